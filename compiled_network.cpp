@@ -0,0 +1,213 @@
+#include "compiled_network.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+static_assert(sizeof(CompiledHeader) == 120, "CompiledHeader must not have padding");
+
+static bool isLittleEndian() {
+    const uint32_t one = 1;
+    char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+static uint64_t alignTo8(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+//The 32-bit fields of the format, throws instead of writing a truncated value
+static uint32_t checkedUint32(uint64_t value, const char* what) {
+    if (value > UINT32_MAX)
+        throw std::runtime_error(std::string("The network is too big for a compiled network: ") + what + " do not fit in 32 bits");
+    return static_cast<uint32_t>(value);
+}
+
+bool isCompiledNetwork(std::string_view data) {
+    return data.size() >= sizeof(COMPILED_MAGIC) && std::memcmp(data.data(), COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) == 0;
+}
+
+void writeCompiledNetwork(const BayesianNetwork& network, std::ostream& out) {
+    if (!isLittleEndian())
+        throw std::runtime_error("Compiled networks are only supported on little endian machines");
+
+    std::string strings;
+    auto addString = [&](std::string_view text) {
+        CompiledString ref{checkedUint32(strings.size(), "the offsets of the names"), checkedUint32(text.size(), "the lengths of the names")};
+        strings += text;
+        return ref;
+    };
+
+    const NetworkLayout& layout = network.getLayout();
+    const size_t n = layout.size();
+    std::vector<CompiledString> names, values;
+    std::vector<uint64_t> cardinalities, parent_offsets{0}, cpt_offsets{0};
+    std::vector<uint32_t> parents;
+    for (VarId id = 0; id < n; ++id) {
+        names.push_back(addString(network.getVariableName(id)));
+        cardinalities.push_back(layout.cardinalities[id]);
+        for (size_t value = 0; value < layout.cardinalities[id]; ++value) values.push_back(addString(network.getValueName(id, value)));
+        for (VarId parent : layout.parentsOf(id)) parents.push_back(parent);
+        parent_offsets.push_back(parents.size());
+        cpt_offsets.push_back(cpt_offsets.back() + layout.cptOf(id).size());
+    }
+
+    CompiledHeader header{};
+    std::memcpy(header.magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+    header.version = COMPILED_VERSION;
+    header.variableCount = static_cast<uint32_t>(n);
+    header.valueCount = values.size();
+    header.parentCount = parents.size();
+    header.tableSize = cpt_offsets.back();
+    header.networkName = addString(network.getName());
+    header.stringBytes = strings.size();
+
+    uint64_t offset = sizeof(CompiledHeader);
+    auto placeSection = [&](uint64_t& sectionOffset, uint64_t bytes) {
+        sectionOffset = offset;
+        offset = alignTo8(offset + bytes);
+    };
+    placeSection(header.namesOffset, names.size() * sizeof(CompiledString));
+    placeSection(header.valuesOffset, values.size() * sizeof(CompiledString));
+    placeSection(header.cardinalitiesOffset, cardinalities.size() * sizeof(uint64_t));
+    placeSection(header.parentOffsetsOffset, parent_offsets.size() * sizeof(uint64_t));
+    placeSection(header.parentsOffset, parents.size() * sizeof(uint32_t));
+    placeSection(header.cptOffsetsOffset, cpt_offsets.size() * sizeof(uint64_t));
+    placeSection(header.tablesOffset, header.tableSize * sizeof(double));
+    header.stringsOffset = offset;
+
+    uint64_t position = 0;
+    auto write = [&](const void* data, uint64_t bytes) {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        position += bytes;
+    };
+    auto padTo = [&](uint64_t target) {
+        const char zeros[8] = {};
+        write(zeros, target - position);
+    };
+
+    write(&header, sizeof(header));
+    write(names.data(), names.size() * sizeof(CompiledString));
+    padTo(header.valuesOffset);
+    write(values.data(), values.size() * sizeof(CompiledString));
+    padTo(header.cardinalitiesOffset);
+    write(cardinalities.data(), cardinalities.size() * sizeof(uint64_t));
+    padTo(header.parentOffsetsOffset);
+    write(parent_offsets.data(), parent_offsets.size() * sizeof(uint64_t));
+    padTo(header.parentsOffset);
+    write(parents.data(), parents.size() * sizeof(uint32_t));
+    padTo(header.cptOffsetsOffset);
+    write(cpt_offsets.data(), cpt_offsets.size() * sizeof(uint64_t));
+    padTo(header.tablesOffset);
+    for (VarId id = 0; id < n; ++id) {
+        const Span<double> table = layout.cptOf(id);
+        write(table.begin(), table.size() * sizeof(double));
+    }
+    padTo(header.stringsOffset);
+    write(strings.data(), strings.size());
+
+    if (!out)
+        throw std::runtime_error("Error writing the compiled network");
+}
+
+/*
+The count records of type T starting at offset, read in place.
+Throws if they are not all inside data, which is aligned to 8 bytes like every section.
+*/
+template <typename T>
+static const T* section(std::string_view data, uint64_t offset, uint64_t count) {
+    if (offset > data.size() || count > (data.size() - offset) / sizeof(T) || offset % 8 != 0)
+        throw std::runtime_error("Corrupted compiled network: a section ends after the file");
+    return reinterpret_cast<const T*>(data.data() + offset);
+}
+
+//Throws unless offsets[0 ... count] goes from 0 to last without ever decreasing
+static void checkOffsets(const uint64_t* offsets, uint64_t count, uint64_t last, const char* what) {
+    bool valid = offsets[0] == 0 && offsets[count] == last;
+    for (uint64_t i = 0; i < count && valid; ++i) valid = offsets[i] <= offsets[i + 1];
+    if (!valid)
+        throw std::runtime_error(std::string("Corrupted compiled network: wrong offsets of the ") + what);
+}
+
+std::unique_ptr<BayesianNetwork> readCompiledNetwork(std::string_view data, std::shared_ptr<const void> owner) {
+    if (!isCompiledNetwork(data) || data.size() < sizeof(CompiledHeader))
+        throw std::runtime_error("Not a compiled network");
+    if (!isLittleEndian() || sizeof(size_t) != sizeof(uint64_t))
+        throw std::runtime_error("Compiled networks are only supported on little endian machines with a 64-bit size_t");
+    if (reinterpret_cast<uintptr_t>(data.data()) % 8 != 0)
+        throw std::runtime_error("A compiled network must be read from an address aligned to 8 bytes");
+
+    CompiledHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.version != COMPILED_VERSION)
+        throw std::runtime_error("Unsupported compiled network version " + std::to_string(header.version));
+
+    const uint64_t n = header.variableCount;
+    const auto* names = section<CompiledString>(data, header.namesOffset, n);
+    const auto* values = section<CompiledString>(data, header.valuesOffset, header.valueCount);
+    const auto* cardinalities = section<uint64_t>(data, header.cardinalitiesOffset, n);
+    const auto* parent_offsets = section<uint64_t>(data, header.parentOffsetsOffset, n + 1);
+    const auto* parents = section<uint32_t>(data, header.parentsOffset, header.parentCount);
+    const auto* cpt_offsets = section<uint64_t>(data, header.cptOffsetsOffset, n + 1);
+    const auto* tables = section<double>(data, header.tablesOffset, header.tableSize);
+    const std::string_view strings = data.substr(std::min<uint64_t>(header.stringsOffset, data.size()));
+    if (header.stringsOffset > data.size() || header.stringBytes > strings.size())
+        throw std::runtime_error("Corrupted compiled network: a section ends after the file");
+
+    checkOffsets(parent_offsets, n, header.parentCount, "parents");
+    checkOffsets(cpt_offsets, n, header.tableSize, "tables");
+    for (uint64_t k = 0; k < header.parentCount; ++k)
+        if (parents[k] >= n)
+            throw std::runtime_error("Corrupted compiled network: unknown parent");
+
+    auto getString = [&](CompiledString ref) {
+        if (ref.offset > header.stringBytes || ref.length > header.stringBytes - ref.offset)
+            throw std::runtime_error("Corrupted compiled network: a name ends after the strings");
+        return strings.substr(ref.offset, ref.length);
+    };
+
+    SymbolTable symbols;
+    NetworkLayout layout;
+    layout.valueOffsets.push_back(0);
+    for (VarId id = 0; id < n; ++id) {
+        layout.names.push_back(symbols.intern(getString(names[id])));
+        const uint64_t card = cardinalities[id];
+        if (card == 0 || card > header.valueCount - layout.values.size())
+            throw std::runtime_error("Corrupted compiled network: a domain ends after the values");
+        for (uint64_t i = 0; i < card; ++i) layout.values.push_back(symbols.intern(getString(values[layout.values.size()])));
+        layout.valueOffsets.push_back(layout.values.size());
+    }
+    if (layout.values.size() != header.valueCount)
+        throw std::runtime_error("Corrupted compiled network: values without a variable");
+
+    //A CPT has an entry for each value of the variable and of its parents; the product stops
+    //as soon as it is bigger than the table, so a corrupt cardinality cannot overflow it
+    for (VarId id = 0; id < n; ++id) {
+        const uint64_t table_size = cpt_offsets[id + 1] - cpt_offsets[id];
+        uint64_t expected_size = cardinalities[id];
+        for (uint64_t k = parent_offsets[id]; k < parent_offsets[id + 1] && expected_size <= table_size; ++k) {
+            const uint64_t card = cardinalities[parents[k]];
+            expected_size = expected_size > table_size / card ? table_size + 1 : expected_size * card;
+        }
+        if (expected_size != table_size)
+            throw std::runtime_error("Corrupted compiled network: wrong table size for " + std::string(symbols.name(layout.names[id])));
+        layout.cptData.push_back(tables + cpt_offsets[id]);
+        layout.cptSizes.push_back(table_size);
+    }
+
+    layout.cardinalities = Span<size_t>(reinterpret_cast<const size_t*>(cardinalities), reinterpret_cast<const size_t*>(cardinalities) + n);
+    layout.parentOffsets = Span<size_t>(reinterpret_cast<const size_t*>(parent_offsets), reinterpret_cast<const size_t*>(parent_offsets) + n + 1);
+    layout.parents = Span<VarId>(parents, parents + header.parentCount);
+    layout.storage = std::move(owner);
+    return std::make_unique<BayesianNetwork>(std::string(getString(header.networkName)), std::move(symbols), std::move(layout));
+}
+
+std::unique_ptr<BayesianNetwork> readCompiledNetwork(std::istream& input) {
+    auto data = std::make_shared<std::string>();
+    char buffer[1 << 16];
+    while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0)
+        data->append(buffer, static_cast<size_t>(input.gcount()));
+    return readCompiledNetwork(*data, data);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "parser.h"
+#include "variable_elimination.h"
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string_view>
+
+/*
+    A binary file with everything BayesianNetwork needs, loaded without any lexing or parsing.
+    All the integers are little endian, every section starts at an offset aligned to 8 bytes
+    and is a plain array in the layout of the NetworkLayout array it fills, so the sections of
+    a mapped file are read in place: the network points at them instead of copying them.
+
+        CompiledHeader
+        CompiledString    names[variableCount]          in VarId order
+        CompiledString    values[valueCount]            the domains, one after the other
+        uint64_t          cardinalities[variableCount]  NetworkLayout::cardinalities
+        uint64_t          parentOffsets[variableCount + 1]
+        uint32_t          parents[parentCount]          NetworkLayout::parents, the VarIds of the parents
+        uint64_t          cptOffsets[variableCount + 1] where the CPT of each variable starts in tables
+        double            tables[tableSize]             the CPTs, each in the layout of NetworkLayout::cptOf
+        char              strings[stringBytes]          the names, referenced by CompiledString
+
+    A loader refuses files with a different version, so the layout can change in the future.
+*/
+static constexpr char COMPILED_MAGIC[8] = {'\x89', 'B', 'N', 'C', '\r', '\n', '\x1a', '\n'};
+static constexpr uint32_t COMPILED_VERSION = 2;
+
+struct CompiledString {
+    uint32_t offset; //in the strings section
+    uint32_t length;
+};
+
+struct CompiledHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t variableCount;
+    uint64_t valueCount;
+    uint64_t parentCount;
+    uint64_t tableSize;
+    uint64_t stringBytes;
+    CompiledString networkName;
+    uint64_t namesOffset;
+    uint64_t valuesOffset;
+    uint64_t cardinalitiesOffset;
+    uint64_t parentOffsetsOffset;
+    uint64_t parentsOffset;
+    uint64_t cptOffsetsOffset;
+    uint64_t tablesOffset;
+    uint64_t stringsOffset;
+};
+
+//True when data starts with COMPILED_MAGIC, the first byte alone is never the start of a BIF file
+bool isCompiledNetwork(std::string_view data);
+
+void writeCompiledNetwork(const BayesianNetwork& network, std::ostream& out);
+
+/*
+    The network of a compiled file, read in place: its cardinalities, parents and CPTs stay in data,
+    which must start at an address aligned to 8 bytes (a mapping or a heap buffer does).
+    The network keeps owner, e.g. the MappedFile of data, alive as long as it exists.
+    Throws std::runtime_error if data is not a valid compiled network of this version.
+*/
+std::unique_ptr<BayesianNetwork> readCompiledNetwork(std::string_view data, std::shared_ptr<const void> owner);
+//Reads the whole stream into a buffer, which the network keeps
+std::unique_ptr<BayesianNetwork> readCompiledNetwork(std::istream& input);
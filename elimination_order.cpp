@@ -0,0 +1,257 @@
+#include "elimination_order.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+EliminationHeuristic parseEliminationHeuristic(const std::string& name) {
+    if (name == "min-degree") return EliminationHeuristic::MIN_DEGREE;
+    if (name == "min-fill") return EliminationHeuristic::MIN_FILL;
+    if (name == "weighted-min-fill") return EliminationHeuristic::WEIGHTED_MIN_FILL;
+    throw std::runtime_error("Unknown elimination heuristic " + name);
+}
+
+std::string toString(EliminationHeuristic heuristic) {
+    switch (heuristic) {
+        case EliminationHeuristic::MIN_DEGREE: return "min-degree";
+        case EliminationHeuristic::MIN_FILL: return "min-fill";
+        case EliminationHeuristic::WEIGHTED_MIN_FILL: return "weighted-min-fill";
+    }
+    return "unknown";
+}
+
+static size_t saturatingMultiply(size_t a, size_t b) {
+    if (a != 0 && b > std::numeric_limits<size_t>::max() / a)
+        return std::numeric_limits<size_t>::max();
+    return a * b;
+}
+
+static size_t saturatingAdd(size_t a, size_t b) {
+    return a > std::numeric_limits<size_t>::max() - b ? std::numeric_limits<size_t>::max() : a + b;
+}
+
+//The memory of a table of entries values of valueBytes each
+static size_t tableBytes(const TableMemory& memory, size_t entries, size_t valueBytes) {
+    const size_t bytes = saturatingMultiply(entries, valueBytes);
+    if (!memory.allocationBytes || bytes == std::numeric_limits<size_t>::max()) return bytes;
+    return memory.allocationBytes(bytes);
+}
+
+static size_t scopeSize(const std::vector<VarId>& scope, const std::vector<size_t>& cardinalities) {
+    size_t size = 1;
+    for (VarId var : scope) size = saturatingMultiply(size, cardinalities[var]);
+    return size;
+}
+
+EliminationOrderPlanner::EliminationOrderPlanner(EliminationHeuristic heuristic)
+    : heuristic(heuristic) {}
+
+double EliminationOrderPlanner::score(VarId var, const std::vector<std::set<VarId>>& graph, const std::vector<size_t>& cardinalities) const {
+    const std::set<VarId>& neighbours = graph[var];
+    if (heuristic == EliminationHeuristic::MIN_DEGREE)
+        return static_cast<double>(neighbours.size());
+
+    double fill = 0;
+    for (auto u = neighbours.begin(); u != neighbours.end(); ++u) {
+        for (auto w = std::next(u); w != neighbours.end(); ++w) {
+            if (graph[*u].count(*w)) continue;
+            if (heuristic == EliminationHeuristic::MIN_FILL) fill += 1;
+            else fill += static_cast<double>(cardinalities[*u]) * static_cast<double>(cardinalities[*w]);
+        }
+    }
+    return fill;
+}
+
+EliminationPlan EliminationOrderPlanner::plan(const std::vector<std::vector<VarId>>& factorScopes,
+                                              const std::vector<size_t>& cardinalities,
+                                              const std::vector<VarId>& toEliminate,
+                                              const TableMemory& memory) const {
+    //Every factor is a clique of the interaction graph
+    std::vector<std::set<VarId>> graph(cardinalities.size());
+    for (const auto& scope : factorScopes)
+        for (VarId u : scope)
+            for (VarId w : scope)
+                if (u != w) graph[u].insert(w);
+
+    std::vector<bool> pending(cardinalities.size(), false);
+    for (VarId var : toEliminate) pending[var] = true;
+
+    std::vector<double> scores(cardinalities.size(), 0);
+    for (VarId var : toEliminate) scores[var] = score(var, graph, cardinalities);
+
+    EliminationPlan plan;
+    plan.order.reserve(toEliminate.size());
+    plan.cliques.reserve(toEliminate.size());
+
+    for (size_t step = 0; step < toEliminate.size(); ++step) {
+        VarId best = 0;
+        bool found = false;
+        for (VarId var : toEliminate) {
+            if (!pending[var]) continue;
+            if (!found || scores[var] < scores[best] || (scores[var] == scores[best] && var < best)) {
+                best = var;
+                found = true;
+            }
+        }
+
+        const std::set<VarId> neighbours = graph[best];
+        size_t clique_size = cardinalities[best];
+        for (VarId u : neighbours) clique_size = saturatingMultiply(clique_size, cardinalities[u]);
+        plan.inducedWidth = std::max(plan.inducedWidth, neighbours.size());
+        plan.maxFactorSize = std::max(plan.maxFactorSize, clique_size);
+        plan.order.push_back(best);
+        std::vector<VarId> clique(neighbours.begin(), neighbours.end());
+        clique.insert(std::lower_bound(clique.begin(), clique.end(), best), best);
+        plan.cliques.push_back(std::move(clique));
+        pending[best] = false;
+
+        //Connect the neighbours with each other and remove the eliminated variable
+        for (VarId u : neighbours) {
+            graph[u].erase(best);
+            for (VarId w : neighbours)
+                if (u != w) graph[u].insert(w);
+        }
+        graph[best].clear();
+
+        //Only the neighbours and their neighbours can have a different score now
+        std::set<VarId> dirty(neighbours.begin(), neighbours.end());
+        for (VarId u : neighbours) dirty.insert(graph[u].begin(), graph[u].end());
+        for (VarId var : dirty)
+            if (pending[var]) scores[var] = score(var, graph, cardinalities);
+    }
+    estimate(plan, factorScopes, cardinalities, memory);
+    return plan;
+}
+
+void EliminationOrderPlanner::estimate(EliminationPlan& plan, const std::vector<std::vector<VarId>>& factorScopes,
+                                       const std::vector<size_t>& cardinalities, const TableMemory& memory) {
+    /*
+    The factors multiplied by step i are the ones containing order[i], whose scopes make up cliques[i].
+    So a factor is freed by the first step eliminating one of its variables, freed[i] are the entries
+    released after step i (freed[steps] are never released), and converted[i] the bytes of the copies
+    of the initial factors which only live during step i (step steps is the final product).
+    */
+    const size_t steps = plan.order.size();
+    std::vector<size_t> position(cardinalities.size(), steps);
+    for (size_t i = 0; i < steps; ++i) position[plan.order[i]] = i;
+    //The first step from the from-th on eliminating a variable of scope
+    auto firstUse = [&](const std::vector<VarId>& scope, size_t from) {
+        size_t first = steps;
+        for (VarId var : scope)
+            if (position[var] >= from) first = std::min(first, position[var]);
+        return first;
+    };
+
+    std::vector<size_t> freed(steps + 1, 0), freed_bytes(steps + 1, 0), converted(steps + 1, 0);
+    size_t live_entries = 0, live_bytes = 0;
+    std::vector<bool> remaining(cardinalities.size(), false);
+    size_t result_entries = 1; //of the product of the factors left at the end
+    for (size_t f = 0; f < factorScopes.size(); ++f) {
+        const size_t size = scopeSize(factorScopes[f], cardinalities);
+        const size_t first = firstUse(factorScopes[f], 0);
+        for (VarId var : factorScopes[f]) {
+            if (position[var] < steps || remaining[var]) continue;
+            remaining[var] = true;
+            result_entries = saturatingMultiply(result_entries, cardinalities[var]);
+        }
+        if (memory.convertsInitial) converted[first] = saturatingAdd(converted[first], tableBytes(memory, size, memory.valueBytes));
+        if (f >= memory.allocated.size() || !memory.allocated[f]) continue;
+        const size_t bytes = tableBytes(memory, size, sizeof(double));
+        live_entries = saturatingAdd(live_entries, size);
+        live_bytes = saturatingAdd(live_bytes, bytes);
+        freed[first] = saturatingAdd(freed[first], size);
+        freed_bytes[first] = saturatingAdd(freed_bytes[first], bytes);
+    }
+
+    plan.totalWork = 0;
+    plan.peakEntries = live_entries;
+    plan.peakBytes = live_bytes;
+    for (size_t i = 0; i < steps; ++i) {
+        const VarId var = plan.order[i];
+        const std::vector<VarId>& clique = plan.cliques[i];
+        plan.totalWork = saturatingAdd(plan.totalWork, scopeSize(clique, cardinalities));
+        size_t output_entries = 1;
+        for (VarId u : clique)
+            if (u != var) output_entries = saturatingMultiply(output_entries, cardinalities[u]);
+        const size_t output_bytes = tableBytes(memory, output_entries, memory.valueBytes);
+
+        //The inputs are freed only after the result is complete
+        plan.peakEntries = std::max(plan.peakEntries, saturatingAdd(live_entries, output_entries));
+        plan.peakBytes = std::max(plan.peakBytes, saturatingAdd(saturatingAdd(live_bytes, converted[i]), output_bytes));
+        live_entries = saturatingAdd(live_entries - std::min(live_entries, freed[i]), output_entries);
+        live_bytes = saturatingAdd(live_bytes - std::min(live_bytes, freed_bytes[i]), output_bytes);
+        const size_t next = firstUse(clique, i + 1);
+        freed[next] = saturatingAdd(freed[next], output_entries);
+        freed_bytes[next] = saturatingAdd(freed_bytes[next], output_bytes);
+    }
+    const size_t result_bytes = saturatingMultiply(tableBytes(memory, result_entries, memory.valueBytes), 2);
+    plan.peakBytes = std::max(plan.peakBytes, saturatingAdd(saturatingAdd(live_bytes, converted[steps]), result_bytes));
+}
+
+EliminationPlan EliminationOrderPlanner::planWithinBudget(const std::vector<std::vector<VarId>>& factorScopes,
+                                                          const std::vector<size_t>& cardinalities,
+                                                          const std::vector<VarId>& toEliminate,
+                                                          size_t maxBytes, const TableMemory& memory) const {
+    std::vector<bool> in_cutset(cardinalities.size(), false);
+    std::vector<VarId> cutset;
+    size_t subproblems = 1;
+    while (true) {
+        //The factors over cutset variables are sliced for every sub-problem, so they take memory too
+        std::vector<std::vector<VarId>> scopes;
+        std::vector<bool> sliced;
+        for (const auto& scope : factorScopes) {
+            scopes.emplace_back();
+            for (VarId var : scope)
+                if (!in_cutset[var]) scopes.back().push_back(var);
+            sliced.push_back(scopes.back().size() < scope.size());
+        }
+        std::vector<VarId> rest;
+        for (VarId var : toEliminate)
+            if (!in_cutset[var]) rest.push_back(var);
+
+        //The sub-problems add up their results over the variables left in one more table
+        TableMemory sliced_memory = memory;
+        size_t resident = 0;
+        if (!cutset.empty()) {
+            sliced_memory.allocated = sliced;
+            for (size_t f = 0; f < factorScopes.size(); ++f)
+                if (f < memory.allocated.size() && memory.allocated[f])
+                    resident = saturatingAdd(resident, tableBytes(memory, scopeSize(factorScopes[f], cardinalities), sizeof(double)));
+            std::vector<bool> eliminated(cardinalities.size(), false);
+            for (VarId var : toEliminate) eliminated[var] = true;
+            std::vector<bool> counted(cardinalities.size(), false);
+            size_t result_entries = 1;
+            for (const auto& scope : factorScopes)
+                for (VarId var : scope) {
+                    if (eliminated[var] || counted[var]) continue;
+                    counted[var] = true;
+                    result_entries = saturatingMultiply(result_entries, cardinalities[var]);
+                }
+            resident = saturatingAdd(resident, tableBytes(memory, result_entries, memory.valueBytes));
+        }
+
+        EliminationPlan result = plan(scopes, cardinalities, rest, sliced_memory);
+        result.peakBytes = saturatingAdd(result.peakBytes, resident);
+        result.cutset = cutset;
+        result.subproblems = subproblems;
+        result.totalWork = saturatingMultiply(result.totalWork, subproblems);
+        if (result.peakBytes <= maxBytes || rest.empty()) return result;
+
+        std::vector<double> weight(cardinalities.size(), 0);
+        for (const auto& clique : result.cliques) {
+            const double size = static_cast<double>(scopeSize(clique, cardinalities));
+            for (VarId var : clique) weight[var] += size;
+        }
+        VarId best = rest[0];
+        for (VarId var : rest) {
+            if (weight[var] > weight[best] || (weight[var] == weight[best] &&
+                (cardinalities[var] < cardinalities[best] || (cardinalities[var] == cardinalities[best] && var < best))))
+                best = var;
+        }
+        if (saturatingMultiply(subproblems, cardinalities[best]) > MAX_SUBPROBLEMS) return result;
+        in_cutset[best] = true;
+        cutset.push_back(best);
+        subproblems *= cardinalities[best];
+    }
+}
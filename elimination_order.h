@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+//Dense integer identifier of a variable, it is the position of the variable in the arrays of NetworkLayout
+typedef uint32_t VarId;
+
+/*
+    The heuristics used to choose the next variable to eliminate.
+    All of them are greedy: at each step they pick the variable with the lowest score
+    in the current interaction graph, ties are broken by the smallest VarId.
+        - MIN_DEGREE: number of neighbours of the variable
+        - MIN_FILL: number of edges that eliminating the variable adds between its neighbours
+        - WEIGHTED_MIN_FILL: like MIN_FILL, but every added edge (u, w) costs card(u) * card(w)
+*/
+enum class EliminationHeuristic { MIN_DEGREE, MIN_FILL, WEIGHTED_MIN_FILL };
+
+//Accepts "min-degree", "min-fill" and "weighted-min-fill", throws otherwise
+EliminationHeuristic parseEliminationHeuristic(const std::string& name);
+std::string toString(EliminationHeuristic heuristic);
+
+struct EliminationPlan {
+    std::vector<VarId> order;
+    size_t inducedWidth = 0;  //size of the largest clique formed during elimination, minus one
+    size_t maxFactorSize = 0; //number of entries of the largest product factor, saturated at SIZE_MAX
+
+    /*
+    The pre-flight estimate of the elimination, made on the scopes before any table is allocated.
+    A step multiplies its factors and sums its variable out in one pass, so it computes one term
+    for every entry of its clique but only stores the result. Both are saturated at SIZE_MAX.
+        - totalWork: the terms computed by all the steps (of all the sub-problems, see cutset)
+        - peakEntries: the most entries of the factors alive at the same time; the initial factors are
+          views of the CPTs (or small evidence slices of them) and are only counted when sliced on a cutset.
+        - peakBytes: the memory of those factors as allocated, see TableMemory, which also counts the
+          copies of the initial factors made in the value modes other than double. The plan of a
+          BayesianNetwork query also covers the check of its pruned evidence, which comes before.
+    */
+    size_t totalWork = 0;
+    size_t peakEntries = 0;
+    size_t peakBytes = 0;
+
+    //Variables conditioned on: order is eliminated once for each of the subproblems assignments of them
+    std::vector<VarId> cutset;
+    size_t subproblems = 1;
+
+    //cliques[i] is order[i] together with its neighbours at the time it is eliminated, sorted by VarId
+    std::vector<std::vector<VarId>> cliques;
+};
+
+/*
+    How an elimination allocates its tables, for EliminationPlan::peakBytes.
+    The results of the steps have valueBytes per entry; the initial factors with allocated[f] set
+    (evidence slices, slices on a cutset) are double and freed by their first step, the others are views.
+    With convertsInitial every step also copies its initial factors to values of valueBytes, freed
+    when the step ends. The variables left at the end are multiplied into the result, which is
+    copied once more. allocationBytes gives the memory the allocator takes for a request
+    (see FactorArena::bufferBytes), the bytes themselves when it is empty.
+*/
+struct TableMemory {
+    size_t valueBytes = sizeof(double);
+    bool convertsInitial = false;
+    std::vector<bool> allocated;
+    std::function<size_t(size_t)> allocationBytes;
+};
+
+/*
+    The planner works on the interaction graph of a set of factors: two variables are neighbours
+    if some factor contains both. For the CPTs of a network this is exactly the moral graph.
+    It simulates the elimination on the graph only, without touching any table, so it can
+    predict the size of every intermediate factor before the real elimination starts.
+*/
+class EliminationOrderPlanner {
+public:
+    static constexpr size_t MAX_SUBPROBLEMS = size_t(1) << 24;
+
+    EliminationOrderPlanner(EliminationHeuristic heuristic = EliminationHeuristic::MIN_FILL);
+
+    /*
+    factorScopes are the variables of each factor, cardinalities is indexed by VarId
+    and toEliminate are the variables the plan must order.
+    */
+    EliminationPlan plan(const std::vector<std::vector<VarId>>& factorScopes,
+                         const std::vector<size_t>& cardinalities,
+                         const std::vector<VarId>& toEliminate,
+                         const TableMemory& memory = TableMemory()) const;
+
+    /*
+    A plan whose peakBytes is at most maxBytes, conditioning on a cutset when the plain one is bigger.
+    The initial factors are kept for all the sub-problems, and the ones sliced on the cutset are allocated.
+    Fixing the value of a variable removes it from every scope, so each of its values gives a smaller
+    elimination, and they run one after the other: memory is traded for time.
+    The variables of toEliminate join the cutset one at a time, choosing the one in the biggest cliques
+    of the current plan (the sum of their sizes), with ties to the smallest cardinality and then VarId,
+    until the plan fits. If it never does, or it would need more than MAX_SUBPROBLEMS sub-problems,
+    the last plan is returned, with peakBytes over maxBytes.
+    */
+    EliminationPlan planWithinBudget(const std::vector<std::vector<VarId>>& factorScopes,
+                                     const std::vector<size_t>& cardinalities,
+                                     const std::vector<VarId>& toEliminate,
+                                     size_t maxBytes, const TableMemory& memory = TableMemory()) const;
+
+private:
+    EliminationHeuristic heuristic;
+
+    //Fills totalWork, peakEntries and peakBytes replaying the order of plan on factorScopes
+    static void estimate(EliminationPlan& plan, const std::vector<std::vector<VarId>>& factorScopes,
+                         const std::vector<size_t>& cardinalities, const TableMemory& memory);
+
+    double score(VarId var, const std::vector<std::set<VarId>>& graph, const std::vector<size_t>& cardinalities) const;
+};
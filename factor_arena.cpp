@@ -0,0 +1,96 @@
+#include "factor_arena.h"
+
+#include <algorithm>
+#include <new>
+
+FactorArena::FactorArena(size_t blockSize)
+    : blockSize(std::max(blockSize, MIN_BUFFER)) {}
+
+FactorArena::~FactorArena() {
+    for (const Block& block : blocks) freeAligned(block.data);
+}
+
+size_t FactorArena::sizeClass(size_t bytes) {
+    size_t k = 0;
+    while ((MIN_BUFFER << k) < bytes) ++k;
+    return k;
+}
+
+char* FactorArena::allocateAligned(size_t bytes) {
+    return static_cast<char*>(::operator new(bytes, std::align_val_t(ALIGNMENT)));
+}
+
+void FactorArena::freeAligned(char* pointer) {
+    ::operator delete(pointer, std::align_val_t(ALIGNMENT));
+}
+
+size_t FactorArena::bufferBytes(size_t bytes) const {
+    return bytes > blockSize ? bytes : MIN_BUFFER << sizeClass(bytes);
+}
+
+void* FactorArena::allocate(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++stats.allocations;
+
+    if (bytes > blockSize) {
+        char* pointer = allocateAligned(bytes);
+        liveBytes += bytes;
+        stats.reservedBytes += bytes;
+        stats.peakBytes = std::max(stats.peakBytes, liveBytes);
+        return pointer;
+    }
+
+    const size_t k = sizeClass(bytes);
+    const size_t size = MIN_BUFFER << k;
+    liveBytes += size;
+    stats.peakBytes = std::max(stats.peakBytes, liveBytes);
+
+    if (k < freeLists.size() && !freeLists[k].empty()) {
+        void* pointer = freeLists[k].back();
+        freeLists[k].pop_back();
+        return pointer;
+    }
+
+    //The tail of a block too short for this buffer is left unused until the next reset
+    while (currentBlock < blocks.size() && blocks[currentBlock].size - blockOffset < size) {
+        ++currentBlock;
+        blockOffset = 0;
+    }
+    if (currentBlock == blocks.size()) {
+        blocks.push_back({allocateAligned(blockSize), blockSize});
+        stats.reservedBytes += blockSize;
+    }
+    void* pointer = blocks[currentBlock].data + blockOffset;
+    blockOffset += size;
+    return pointer;
+}
+
+void FactorArena::deallocate(void* pointer, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (bytes > blockSize) {
+        freeAligned(static_cast<char*>(pointer));
+        liveBytes -= bytes;
+        stats.reservedBytes -= bytes;
+        return;
+    }
+
+    const size_t k = sizeClass(bytes);
+    if (k >= freeLists.size()) freeLists.resize(k + 1);
+    freeLists[k].push_back(pointer);
+    liveBytes -= MIN_BUFFER << k;
+}
+
+void FactorArena::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& list : freeLists) list.clear();
+    currentBlock = 0;
+    blockOffset = 0;
+    liveBytes = 0;
+    stats.allocations = 0;
+    stats.peakBytes = 0;
+}
+
+AllocationStats FactorArena::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+//Allocations made through a FactorArena during one query
+struct AllocationStats {
+    size_t allocations = 0;
+    size_t peakBytes = 0;     //largest amount of memory handed out at the same time
+    size_t reservedBytes = 0; //memory the arena holds, including the blocks kept from earlier queries
+};
+
+/*
+    The memory of the factor tables of one query.
+    Small buffers (up to blockSize) are rounded up to a power of two and carved from big blocks;
+    a released buffer goes to the free list of its size, so the next factor of that size reuses it.
+    Bigger buffers get their own allocation, freed as soon as they are released.
+    reset() forgets every buffer at once but keeps the blocks, so later queries do not ask the
+    system for memory again. Every buffer must have been released before calling it.
+    All the functions are thread safe, the parallel elimination allocates from several threads.
+*/
+class FactorArena {
+public:
+    explicit FactorArena(size_t blockSize = 1 << 20);
+    ~FactorArena();
+
+    FactorArena(const FactorArena&) = delete;
+    FactorArena& operator=(const FactorArena&) = delete;
+
+    void* allocate(size_t bytes);
+    void deallocate(void* pointer, size_t bytes);
+    //The memory allocate(bytes) takes: bytes rounded up to a buffer size, or bytes itself above blockSize
+    size_t bufferBytes(size_t bytes) const;
+
+    //Also clears the counters of allocations and peak bytes
+    void reset();
+    AllocationStats getStats() const;
+
+private:
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t MIN_BUFFER = 64;
+
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    size_t currentBlock = 0; //blocks before it are full
+    size_t blockOffset = 0;  //first free byte of the current block
+    std::vector<std::vector<void*>> freeLists; //freeLists[k] holds released buffers of MIN_BUFFER << k bytes
+
+    size_t liveBytes = 0;
+    AllocationStats stats;
+    mutable std::mutex mutex;
+
+    static size_t sizeClass(size_t bytes);
+    static char* allocateAligned(size_t bytes);
+    static void freeAligned(char* pointer);
+};
+
+/*
+    Allocator for the value tables of factors: from arena when it is set, from the heap otherwise.
+    Moving a table keeps its memory, while a copy always goes to the heap, so copies (the factors
+    stored in the cache, the marginals returned to the caller) never point into an arena that
+    is reset at the end of the query.
+*/
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    ArenaAllocator(FactorArena* arena = nullptr) noexcept
+        : arena(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : arena(other.getArena()) {}
+
+    T* allocate(size_t n) {
+        if (arena == nullptr) return std::allocator<T>().allocate(n);
+        return static_cast<T*>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t n) {
+        if (arena == nullptr) std::allocator<T>().deallocate(pointer, n);
+        else arena->deallocate(pointer, n * sizeof(T));
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator();
+    }
+
+    FactorArena* getArena() const { return arena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.getArena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.getArena(); }
+
+private:
+    FactorArena* arena;
+};
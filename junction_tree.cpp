@@ -0,0 +1,209 @@
+#include "junction_tree.h"
+
+#include <algorithm>
+
+JunctionTree::JunctionTree(const BayesianNetwork& network, EliminationHeuristic heuristic, const Evidence& evidence)
+    : network(network), observed(network.resolveEvidence(evidence)) {
+    build(heuristic);
+}
+
+static bool isSubset(const std::vector<VarId>& a, const std::vector<VarId>& b) {
+    return std::includes(b.begin(), b.end(), a.begin(), a.end());
+}
+
+void JunctionTree::build(EliminationHeuristic heuristic) {
+    const size_t n_vars = network.getVariableCount();
+    std::vector<Factor> factors = network.buildInitialFactors(std::vector<bool>(n_vars, true), observed);
+
+    std::vector<std::vector<VarId>> scopes;
+    std::vector<size_t> cardinalities(n_vars);
+    std::vector<VarId> unobserved_vars;
+    for (const auto& f : factors)
+        scopes.emplace_back(f.variables.begin(), f.variables.end());
+    for (VarId var = 0; var < n_vars; ++var) {
+        cardinalities[var] = network.getCardinality(var);
+        if (observed[var] == -1) unobserved_vars.push_back(var);
+    }
+
+    EliminationPlan plan = EliminationOrderPlanner(heuristic).plan(scopes, cardinalities, unobserved_vars);
+
+    std::vector<size_t> step_of(n_vars);
+    for (size_t step = 0; step < plan.order.size(); ++step) step_of[plan.order[step]] = step;
+
+    //The parent of the clique of step i is the clique of the first neighbour eliminated after it
+    std::vector<std::vector<VarId>>& sets = plan.cliques;
+    const size_t n_steps = sets.size();
+    std::vector<int> parent(n_steps, -1);
+    for (size_t step = 0; step < n_steps; ++step)
+        for (VarId var : sets[step])
+            if (var != plan.order[step] && (parent[step] == -1 || step_of[var] < static_cast<size_t>(parent[step])))
+                parent[step] = static_cast<int>(step_of[var]);
+
+    /*
+    Merge each clique contained in its parent, or containing it, into the parent slot.
+    The parent always comes later in the order, so it is still alive when its children are checked,
+    and alias lets the children of a merged clique find the slot that replaced it.
+    */
+    std::vector<size_t> alias(n_steps);
+    std::vector<bool> merged(n_steps, false);
+    for (size_t step = 0; step < n_steps; ++step) alias[step] = step;
+    auto find = [&](size_t step) {
+        while (alias[step] != step) step = alias[step] = alias[alias[step]];
+        return step;
+    };
+    for (size_t step = 0; step < n_steps; ++step) {
+        if (parent[step] == -1) continue;
+        const size_t p = static_cast<size_t>(parent[step]);
+        if (isSubset(sets[p], sets[step])) sets[p] = sets[step];
+        else if (!isSubset(sets[step], sets[p])) continue;
+        alias[step] = p;
+        merged[step] = true;
+    }
+
+    std::vector<int> clique_of_step(n_steps, -1);
+    for (size_t step = 0; step < n_steps; ++step) {
+        if (merged[step]) continue;
+        clique_of_step[step] = static_cast<int>(cliques.size());
+        Clique clique;
+        Factor::SizeList cards;
+        for (VarId var : sets[step]) {
+            clique.variables.push_back(var);
+            cards.push_back(cardinalities[var]);
+        }
+        clique.potential = Factor(clique.variables, cards);
+        std::fill(clique.potential.values.begin(), clique.potential.values.end(), 1.0);
+        cliques.push_back(std::move(clique));
+    }
+    for (size_t step = 0; step < n_steps; ++step) {
+        if (merged[step] || parent[step] == -1) continue;
+        const size_t c = static_cast<size_t>(clique_of_step[step]);
+        const size_t p = static_cast<size_t>(clique_of_step[find(static_cast<size_t>(parent[step]))]);
+        cliques[c].parent = static_cast<int>(p);
+        cliques[p].children.push_back(c);
+    }
+
+    //The clique of the first eliminated variable of a CPT contains the whole scope of the CPT.
+    //Factors left without variables by the evidence are constants and do not change any marginal,
+    //unless they are 0 and the evidence is impossible.
+    for (const auto& f : factors) {
+        if (f.variables.empty()) {
+            if (f.values[0] == 0.0) throw std::runtime_error("The evidence has zero probability");
+            continue;
+        }
+        size_t first = n_steps;
+        for (VarId var : f.variables) first = std::min(first, step_of[var]);
+        Clique& clique = cliques[clique_of_step[find(first)]];
+        clique.potential = network.factorProduct(clique.potential, f);
+    }
+
+    cliqueOfVariable.assign(n_vars, 0);
+    std::vector<bool> assigned(n_vars, false);
+    for (size_t c = 0; c < cliques.size(); ++c) {
+        for (VarId var : cliques[c].variables) {
+            if (!assigned[var] || cliques[c].potential.values.size() < cliques[cliqueOfVariable[var]].potential.values.size()) {
+                cliqueOfVariable[var] = c;
+                assigned[var] = true;
+            }
+        }
+    }
+}
+
+Factor::VarList JunctionTree::separatorVariables(size_t a, size_t b) const {
+    Factor::VarList result;
+    for (VarId var : cliques[a].variables)
+        if (std::find(cliques[b].variables.begin(), cliques[b].variables.end(), var) != cliques[b].variables.end())
+            result.push_back(var);
+    return result;
+}
+
+Factor JunctionTree::combineMessages(size_t clique, int excludedChild, bool withParent) const {
+    const Clique& c = cliques[clique];
+    Factor result = c.potential;
+    for (size_t child : c.children)
+        if (static_cast<int>(child) != excludedChild)
+            result = network.factorProduct(result, cliques[child].messageToParent);
+    if (withParent && c.parent != -1)
+        result = network.factorProduct(result, c.messageFromParent);
+    return result;
+}
+
+void JunctionTree::calibrate() {
+    //Pre-order of every tree of the forest, the reverse is a valid order for the collect pass
+    std::vector<size_t> pre_order;
+    std::vector<size_t> stack;
+    for (size_t c = 0; c < cliques.size(); ++c)
+        if (cliques[c].parent == -1) stack.push_back(c);
+    while (!stack.empty()) {
+        size_t c = stack.back();
+        stack.pop_back();
+        pre_order.push_back(c);
+        for (size_t child : cliques[c].children) stack.push_back(child);
+    }
+
+    for (auto it = pre_order.rbegin(); it != pre_order.rend(); ++it) {
+        Clique& c = cliques[*it];
+        if (c.parent == -1) continue;
+        c.messageToParent = network.factorMarginalize(combineMessages(*it, -1, false), separatorVariables(*it, c.parent));
+    }
+
+    for (size_t p : pre_order) {
+        for (size_t child : cliques[p].children) {
+            Factor message = combineMessages(p, static_cast<int>(child), true);
+            cliques[child].messageFromParent = network.factorMarginalize(message, separatorVariables(p, child));
+        }
+    }
+    calibrated = true;
+}
+
+Factor JunctionTree::marginalFromBelief(const Factor& belief, VarId var) const {
+    if (observed[var] != -1) {
+        Factor point({var}, {network.getCardinality(var)});
+        point.values[observed[var]] = 1.0;
+        return point;
+    }
+    Factor marginal = network.factorMarginalize(belief, Factor::VarList{var});
+    marginal.normalize();
+    if (std::all_of(marginal.values.begin(), marginal.values.end(), [](double v) { return v == 0.0; }))
+        throw std::runtime_error("The evidence has zero probability");
+    return marginal;
+}
+
+Factor JunctionTree::getMarginal(VarId var) {
+    if (!calibrated) calibrate();
+    if (observed.at(var) != -1) return marginalFromBelief(Factor(), var);
+    return marginalFromBelief(combineMessages(cliqueOfVariable[var], -1, true), var);
+}
+
+Factor JunctionTree::getMarginal(const std::string& variableName) {
+    return getMarginal(network.getVarId(variableName));
+}
+
+std::vector<Factor> JunctionTree::getAllMarginals() {
+    if (!calibrated) calibrate();
+    const size_t n_vars = network.getVariableCount();
+    std::vector<Factor> marginals(n_vars);
+
+    //Each belief is computed once and shared by all the variables it answers
+    std::vector<std::vector<VarId>> answered_by(cliques.size());
+    for (VarId var = 0; var < n_vars; ++var) {
+        if (observed[var] != -1) marginals[var] = marginalFromBelief(Factor(), var);
+        else answered_by[cliqueOfVariable[var]].push_back(var);
+    }
+
+    for (size_t c = 0; c < cliques.size(); ++c) {
+        if (answered_by[c].empty()) continue;
+        Factor belief = combineMessages(c, -1, true);
+        for (VarId var : answered_by[c]) marginals[var] = marginalFromBelief(belief, var);
+    }
+    return marginals;
+}
+
+size_t JunctionTree::getCliqueCount() const {
+    return cliques.size();
+}
+
+size_t JunctionTree::getMaxCliqueSize() const {
+    size_t max_size = 0;
+    for (const auto& c : cliques) max_size = std::max(max_size, c.potential.values.size());
+    return max_size;
+}
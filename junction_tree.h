@@ -0,0 +1,68 @@
+#pragma once
+
+#include "variable_elimination.h"
+
+/*
+    A junction tree (clique tree) of a Bayesian network.
+    The cliques come from the triangulation done by the elimination order planner:
+    eliminating a variable creates the clique {variable} + {its neighbours}, and its
+    parent is the clique of the first neighbour eliminated after it. Cliques contained in
+    a neighbour are merged into it, so only maximal cliques are left.
+    Every CPT is multiplied into one clique that contains its whole scope.
+    Evidence is applied by slicing the CPTs before they are assigned, so observed variables
+    are not part of any clique and the calibrated beliefs are proportional to P(clique, evidence).
+
+    calibrate() does the two passes of the Shafer-Shenoy message passing:
+        1. collect: every clique sends a message to its parent, from the leaves to the root
+        2. distribute: every clique sends a message to each child, from the root to the leaves
+    The message from i to j is the product of the potential of i with all the messages i received
+    from the other neighbours, summed onto the separator of i and j.
+    After the calibration the belief of each clique is proportional to the joint marginal of its
+    variables, so a single calibration answers the marginal of every variable.
+*/
+class JunctionTree {
+public:
+    JunctionTree(const BayesianNetwork& network, EliminationHeuristic heuristic = EliminationHeuristic::MIN_FILL,
+                 const Evidence& evidence = {});
+
+    void calibrate();
+
+    //Normalized marginal of one variable given the evidence, calibrate() is called first if needed
+    Factor getMarginal(VarId var);
+    Factor getMarginal(const std::string& variableName);
+
+    //getAllMarginals()[id] is the marginal of the variable with that VarId
+    std::vector<Factor> getAllMarginals();
+
+    size_t getCliqueCount() const;
+    size_t getMaxCliqueSize() const; //number of entries of the largest clique potential
+
+private:
+    struct Clique {
+        Factor::VarList variables; //sorted by VarId
+        Factor potential;          //product of the CPTs assigned to the clique
+        int parent = -1;           //-1 for the root of each tree of the forest
+        std::vector<size_t> children;
+        Factor messageToParent;
+        Factor messageFromParent;
+    };
+
+    const BayesianNetwork& network;
+    ObservedValues observed;
+    std::vector<Clique> cliques;
+    std::vector<size_t> cliqueOfVariable; //the smallest clique containing each unobserved variable
+    bool calibrated = false;
+
+    void build(EliminationHeuristic heuristic);
+
+    /*
+    Product of the potential of a clique with the messages it received from its children,
+    except the one from excludedChild (-1 to keep all of them), and, if withParent is true,
+    with the message it received from its parent.
+    */
+    Factor combineMessages(size_t clique, int excludedChild, bool withParent) const;
+    Factor::VarList separatorVariables(size_t a, size_t b) const;
+
+    //Marginal of var from the calibrated belief of a clique, or a point mass if var is observed
+    Factor marginalFromBelief(const Factor& belief, VarId var) const;
+};
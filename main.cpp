@@ -1,74 +1,452 @@
 #include "parser.h"
 #include "variable_elimination.h"
+#include "junction_tree.h"
+#include "simd_kernels.h"
+#include "mapped_file.h"
+#include "compiled_network.h"
+#include "sampling.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <chrono>
+#include <limits>
+#include <sstream>
+#include <type_traits>
 
 //https://www.bnlearn.com/bnrepository/
 //http://www.cs.washington.edu/dm/vfml/appendixes/bif.htm
 
-bool isQueryVariableInNetwork(const NetworkAST& network, const std::string& queryVariableName) {
-    for (const auto& variable : network.variables)
-        if (variable.name == queryVariableName)
-            return true;
-    return false;
+void printMarginal(const BayesianNetwork& bn, const Factor& marginal, std::ostream& out) {
+    const VarId var = marginal.variables[0];
+    for (size_t i = 0; i < marginal.values.size(); ++i) {
+        out << "P(" << bn.getVariableName(var) << " = " << bn.getValueName(var, i) << ") = "
+            << marginal.values[i] << "\n";
+    }
+}
+
+void printAllocations(const AllocationStats& stats, std::ostream& out) {
+    out << "Factor tables: " << stats.allocations << " allocations, peak " << stats.peakBytes << " bytes" << std::endl;
+}
+
+void printSparseStats(const SparseStats& stats, std::ostream& out) {
+    out << "Sparse kernels: " << stats.operations << " operations, " << stats.skipped << " of "
+        << stats.products << " products skipped" << std::endl;
+}
+
+//A number of bytes with an optional K, M or G suffix (powers of 1024), e.g. "512M"
+size_t parseBytes(const std::string& text) {
+    if (text.empty() || text[0] == '-') throw std::runtime_error("Invalid size " + text);
+    size_t end = 0;
+    const size_t value = std::stoul(text, &end);
+    const std::string suffix = text.substr(end);
+    if (suffix.empty()) return value;
+    int shift;
+    if (suffix == "K" || suffix == "k") shift = 10;
+    else if (suffix == "M" || suffix == "m") shift = 20;
+    else if (suffix == "G" || suffix == "g") shift = 30;
+    else throw std::runtime_error("Unknown size suffix " + suffix);
+    if (value > std::numeric_limits<size_t>::max() >> shift) throw std::runtime_error("Size too large " + text);
+    return value << shift;
+}
+
+//One line "variable,value,probability" for each entry of each marginal
+void dumpMarginals(const BayesianNetwork& bn, const std::vector<Factor>& marginals, std::ostream& out) {
+    out << "variable,value,probability\n";
+    for (const auto& marginal : marginals) {
+        const VarId var = marginal.variables[0];
+        for (size_t i = 0; i < marginal.values.size(); ++i)
+            out << bn.getVariableName(var) << "," << bn.getValueName(var, i) << "," << marginal.values[i] << "\n";
+    }
+}
+
+//Each line of a batch file is a query variable followed by its evidence, e.g. "dysp xray=yes smoke=no"
+std::vector<Query> readBatch(std::ifstream& input) {
+    std::vector<Query> queries;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream words(line);
+        Query query;
+        if (!(words >> query.variable)) continue;
+        std::string item;
+        while (words >> item) {
+            size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                throw std::runtime_error("Expected <variable>=<value>, got " + item);
+            query.evidence[item.substr(0, eq)] = item.substr(eq + 1);
+        }
+        queries.push_back(query);
+    }
+    return queries;
+}
+
+/*
+The number after the '=' of a flag such as --threads=4 or --time-budget=2.5, which must be
+the whole value and not negative. Prints which flag was bad and returns false otherwise.
+*/
+template <typename T>
+bool parseNumber(const std::string& arg, T& value) {
+    const size_t eq = arg.find('=');
+    const std::string text = arg.substr(eq + 1);
+    size_t end = 0;
+    try {
+        if (!text.empty() && text[0] != '-') {
+            if constexpr (std::is_floating_point_v<T>) value = static_cast<T>(std::stod(text, &end));
+            else value = static_cast<T>(std::stoull(text, &end));
+        }
+    } catch (const std::exception&) {
+        end = 0;
+    }
+    if (end == 0 || end != text.size()) {
+        std::cerr << "Invalid value for " << arg.substr(0, eq) << ": " << text << std::endl;
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char* argv[]) {
     std::string filename;
     std::string queryVariableName;
+    std::string dumpFilename;
+    std::string batchFilename;
+    std::string compileFilename;
+    EliminationHeuristic heuristic = EliminationHeuristic::MIN_FILL;
+    bool allMarginals = false;
+    size_t threads = 1;
+    size_t parallelThreshold = 0; //0 keeps the default of BayesianNetwork
+    double sparseThreshold = -1;  //negative keeps the default of BayesianNetwork
+    ValueMode valueMode = ValueMode::DOUBLE;
+    size_t memoryBudget = 0;
+    bool sampling = false;
+    SamplingOptions samplingOptions;
+    bool useMmap = true;
+    Evidence evidence;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--order=", 0) == 0) {
+            try {
+                heuristic = parseEliminationHeuristic(arg.substr(8));
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!parseNumber(arg, threads)) return 1;
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        } else if (arg.rfind("--parallel-threshold=", 0) == 0) {
+            if (!parseNumber(arg, parallelThreshold)) return 1;
+        } else if (arg.rfind("--sparse-threshold=", 0) == 0) {
+            if (!parseNumber(arg, sparseThreshold)) return 1;
+        } else if (arg.rfind("--simd=", 0) == 0) {
+            try {
+                setSimdLevel(parseSimdLevel(arg.substr(7)));
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--values=", 0) == 0) {
+            try {
+                valueMode = parseValueMode(arg.substr(9));
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--memory-budget=", 0) == 0) {
+            try {
+                memoryBudget = parseBytes(arg.substr(16));
+            } catch (const std::exception&) {
+                std::cerr << "Invalid memory budget " << arg.substr(16) << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--sample=", 0) == 0) {
+            try {
+                samplingOptions.method = parseSamplingMethod(arg.substr(9));
+                sampling = true;
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--samples=", 0) == 0) {
+            if (!parseNumber(arg, samplingOptions.samples)) return 1;
+        } else if (arg.rfind("--time-budget=", 0) == 0) {
+            if (!parseNumber(arg, samplingOptions.timeBudget)) return 1;
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            if (!parseNumber(arg, samplingOptions.seed)) return 1;
+        } else if (arg.rfind("--burn-in=", 0) == 0) {
+            if (!parseNumber(arg, samplingOptions.burnIn)) return 1;
+        } else if (arg == "--no-mmap")
+            useMmap = false;
+        else if (arg == "--all")
+            allMarginals = true;
+        else if (arg.rfind("--dump=", 0) == 0) {
+            allMarginals = true;
+            dumpFilename = arg.substr(7);
+        } else if (arg.rfind("--batch=", 0) == 0)
+            batchFilename = arg.substr(8);
+        else if (arg.rfind("--compile=", 0) == 0)
+            compileFilename = arg.substr(10);
+        else if (arg.find('=') != std::string::npos && arg.rfind("--", 0) != 0) {
+            size_t eq = arg.find('=');
+            evidence[arg.substr(0, eq)] = arg.substr(eq + 1);
+        } else
+            positional.push_back(arg);
+    }
 
-    if(argc < 3) {
-        std::cout << "Usage: ./main <filename> <query_variable>\n";
+    const bool needsQuery = !allMarginals && batchFilename.empty() && compileFilename.empty();
+    if(positional.size() < (needsQuery ? 2 : 1)) {
+        std::cout << "Usage: ./main <filename> <query_variable> [<variable>=<value> ...] [--order=min-degree|min-fill|weighted-min-fill] [--threads=N] [--parallel-threshold=entries] [--sparse-threshold=density] [--simd=auto|scalar|avx2|avx512] [--values=double|float|log] [--memory-budget=bytes[K|M|G]] [--no-mmap]\n"
+                  << "       ./main <filename> --all [<variable>=<value> ...] [--dump=<csv_file>] [--order=...]\n"
+                  << "       ./main <filename> <query_variable>|--all [<variable>=<value> ...] --sample=forward|lw|gibbs [--samples=N] [--time-budget=seconds] [--seed=N] [--burn-in=sweeps] [--threads=N]\n"
+                  << "       ./main <filename> --batch=<queries_file> [--order=...] [--values=...] [--memory-budget=...]\n"
+                  << "       ./main <filename> --compile=<compiled_file>\n";
         return 1;
     }
 
-    filename = argv[1];
-    queryVariableName = argv[2];
+    //The junction tree only has double cliques
+    if (allMarginals && !sampling && valueMode != ValueMode::DOUBLE) {
+        std::cerr << "--values=" << toString(valueMode) << " is not supported with --all" << std::endl;
+        return 1;
+    }
+    //and does not condition on a cutset, so it could not keep to a budget
+    if (allMarginals && !sampling && memoryBudget != 0) {
+        std::cerr << "--memory-budget is not supported with --all" << std::endl;
+        return 1;
+    }
 
-    std::ifstream input(filename);    
+    filename = positional[0];
+    if (needsQuery) queryVariableName = positional[1];
 
-    if(!input.is_open()) {
-        std::cerr << "Error opening file: " << filename << std::endl;
-        return 1;
+    //The file is mapped when possible, pipes and systems without mmap are read as a stream.
+    //A compiled network is read in place, so it keeps the mapping as long as it exists
+    std::shared_ptr<MappedFile> mapped;
+    if (useMmap) {
+        try {
+            mapped = std::make_shared<MappedFile>(filename);
+        } catch (const std::exception&) {}
     }
 
-    Parser parser(input);
+    std::ifstream input;
+    if (!mapped) {
+        input.open(filename, std::ios::binary);
+        if(!input.is_open()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return 1;
+        }
+    }
 
-    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point start, finish;
+    std::chrono::duration<double> duration;
 
-    NetworkAST parsed_network = parser.parse(); //Meglio stare attenti alla restituzione per valore e non per riferimento.
+    //Compiled networks are recognized from their first bytes, whatever the name of the file
+    std::unique_ptr<BayesianNetwork> network;
+    const bool compiled = mapped ? isCompiledNetwork(mapped->view()) : input.peek() == static_cast<unsigned char>(COMPILED_MAGIC[0]);
+    if (compiled) {
+        start = std::chrono::steady_clock::now();
+        try {
+            network = mapped ? readCompiledNetwork(mapped->view(), mapped) : readCompiledNetwork(input);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        finish = std::chrono::steady_clock::now();
+        duration = finish - start;
+        std::cout << "Input: compiled network, loaded in " << duration.count() << std::endl;
+    } else {
+        std::unique_ptr<Parser> parser;
+        try {
+            if (mapped) parser = std::make_unique<Parser>(mapped->view());
+            else parser = std::make_unique<Parser>(input);
 
-    auto finish = std::chrono::steady_clock::now();
-    std::chrono::duration<double> duration = finish - start;
+            //With more threads a big source is parsed in parallel into an AST, otherwise the
+            //network is built while parsing and the whole AST never exists
+            if (threads > 1 && parser->sourceSize() >= Parser::PARALLEL_PARSE_BYTES) {
+                ThreadPool pool(threads);
+                network = std::make_unique<BayesianNetwork>(parser->parse(pool));
+            } else
+                network = std::make_unique<BayesianNetwork>(*parser);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
 
-    std::cout<<"Parsing took: "<<duration.count()<< std::endl;
+        ParseTimings timings = parser->getTimings();
+        std::cout << "Input: " << (mapped ? "memory mapped" : "stream") << ", first token after " << timings.firstToken << std::endl;
+        std::cout<<"Parsing took: "<<timings.total<< std::endl;
+    }
 
-    if(!isQueryVariableInNetwork(parsed_network, queryVariableName)) {
+    BayesianNetwork& bn = *network;
+    if(needsQuery && !bn.containsVariable(queryVariableName)) {
         std::cerr << "Query variable not found in the network." << std::endl;
         return 1;
     }
 
-    BayesianNetwork bn(parsed_network);
+    bn.setEliminationHeuristic(heuristic);
+    bn.setThreadCount(threads);
+    if (parallelThreshold > 0) bn.setParallelThreshold(parallelThreshold);
+    if (sparseThreshold >= 0) bn.setSparseThreshold(sparseThreshold);
+    bn.setValueMode(valueMode);
+    bn.setMemoryBudget(memoryBudget);
+
+    if (!compileFilename.empty()) {
+        std::ofstream out(compileFilename, std::ios::binary);
+        try {
+            if (!out.is_open()) throw std::runtime_error("Error opening file: " + compileFilename);
+            writeCompiledNetwork(bn, out);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Compiled network written to " << compileFilename << std::endl;
+        return 0;
+    }
+
+    if (sampling) {
+        std::vector<VarId> queryVars;
+        if (allMarginals)
+            for (VarId var = 0; var < bn.getVariableCount(); ++var) queryVars.push_back(var);
+        else
+            queryVars.push_back(bn.getVarId(queryVariableName));
+        samplingOptions.threads = threads;
+
+        SamplingResult result;
+        try {
+            Sampler sampler(bn);
+            result = sampler.estimate(queryVars, evidence, samplingOptions);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        if (!allMarginals || dumpFilename.empty()) {
+            std::cout << std::endl;
+            for (const auto& marginal : result.marginals) printMarginal(bn, marginal, std::cout);
+            std::cout << std::endl;
+        } else {
+            std::ofstream dump(dumpFilename);
+            if (!dump.is_open()) {
+                std::cerr << "Error opening file: " << dumpFilename << std::endl;
+                return 1;
+            }
+            dumpMarginals(bn, result.marginals, dump);
+        }
+
+        std::cout << "Sampling (" << toString(samplingOptions.method) << ", " << threads << (threads == 1 ? " thread): " : " threads): ")
+                  << result.samples << " samples, " << result.accepted << " accepted, effective sample size ";
+        if (result.effectiveSamples > 0) std::cout << result.effectiveSamples << std::endl;
+        else std::cout << "not estimated" << std::endl;
+        std::cout << "Sampling took: " << result.seconds << " seconds." << std::endl;
+        return 0;
+    }
+
+    if (allMarginals) {
+        start = std::chrono::steady_clock::now();
+
+        std::unique_ptr<JunctionTree> tree;
+        std::vector<Factor> marginals;
+        try {
+            tree = std::make_unique<JunctionTree>(bn, heuristic, evidence);
+            marginals = tree->getAllMarginals();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        finish = std::chrono::steady_clock::now();
+        duration = finish - start;
+
+        if (dumpFilename.empty()) {
+            std::cout << std::endl;
+            for (const auto& marginal : marginals) printMarginal(bn, marginal, std::cout);
+            std::cout << std::endl;
+        } else {
+            std::ofstream dump(dumpFilename);
+            if (!dump.is_open()) {
+                std::cerr << "Error opening file: " << dumpFilename << std::endl;
+                return 1;
+            }
+            dumpMarginals(bn, marginals, dump);
+        }
+
+        std::cout << "Junction tree: " << tree->getCliqueCount() << " cliques, largest clique "
+                  << tree->getMaxCliqueSize() << " entries" << std::endl;
+        printSparseStats(bn.getSparseStats(), std::cout);
+        std::cout << "Calibration and all marginals took: " << duration.count() << " seconds." << std::endl;
+        return 0;
+    }
+
+    if (!batchFilename.empty()) {
+        std::ifstream batchInput(batchFilename);
+        if (!batchInput.is_open()) {
+            std::cerr << "Error opening file: " << batchFilename << std::endl;
+            return 1;
+        }
+
+        std::vector<Factor> marginals;
+        try {
+            std::vector<Query> queries = readBatch(batchInput);
+            start = std::chrono::steady_clock::now();
+            marginals = bn.calculateMarginals(queries);
+            finish = std::chrono::steady_clock::now();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        duration = finish - start;
+
+        const std::vector<AllocationStats>& allocations = bn.getAllocationStats();
+        std::cout << std::endl;
+        for (size_t i = 0; i < marginals.size(); ++i) {
+            printMarginal(bn, marginals[i], std::cout);
+            printAllocations(allocations[i], std::cout);
+        }
+        std::cout << std::endl;
+
+        CacheStats stats = bn.getCacheStats();
+        std::cout << "Factor cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+                  << stats.entries << " entries" << std::endl;
+        printSparseStats(bn.getSparseStats(), std::cout);
+        std::cout << marginals.size() << " queries took: " << duration.count() << " seconds." << std::endl;
+        return 0;
+    }
 
     start = std::chrono::steady_clock::now();
 
-    Factor marginal = bn.calculateMarginal(queryVariableName);
-    
+    Factor marginal;
+    try {
+        marginal = bn.calculateMarginal(queryVariableName, evidence);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
     finish = std::chrono::steady_clock::now();
     duration = finish - start;
 
-    std::cout << "\nMarginal distribution for " << queryVariableName << ":" << std::endl;
-
-    const Node* queryNode = bn.getNode(queryVariableName);
-    for (size_t i = 0; i < marginal.values.size(); ++i) {
-        std::map<std::string, size_t> assignment = marginal.getAssignment(i);
-        std::string valueName = queryNode->domain[assignment[queryVariableName]];
-        std::cout << "P(" << queryVariableName << " = " << valueName << ") = " 
-                  << marginal.values[i] << "\n";
+    std::cout << "\nMarginal distribution for " << queryVariableName;
+    if (!evidence.empty()) {
+        std::cout << " given";
+        for (const auto& [variable, value] : evidence) std::cout << " " << variable << "=" << value;
     }
+    std::cout << ":" << std::endl;
+
+    printMarginal(bn, marginal, std::cout);
     std::cout<< std::endl;
 
+    const EliminationPlan& plan = bn.getLastEliminationPlan();
+    std::cout << "Elimination order (" << toString(heuristic) << "): induced width " << plan.inducedWidth
+              << ", largest factor " << plan.maxFactorSize << " entries" << std::endl;
+    std::cout << "Estimated peak " << plan.peakEntries << " entries (" << plan.peakBytes << " bytes), " << plan.totalWork << " products";
+    if (!plan.cutset.empty()) std::cout << ", conditioning on " << plan.cutset.size() << " variables (" << plan.subproblems << " sub-problems)";
+    std::cout << std::endl;
+    printAllocations(bn.getAllocationStats().back(), std::cout);
+    printSparseStats(bn.getSparseStats(), std::cout);
+
     std::cout << "Marginal computation took: " << duration.count() << " seconds." << std::endl;
 }
 
-//g++ -O3 -Wall -Wextra -Wpedantic -o main parser.cpp variable_elimination.cpp -std=c++17
\ No newline at end of file
+//g++ -O3 -Wall -Wextra -Wpedantic -o main main.cpp parser.cpp variable_elimination.cpp elimination_order.cpp junction_tree.cpp thread_pool.cpp simd_kernels.cpp small_kernels.cpp factor_arena.cpp mapped_file.cpp compiled_network.cpp symbol_table.cpp typed_factor.cpp sampling.cpp -std=c++17 -pthread
\ No newline at end of file
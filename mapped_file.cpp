@@ -0,0 +1,54 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Cannot open " + path);
+
+    struct stat info;
+    if (::fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map " + path + ": not a regular file");
+    }
+
+    size = static_cast<size_t>(info.st_size);
+    //An empty file cannot be mapped, it is just an empty view
+    if (size > 0) {
+        void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + path);
+        }
+        //The lexer reads the file once from the start to the end
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+    }
+    //The mapping stays valid after the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) ::munmap(const_cast<char*>(data), size);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    throw std::runtime_error("Cannot map " + path + ": memory mapping is not supported on this system");
+}
+
+MappedFile::~MappedFile() {}
+
+#endif
+
+std::string_view MappedFile::view() const {
+    return std::string_view(data, size);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+/*
+    A read-only memory mapping of a whole file.
+    The Lexer can scan the mapping directly, so the file is never copied into a string
+    and parsing starts as soon as the mapping exists: pages are read on demand.
+    The mapping, and every view into it, lives as long as the MappedFile.
+*/
+class MappedFile {
+public:
+    //Throws std::runtime_error if the file cannot be mapped, e.g. when it is a pipe or on systems without mmap
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const;
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+};
@@ -1,8 +1,13 @@
 #include "parser.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <charconv>
+#include <exception>
 
-Token::Token(Type type, std::string value)
-    : type(type), value(value) {}
+
+Token::Token(Type type, std::string_view value, size_t offset, SymbolId symbol)
+    : type(type), value(value), offset(offset), symbol(symbol) {}
 
 std::ostream& operator<<(std::ostream& os, const Token& token) {
     const std::string typeStr[7] = {
@@ -12,197 +17,330 @@ std::ostream& operator<<(std::ostream& os, const Token& token) {
     return os;
 }
 
-Matcher::Matcher(Token::Type type, matcher_function_t func)
-    : type(type), matchFunc(func) {}
-
-match_result_t Matcher::try_match(std::string::iterator cursor, std::string::iterator end) {
-    return matchFunc(cursor, end);
+const std::array<uint8_t, 256> Lexer::charClasses = [] {
+    std::array<uint8_t, 256> classes{};
+    for (unsigned char c : std::string(" \t\r\n|,\"")) classes[c] |= BLANK;
+    for (unsigned char c : std::string("{}[]()=;")) classes[c] |= SYMBOL_CHAR;
+    for (unsigned char c = '0'; c <= '9'; ++c) classes[c] |= DIGIT | IDENTIFIER | WORD_CHAR;
+    for (unsigned char c = 'a'; c <= 'z'; ++c) classes[c] |= IDENTIFIER | WORD_CHAR;
+    for (unsigned char c = 'A'; c <= 'Z'; ++c) classes[c] |= IDENTIFIER | WORD_CHAR;
+    classes['_'] |= IDENTIFIER | WORD_CHAR;
+    for (unsigned char c : std::string("./><=?-")) classes[c] |= WORD_CHAR;
+    return classes;
+}();
+
+Lexer::Lexer(std::istream& input, SymbolTable& symbols)
+    : source(readAll(input)),
+      symbols(symbols),
+      begin(source.data()),
+      cursor(begin),
+      end(begin + source.size()) {}
+
+Lexer::Lexer(std::string_view text, SymbolTable& symbols)
+    : symbols(symbols),
+      begin(text.data()),
+      cursor(begin),
+      end(begin + text.size()) {}
+
+Lexer::Lexer(std::string_view text, size_t first, size_t last, SymbolTable& symbols)
+    : symbols(symbols),
+      begin(text.data()),
+      cursor(begin + first),
+      end(begin + last) {}
+
+std::string_view Lexer::text() const {
+    //The end of the whole source, end may be the end of a part of it
+    const size_t size = source.empty() ? end - begin : source.size();
+    return std::string_view(begin, size);
 }
 
-typedef std::pair<bool, std::string::iterator> match_result_t;
-typedef std::function<match_result_t(std::string::iterator, std::string::iterator)> matcher_function_t;
-
-bool Matcher::isADigit(const char c) {
-    return c >= '0' && c <= '9';
+std::string Lexer::position(size_t offset) const {
+    const char* at = begin + offset;
+    size_t line = 1 + std::count(begin, at, '\n');
+    const char* lineStart = at;
+    while (lineStart != begin && lineStart[-1] != '\n') --lineStart;
+    return "line " + std::to_string(line) + ", column " + std::to_string(at - lineStart + 1);
 }
 
-bool Matcher::isAlpha(const char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+std::string Lexer::readAll(std::istream& input) {
+    //Chunked reads work on pipes too, where the size is not known in advance
+    std::string text;
+    char buffer[1 << 16];
+    while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0)
+        text.append(buffer, static_cast<size_t>(input.gcount()));
+    return text;
 }
 
-bool Matcher::isAlphaNumeric(const char c) {
-    return isADigit(c) || isAlpha(c) || c == '_';
+uint8_t Lexer::classOf(char c) {
+    return charClasses[static_cast<unsigned char>(c)];
 }
 
-bool Matcher::isIgnoredSymbols(const char c) {
-    return c == ' ' || c == '|' || c == ',' || c == '"' || c == '\n';
+bool Lexer::isKeyword(std::string_view text) const {
+    for (const auto& keyword : Token::KEYWORDS)
+        if (text == keyword) return true;
+    return false;
 }
 
-bool Matcher::matchCommentStart(const std::string::iterator it, const std::string::iterator end) {
-    return it != end && *it == '/' && (it + 1) != end && *(it + 1) == '*';
-}
+Token Lexer::getNextToken() {
+    //Blanks and comments, in a loop since a comment can be followed by more of them
+    while (true) {
+        while (cursor != end && (classOf(*cursor) & BLANK)) ++cursor;
+        if (end - cursor >= 2 && cursor[0] == '/' && cursor[1] == '*') {
+            std::string_view rest(cursor + 2, end - cursor - 2);
+            size_t close = rest.find("*/");
+            cursor = close == std::string_view::npos ? end : cursor + 2 + close + 2;
+            continue;
+        }
+        break;
+    }
 
-bool Matcher::matchCommentEnd(const std::string::iterator it, const std::string::iterator end) {
-    return it != end && *it == '*' && (it + 1) != end && *(it + 1) == '/';
-}
+    const size_t offset = cursor - begin;
+    if (cursor == end)
+        return Token(Token::END, {}, offset);
+
+    const char* start = cursor;
+    const uint8_t first = classOf(*start);
+    auto take = [&](Token::Type type, const char* tokenEnd) {
+        cursor = tokenEnd;
+        const std::string_view value(start, tokenEnd - start);
+        const bool isName = type == Token::WORD || type == Token::DECIMAL_LITERAL;
+        return Token(type, value, offset, isName ? symbols.intern(value) : SymbolTable::NONE);
+    };
+    auto skipDigits = [&](const char* it) {
+        while (it != end && (classOf(*it) & DIGIT)) ++it;
+        return it;
+    };
 
-bool Matcher::theWordEnds(const std::string::iterator it) {
-    return !isAlphaNumeric(*it);
-}
+    if (first & SYMBOL_CHAR)
+        return take(Token::SYMBOL, start + 1);
 
-match_result_t Matcher::ignoreMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    while(it != end && isIgnoredSymbols(*it)) ++it;
-    if (matchCommentStart(it, end)) {
-        it += 2; // skip /*
-        while(it != end) {
-            if (matchCommentEnd(it, end)) {
-                it += 2; // skip */
-                break;
-            }
+    if (first & DIGIT) {
+        const char* digitsEnd = skipDigits(start);
+        const char* it = digitsEnd;
+        bool isFloat = false;
+        if (it != end && *it == '.') {
+            isFloat = true;
+            it = skipDigits(it + 1);
+        }
+        if (it != end && (*it == 'e' || *it == 'E')) {
+            isFloat = true;
             ++it;
+            if (it != end && (*it == '+' || *it == '-')) ++it;
+            it = skipDigits(it);
         }
+        if (isFloat)
+            return take(Token::FLOATING_POINT_LITERAL, it);
+        if (digitsEnd == end || !(classOf(*digitsEnd) & IDENTIFIER))
+            return take(Token::DECIMAL_LITERAL, digitsEnd);
+        //Digits followed by letters, e.g. 2nd, are a word
     }
-    return {(it == cursor) ? false : true, it};
-}
 
-match_result_t Matcher::keyWordMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    for(auto keyword : Token::KEYWORDS) {
-        it = cursor + keyword.size();
-        if(it <= end && std::string(cursor, it) == keyword && theWordEnds(it))
-            return {true, it};
-    }
-    return {false, it};
-}
+    const char* it = start;
+    while (it != end && (classOf(*it) & IDENTIFIER)) ++it;
+    if (it != start && isKeyword(std::string_view(start, it - start)))
+        return take(Token::KEYWORD, it);
 
-match_result_t Matcher::wordMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    const std::string symbols_accepted_in_word = "./_><=?-";
-    while (it != end && (isAlphaNumeric(*it) || symbols_accepted_in_word.find(*it) != std::string::npos))
-        ++it;
-    return {true, it};
+    while (it != end && (classOf(*it) & WORD_CHAR)) ++it;
+    if (it == start)
+        throw std::runtime_error("Unexpected character '" + std::string(1, *start) + "' at " + position(offset));
+    return take(Token::WORD, it);
 }
 
-match_result_t Matcher::symbolMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    if(it != end && Token::SYMBOLS.find(*it) != std::string::npos) {
-        ++it;
-        return {true, it};
-    }
-    return {false, it};
+Parser::Parser(std::istream& input)
+    : constructionStart(std::chrono::steady_clock::now()),
+      lexer(input, symbols) {
+    advance();
+    timings.firstToken = std::chrono::duration<double>(std::chrono::steady_clock::now() - constructionStart).count();
 }
 
-match_result_t Matcher::decimalMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    if (!isADigit(*it))
-        return {false, it};
-    while (it != end && isADigit(*it))
-        ++it;
-    if(!isAlphaNumeric(*it))
-        return {true, it};
-    return {false, it};
+Parser::Parser(std::string_view text)
+    : constructionStart(std::chrono::steady_clock::now()),
+      lexer(text, symbols) {
+    advance();
+    timings.firstToken = std::chrono::duration<double>(std::chrono::steady_clock::now() - constructionStart).count();
 }
 
-match_result_t Matcher::floatMatcherFunc(const std::string::iterator cursor, const std::string::iterator end) {
-    auto it = cursor;
-    bool seenDot = false;
-    bool seenExp = false;
-    if (!isADigit(*it))
-        return {false, it};
-    while (it != end && isADigit(*it)) ++it;
-    if (it != end && *it == '.') {
-        ++it;
-        seenDot = true;
-        while (it != end && isADigit(*it)) ++it;
-    }
-    if (it != end && (*it == 'e' || *it == 'E')) {
-        ++it;
-        seenExp = true;
-        if (it != end && (*it == '+' || *it == '-')) ++it;
-        while (it != end && isADigit(*it)) ++it;
-    }
-    if (seenDot || seenExp)
-        return {true, it};
-    else
-        return {false, cursor};
+Parser::Parser(std::string_view text, size_t first, size_t last, const Parser& declarations)
+    : constructionStart(std::chrono::steady_clock::now()),
+      lexer(text, first, last, symbols),
+      declarations(&declarations) {
+    advance();
 }
 
-Lexer::Lexer(std::ifstream& input)
-    : source(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()),
-      cursor(source.begin()),
-      ignoreMatcher(Token::IGNORE, Matcher::ignoreMatcherFunc),
-      matchers({
-          {Token::SYMBOL, Matcher(Token::SYMBOL, Matcher::symbolMatcherFunc)},
-          {Token::FLOATING_POINT_LITERAL, Matcher(Token::FLOATING_POINT_LITERAL, Matcher::floatMatcherFunc)},
-          {Token::DECIMAL_LITERAL, Matcher(Token::DECIMAL_LITERAL, Matcher::decimalMatcherFunc)},
-          {Token::KEYWORD, Matcher(Token::KEYWORD, Matcher::keyWordMatcherFunc)},
-          {Token::WORD, Matcher(Token::WORD, Matcher::wordMatcherFunc)}
-      }) {}
-
-Token Lexer::getNextToken() {
-    if (cursor == source.end())
-        return Token(Token::END, "");
-
-    auto [match_res, new_cursor] = ignoreMatcher.try_match(cursor, source.end());
-    if (match_res == true) {
-        cursor = new_cursor;
-        return getNextToken();
-    }
-
-    for (auto& [type, matcher] : matchers) {
-        auto [match_res, new_cursor] = matcher.try_match(cursor, source.end());
-        if (match_res == true) {
-            std::string value = std::string(cursor, new_cursor);
-            cursor = new_cursor;
-            return Token(type, value);
-        }
-    }
-
-    throw std::runtime_error("Unexpected token");
+ParseTimings Parser::getTimings() const {
+    return timings;
 }
 
-Parser::Parser(std::ifstream& input)
-    : lexer(input) {
-    advance();
+size_t Parser::sourceSize() const {
+    return lexer.text().size();
 }
 
 void Parser::advance() {
     current = lexer.getNextToken();
 }
 
-Token Parser::expect(const Token::Type expectedType, const std::string expectedValue) {
-    if (current.type != expectedType || (!std::empty(expectedValue) && current.value != expectedValue)) {
-        throw std::runtime_error("Expected " + expectedValue + ", got " + current.value);
+Token Parser::expect(const Token::Type expectedType, std::string_view expectedValue) {
+    if (current.type != expectedType || (!expectedValue.empty() && current.value != expectedValue)) {
+        fail("Expected " + std::string(expectedValue) + ", got " + std::string(current.value), current);
     }
     Token token = current;
     advance();
     return token;
 }
 
+//The listener of parse(), which just collects the blocks
+class NetworkCollector : public NetworkListener {
+public:
+    NetworkAST network;
+
+    void onNetwork(std::string name) override {
+        network.name = std::move(name);
+    }
+    void onVariable(Variable&& variable) override {
+        network.variables.push_back(std::move(variable));
+    }
+    void onProbability(Probability&& probability) override {
+        network.probabilities.push_back(std::move(probability));
+    }
+    void onSymbols(SymbolTable&& symbols) override {
+        network.symbols = std::move(symbols);
+    }
+};
+
+void Parser::fail(const std::string& message, const Token& token) const {
+    throw std::runtime_error(message + " at " + lexer.position(token.offset));
+}
+
 NetworkAST Parser::parse() {
+    NetworkCollector collector;
+    parse(collector);
+    //The parser is done with the network, moving it avoids copying every table
+    return std::move(collector.network);
+}
+
+void Parser::parse(NetworkListener& target) {
+    listener = &target;
     parseCompilationUnit();
-    return network;
+    listener->onSymbols(std::move(symbols));
+    listener = nullptr;
+    timings.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - constructionStart).count();
+}
+
+//Offsets of the ends of top level blocks, about size / parts apart, starting with first and ending with the size
+static std::vector<size_t> splitBlocks(std::string_view text, size_t first, size_t parts) {
+    std::vector<size_t> bounds = {first};
+    const size_t step = std::max<size_t>((text.size() - first) / parts, 1);
+    size_t next = first + step;
+    long depth = 0;
+    for (size_t i = first; i < text.size(); ++i) {
+        const char c = text[i];
+        if (c == '{')
+            ++depth;
+        else if (c == '}') {
+            if (--depth == 0 && i + 1 >= next && i + 1 < text.size()) {
+                bounds.push_back(i + 1);
+                next = i + 1 + step;
+            }
+        } else if (c == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+            //Braces in comments do not count, the lexer skips the comments in the same way
+            size_t close = text.find("*/", i + 2);
+            if (close == std::string_view::npos) break;
+            i = close + 1;
+        }
+    }
+    bounds.push_back(text.size());
+    return bounds;
+}
+
+NetworkAST Parser::parse(ThreadPool& pool) {
+    NetworkCollector collector;
+    listener = &collector;
+    parseNetworkDeclaration();
+    while (current.type == Token::KEYWORD && current.value == "variable")
+        declareVariable(parseVariableDeclaration());
+
+    const std::string_view text = lexer.text();
+    if (text.size() - current.offset < PARALLEL_PARSE_BYTES) {
+        parseBlocks();
+        listener = nullptr;
+        collector.onSymbols(std::move(symbols));
+        timings.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - constructionStart).count();
+        return std::move(collector.network);
+    }
+    listener = nullptr;
+
+    //A few ranges per thread, so a slow range does not leave the other threads idle
+    const std::vector<size_t> bounds = splitBlocks(text, current.offset, pool.getThreadCount() * 4);
+    std::vector<NetworkAST> parts(bounds.size() - 1);
+    std::vector<std::exception_ptr> errors(parts.size());
+
+    TaskGroup group(pool);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        group.run([&, i] {
+            try {
+                NetworkCollector piece;
+                Parser part(text, bounds[i], bounds[i + 1], *this);
+                part.listener = &piece;
+                part.parseBlocks();
+                piece.onSymbols(std::move(part.symbols));
+                parts[i] = std::move(piece.network);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    group.wait();
+
+    for (const auto& error : errors)
+        if (error) std::rethrow_exception(error);
+
+    /*
+    Every piece has its own symbols, numbered from 0, so its ids are translated to the ids of this parser.
+    Interning the names of the pieces in order gives each name the id of its first appearance in the
+    source, exactly as the sequential lexer does.
+    */
+    NetworkAST& network = collector.network;
+    for (auto& part : parts) {
+        std::vector<SymbolId> remap(part.symbols.size());
+        for (SymbolId id = 0; id < remap.size(); ++id) remap[id] = symbols.intern(part.symbols.name(id));
+
+        for (auto& variable : part.variables) {
+            variable.name = remap[variable.name];
+            for (auto& value : variable.domain) value = remap[value];
+            network.variables.push_back(std::move(variable));
+        }
+        for (auto& probability : part.probabilities) {
+            probability.variable = remap[probability.variable];
+            for (auto& parent : probability.parents) parent = remap[parent];
+            network.probabilities.push_back(std::move(probability));
+        }
+    }
+    collector.onSymbols(std::move(symbols));
+    timings.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - constructionStart).count();
+    return std::move(collector.network);
 }
 
 void Parser::parseCompilationUnit() {
     parseNetworkDeclaration();
+    parseBlocks();
+}
 
+void Parser::parseBlocks() {
     while(true) {
         if(current.type == Token::END)
             break;
 
         if(current.type == Token::KEYWORD) {
             if(current.value == "variable") {
-                Variable variable = parseVariableDeclaration();
-                network.variables.push_back(variable);
+                declareVariable(parseVariableDeclaration());
             }
             else if(current.value == "probability") {
-                Probability probability = parseProbabilityDeclaration();
-                network.probabilities.push_back(probability);
+                listener->onProbability(parseProbabilityDeclaration());
             }
+            else
+                fail("Expected 'variable' or 'probability', got " + std::string(current.value), current);
         } else
-            throw std::runtime_error("Expected 'variable' or 'probability', got " + current.value);
+            fail("Expected 'variable' or 'probability', got " + std::string(current.value), current);
     }
 }
 
@@ -210,12 +348,12 @@ void Parser::parseNetworkDeclaration() {
     expect(Token::KEYWORD, "network");
 
     Token name = expect(Token::WORD);
-    network.name = name.value;
+    listener->onNetwork(std::string(name.value));
 
     // Ignoro inner properties per ora
     while (current.value != "}") {
         if(current.type == Token::END)
-            throw std::runtime_error("Unexpected end of input in network declaration");
+            fail("Unexpected end of input in network declaration", current);
         advance();
     }
 
@@ -226,35 +364,37 @@ Variable Parser::parseVariableDeclaration() {
     Variable variable;
     expect(Token::KEYWORD, "variable");
 
-    Token name = expect(Token::WORD);
-    variable.name = name.value;
+    variable.name = expect(Token::WORD).symbol;
 
     // Ignoro inner properties per ora
     variable.domain = parseVariableDiscrete();
     return variable;
 }
 
-std::vector<std::string> Parser::parseVariableDiscrete() {
+std::vector<SymbolId> Parser::parseVariableDiscrete() {
     expect(Token::SYMBOL, "{");
 
     expect(Token::KEYWORD, "type");
     expect(Token::KEYWORD, "discrete");
     expect(Token::SYMBOL, "[");
-    int n = std::stoi(expect(Token::DECIMAL_LITERAL).value);
-    std::vector<std::string> domain(n);
+    Token size = expect(Token::DECIMAL_LITERAL);
+    size_t n = 0;
+    const char* first = size.value.data();
+    const char* last = first + size.value.size();
+    const auto [end, error] = std::from_chars(first, last, n);
+    if (error != std::errc() || end != last || n == 0)
+        fail("Invalid number of values " + std::string(size.value), size);
+    //Every value is a token of the source, so a bigger count fails below without being allocated
+    std::vector<SymbolId> domain;
+    domain.reserve(std::min(n, lexer.text().size()));
     expect(Token::SYMBOL, "]");
     expect(Token::SYMBOL, "{");
 
-    domain.reserve(n);
-    for (int i = 0; i < n; ++i) {
-        std::string element_of_domain;
-
+    for (size_t i = 0; i < n; ++i) {
         if(current.type == Token::DECIMAL_LITERAL)
-            element_of_domain = expect(Token::DECIMAL_LITERAL).value;
+            domain.push_back(expect(Token::DECIMAL_LITERAL).symbol);
         else
-            element_of_domain = expect(Token::WORD).value;
-
-        domain[i] = element_of_domain;
+            domain.push_back(expect(Token::WORD).symbol);
     }
 
     expect(Token::SYMBOL, "}");
@@ -270,42 +410,57 @@ Probability Parser::parseProbabilityDeclaration() {
 
     auto [variable, parents] = parseProbabilityVariablesList();
     probability.variable = variable;
-    probability.parents = parents;
+    probability.parents = std::move(parents);
+
+    //When every variable is already declared the size of the table is known
+    size_t expected_size = getDomainSize(probability.variable);
+    for (SymbolId parent : probability.parents) expected_size *= getDomainSize(parent);
+    if (expected_size > 0)
+        probability.table.reserve(expected_size);
 
-    std::vector<std::vector<double>> table = parseProbabilityContent();
-    probability.table = table;
+    parseProbabilityContent(probability.table);
 
     return probability;
 }
 
-std::pair<std::string, std::vector<std::string>> Parser::parseProbabilityVariablesList() {
-    std::string variable;
-    std::vector<std::string> parents;
+void Parser::declareVariable(Variable&& variable) {
+    if (variable.name >= domainSizes.size()) domainSizes.resize(variable.name + 1, 0);
+    domainSizes[variable.name] = variable.domain.size();
+    listener->onVariable(std::move(variable));
+}
+
+size_t Parser::getDomainSize(SymbolId variable) const {
+    if (variable < domainSizes.size() && domainSizes[variable] > 0) return domainSizes[variable];
+    //A range looks the name up in the parser of the earlier declarations, which only reads it
+    if (declarations == nullptr) return 0;
+    return declarations->getDomainSize(declarations->symbols.find(symbols.name(variable)));
+}
+
+std::pair<SymbolId, std::vector<SymbolId>> Parser::parseProbabilityVariablesList() {
+    SymbolId variable;
+    std::vector<SymbolId> parents;
     expect(Token::SYMBOL, "(");
 
-    variable = expect(Token::WORD).value;
+    variable = expect(Token::WORD).symbol;
 
     while(current.value != ")"){
-        parents.push_back(expect(Token::WORD).value);
+        parents.push_back(expect(Token::WORD).symbol);
     }
 
     expect(Token::SYMBOL, ")");
     return {variable, parents};
 }
 
-std::vector<std::vector<double>> Parser::parseProbabilityContent() {
+void Parser::parseProbabilityContent(std::vector<double>& table) {
     expect(Token::SYMBOL, "{");
 
-    std::vector<std::vector<double>> table;
-
+    //The rows are appended in the order they appear
     do {
         parseProbabilityValuesList();
-        table.push_back(parseFloatingPointList());
+        parseFloatingPointList(table);
     } while(current.value == "(");
 
     expect(Token::SYMBOL, "}");
-
-    return table;
 }
 
 void Parser::parseProbabilityValuesList() {
@@ -322,11 +477,15 @@ void Parser::parseProbabilityValuesList() {
     expect(Token::SYMBOL, ")");
 }
 
-std::vector<double> Parser::parseFloatingPointList() {
-    std::vector<double> floatingPointList;
+void Parser::parseFloatingPointList(std::vector<double>& values) {
     do {
-        floatingPointList.push_back(std::stod(expect(Token::FLOATING_POINT_LITERAL).value));
+        //from_chars reads the token in place and does not depend on the locale
+        Token number = expect(Token::FLOATING_POINT_LITERAL);
+        double value = 0;
+        const char* first = number.value.data();
+        if (std::from_chars(first, first + number.value.size(), value).ec != std::errc())
+            fail("Invalid number " + std::string(number.value), number);
+        values.push_back(value);
     } while(current.value != ";");
     expect(Token::SYMBOL, ";");
-    return floatingPointList;
 }
\ No newline at end of file
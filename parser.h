@@ -5,15 +5,24 @@
 #include <vector>
 #include <string>
 #include <map>
-#include <functional>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+#include "symbol_table.h"
+
+class ThreadPool;
 
 class Token {
 public:
     enum Type {KEYWORD, WORD, SYMBOL, DECIMAL_LITERAL, FLOATING_POINT_LITERAL, END, TEXT, IGNORE};
     Type type;
-    std::string value;
+    std::string_view value; //points into the source of the Lexer, valid as long as the Lexer
+    size_t offset;          //position of the first character in the source
+    SymbolId symbol;        //the interned value of words and decimal literals, SymbolTable::NONE for the others
 
-    Token(Type type = END, std::string value = "");
+    Token(Type type = END, std::string_view value = {}, size_t offset = 0, SymbolId symbol = SymbolTable::NONE);
     friend std::ostream& operator<<(std::ostream& os, const Token& token);
 
     inline static const std::vector<std::string> KEYWORDS = {
@@ -22,81 +31,153 @@ public:
     inline static const std::string SYMBOLS = "{}[](),;=|";
 };
 
-typedef std::pair<bool, std::string::iterator> match_result_t;
-typedef std::function<match_result_t(std::string::iterator, std::string::iterator)> matcher_function_t;
-
-class Matcher {
-public:
-    Token::Type type;
-    matcher_function_t matchFunc;
-
-    Matcher(Token::Type type, matcher_function_t func);
-    match_result_t try_match(std::string::iterator cursor, std::string::iterator end);
-
-    static bool isADigit(const char c);
-    static bool isAlpha(const char c);
-    static bool isAlphaNumeric(const char c);
-    static bool isIgnoredSymbols(const char c);
-    static bool matchCommentStart(const std::string::iterator it, const std::string::iterator end);
-    static bool matchCommentEnd(const std::string::iterator it, const std::string::iterator end);
-    static bool theWordEnds(const std::string::iterator it);
-
-
-    static match_result_t ignoreMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-    static match_result_t keyWordMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-    static match_result_t wordMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-    static match_result_t symbolMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-    static match_result_t decimalMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-    static match_result_t floatMatcherFunc(const std::string::iterator cursor, const std::string::iterator end);
-};
-
+/*
+    A single pass scanner driven by a table with the classes of every byte.
+    Each call skips blanks and comments in a loop, then looks only at the class of the first
+    character to decide which kind of token it is scanning:
+        - a symbol is a single character
+        - a digit starts a floating point literal (with a dot or an exponent) or a decimal literal,
+          digits followed by letters are a word instead
+        - anything else is a word, and a keyword when its letters are exactly a keyword
+    The value of a token is a view into the source, so no text is copied.
+    Words and decimal literals, which name variables and values, are interned in a SymbolTable.
+    The source is either read from a stream into a string owned by the Lexer, or any text
+    which outlives it, like a MappedFile.
+*/
 class Lexer {
 public:
-    Lexer(std::ifstream& input);
+    Lexer(std::istream& input, SymbolTable& symbols);
+    Lexer(std::string_view text, SymbolTable& symbols);
+    //Scans only text[first, last), the offsets of the tokens still count from the start of text
+    Lexer(std::string_view text, size_t first, size_t last, SymbolTable& symbols);
     Token getNextToken();
+
+    //The whole source, also when only a part of it is scanned
+    std::string_view text() const;
+    //"line L, column C" of an offset in the source, both counted from 1
+    std::string position(size_t offset) const;
 private:
-    std::string source;
-    std::string::iterator cursor;
-    Matcher ignoreMatcher;
-    std::vector<std::pair<Token::Type, Matcher>> matchers;
+    //Bit flags, a character can belong to more than one class
+    enum CharClass : uint8_t {
+        BLANK = 1,       //skipped, this includes | , and " which only separate the items of lists
+        SYMBOL_CHAR = 2,
+        DIGIT = 4,
+        IDENTIFIER = 8,  //letters, digits and _
+        WORD_CHAR = 16   //IDENTIFIER and the punctuation allowed inside words
+    };
+    static const std::array<uint8_t, 256> charClasses;
+
+    std::string source; //only used when reading from a stream
+    SymbolTable& symbols;
+    const char* begin;
+    const char* cursor;
+    const char* end;
+
+    static std::string readAll(std::istream& input);
+
+    static uint8_t classOf(char c);
+    bool isKeyword(std::string_view text) const;
 };
 
-// AST Structures
+// AST Structures, every name is a SymbolId of NetworkAST::symbols
 struct Variable {
-    std::string name;
-    std::vector<std::string> domain;
+    SymbolId name;
+    std::vector<SymbolId> domain;
 };
 
 struct Probability {
-    std::string variable;
-    std::vector<std::string> parents;
-    std::vector<std::vector<double>> table;
+    SymbolId variable;
+    std::vector<SymbolId> parents;
+    /*
+    All the rows of the table one after the other, with the values of variable changing fastest,
+    e.g. for P(A | B) with two values each: P(a0|b0), P(a1|b0), P(a0|b1), P(a1|b1).
+    BayesianNetwork copies it into the CPT arena of its layout with NetworkLayout::storeCPT.
+    */
+    std::vector<double> table;
 };
 
 struct NetworkAST {
     std::string name;
+    SymbolTable symbols;
     std::vector<Variable> variables;
     std::vector<Probability> probabilities;
 };
 
+/*
+    Receives the parts of a network as soon as the Parser has read each block, in the order of the source.
+    The blocks are moved out of the parser, so a listener can keep them without copies
+    and the parser never holds more than the block it is reading.
+*/
+class NetworkListener {
+public:
+    virtual ~NetworkListener() = default;
+    virtual void onNetwork(std::string name) = 0;
+    virtual void onVariable(Variable&& variable) = 0;
+    virtual void onProbability(Probability&& probability) = 0;
+    //Called once when the input ends, with the names of every SymbolId of the blocks
+    virtual void onSymbols(SymbolTable&& symbols) = 0;
+};
+
+//Seconds since the Parser was constructed, so with a stream they include reading the whole input
+struct ParseTimings {
+    double firstToken = 0;
+    double total = 0;
+};
+
 class Parser {
 public:
-    Parser(std::ifstream& input);
+    //The stream is read completely before the first token, it also works with pipes
+    Parser(std::istream& input);
+    //Zero copy: tokens point into text, which must outlive the parse
+    explicit Parser(std::string_view text);
     NetworkAST parse();
+    //Streaming: every block goes to listener when it ends, no NetworkAST is built
+    void parse(NetworkListener& listener);
+    /*
+    Same result as parse(), with the blocks parsed on the threads of pool.
+    The network declaration and the variables declared before the first table are parsed here, so
+    every range knows their domains and preallocates its tables as parse() does. The rest of the
+    source is pre-scanned for the ends of the top level blocks, counting braces and skipping comments,
+    and cut into ranges of whole blocks with about the same size. Every range is parsed by its own Parser,
+    then the pieces are appended in the order of the source, so the AST is exactly the one of parse().
+    When the rest is shorter than PARALLEL_PARSE_BYTES it is parsed here too: splitting it and
+    merging the pieces would cost more than the threads save.
+    When some ranges fail, the error of the first one is thrown, which is the error parse() would
+    throw, with its position in the whole source.
+    */
+    NetworkAST parse(ThreadPool& pool);
+    ParseTimings getTimings() const;
+    //Bytes of the source, read completely by the constructor
+    size_t sourceSize() const;
+
+    static constexpr size_t PARALLEL_PARSE_BYTES = 4 << 20;
 private:
+    //Parses the blocks in text[first, last), taking the domains it does not declare from declarations
+    Parser(std::string_view text, size_t first, size_t last, const Parser& declarations);
+
+    SymbolTable symbols; //declared before lexer, which interns into it
+    std::chrono::steady_clock::time_point constructionStart; //declared before lexer, so it is set before reading
+    ParseTimings timings;
     Lexer lexer;
     Token current;
-    NetworkAST network;
+    NetworkListener* listener = nullptr; //set for the duration of a parse
+    std::vector<size_t> domainSizes; //by SymbolId, of the variables declared so far (0 for the others), to preallocate the tables
+    const Parser* declarations = nullptr; //for a range of parse(ThreadPool&), the parser of the variables declared before it
 
     void advance();
-    Token expect(const Token::Type expectedType, const std::string expectedValue = "");
+    Token expect(const Token::Type expectedType, std::string_view expectedValue = {});
+    [[noreturn]] void fail(const std::string& message, const Token& token) const;
     void parseCompilationUnit();
+    void parseBlocks();
     void parseNetworkDeclaration();
+    //Records the domain size of variable and passes it to the listener
+    void declareVariable(Variable&& variable);
     Probability parseProbabilityDeclaration();
     Variable parseVariableDeclaration();
-    std::vector<double> parseFloatingPointList();
+    void parseFloatingPointList(std::vector<double>& values);
     void parseProbabilityValuesList();
-    std::vector<std::vector<double>> parseProbabilityContent();
-    std::pair<std::string, std::vector<std::string>> parseProbabilityVariablesList();
-    std::vector<std::string> parseVariableDiscrete();
+    void parseProbabilityContent(std::vector<double>& table);
+    std::pair<SymbolId, std::vector<SymbolId>> parseProbabilityVariablesList();
+    std::vector<SymbolId> parseVariableDiscrete();
+    size_t getDomainSize(SymbolId variable) const;
 };
\ No newline at end of file
@@ -0,0 +1,362 @@
+#include "sampling.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+SamplingMethod parseSamplingMethod(const std::string& name) {
+    if (name == "forward") return SamplingMethod::FORWARD;
+    if (name == "likelihood-weighting" || name == "lw") return SamplingMethod::LIKELIHOOD_WEIGHTING;
+    if (name == "gibbs") return SamplingMethod::GIBBS;
+    throw std::runtime_error("Unknown sampling method " + name);
+}
+
+std::string toString(SamplingMethod method) {
+    switch (method) {
+        case SamplingMethod::FORWARD: return "forward";
+        case SamplingMethod::LIKELIHOOD_WEIGHTING: return "likelihood-weighting";
+        case SamplingMethod::GIBBS: return "gibbs";
+    }
+    return "unknown";
+}
+
+/*
+    xoshiro256** (Blackman and Vigna), with its state filled by splitmix64 from the seed and the
+    number of the stream: different streams of the same seed are unrelated sequences.
+*/
+class RandomStream {
+public:
+    RandomStream(uint64_t seed, uint64_t stream) {
+        uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+        for (uint64_t& word : state) {
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        const uint64_t result = rotate(state[1] * 5, 7) * 9;
+        const uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotate(state[3], 45);
+        return result;
+    }
+
+    //Uniform in [0, 1), from the top 53 bits
+    double uniform() {
+        return static_cast<double>(next() >> 11) * 0x1.0p-53;
+    }
+
+private:
+    uint64_t state[4];
+
+    static uint64_t rotate(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+//The value whose cumulative weight passes u, the last one with a nonzero weight if rounding leaves u past the end
+static size_t drawValue(const double* weights, size_t card, double u) {
+    size_t last = 0;
+    for (size_t v = 0; v < card; ++v) {
+        if (weights[v] <= 0) continue;
+        u -= weights[v];
+        if (u < 0) return v;
+        last = v;
+    }
+    return last;
+}
+
+Sampler::Sampler(const BayesianNetwork& network)
+    : network(network), layout(network.getLayout()) {
+    const size_t n = layout.size();
+
+    parentStrides.resize(layout.parents.size());
+    for (VarId var = 0; var < n; ++var) {
+        size_t stride = layout.cardinalities[var];
+        for (size_t k = layout.parentOffsets[var + 1]; k-- > layout.parentOffsets[var];) {
+            parentStrides[k] = stride;
+            stride *= layout.cardinalities[layout.parents[k]];
+        }
+    }
+
+    childStrides.resize(layout.children.size());
+    for (VarId var = 0; var < n; ++var) {
+        for (size_t j = layout.childOffsets[var]; j < layout.childOffsets[var + 1]; ++j) {
+            const VarId child = layout.children[j];
+            for (size_t k = layout.parentOffsets[child]; k < layout.parentOffsets[child + 1]; ++k)
+                if (layout.parents[k] == var) childStrides[j] = parentStrides[k];
+        }
+    }
+
+    //Kahn's algorithm, the ready variables are a stack so the order only depends on the layout
+    std::vector<size_t> missing(n);
+    std::vector<VarId> ready;
+    for (VarId var = 0; var < n; ++var) {
+        missing[var] = layout.parentsOf(var).size();
+        if (missing[var] == 0) ready.push_back(var);
+    }
+    std::reverse(ready.begin(), ready.end());
+    while (!ready.empty()) {
+        const VarId var = ready.back();
+        ready.pop_back();
+        topologicalOrder.push_back(var);
+        for (size_t j = layout.childOffsets[var + 1]; j-- > layout.childOffsets[var];) {
+            const VarId child = layout.children[j];
+            if (--missing[child] == 0) ready.push_back(child);
+        }
+    }
+    if (topologicalOrder.size() != n)
+        throw std::runtime_error("The network has a directed cycle, it cannot be sampled");
+
+    //A row of a CPT is deterministic when one of its values has probability 1 and the others 0
+    deterministicVar = static_cast<VarId>(n);
+    for (VarId var = 0; var < n && deterministicVar == n; ++var) {
+        const Span<double> cpt = layout.cptOf(var);
+        if (layout.cardinalities[var] < 2) continue;
+        for (const double* row = cpt.begin(); row < cpt.end() && deterministicVar == n; row += layout.cardinalities[var])
+            if (*std::max_element(row, row + layout.cardinalities[var]) == 1.0) deterministicVar = var;
+    }
+}
+
+/*
+The effective sample size of a Gibbs run from the counts of its chunks, with batch means: for the
+frequency p of a value over the n samples and its frequencies p_b in the full chunks of size B,
+    ESS = n p (1 - p) / (B * variance of the p_b)
+which is n when the sweeps are independent and smaller the more they are correlated.
+The smallest over the values of the queries, 0 when there are not enough chunks or no value varies.
+*/
+template <typename Tally>
+static double batchMeansESS(const std::vector<Tally>& chunks, size_t chunkSamples, const Tally& total) {
+    size_t batches = 0;
+    for (const Tally& chunk : chunks) batches += chunk.samples == chunkSamples;
+    if (batches < Sampler::MIN_BATCHES) return 0;
+
+    double ess = 0;
+    bool estimated = false;
+    for (size_t i = 0; i < total.weights.size(); ++i) {
+        const double p = total.weights[i] / total.totalWeight;
+        if (p <= 0 || p >= 1) continue;
+        double squares = 0;
+        for (const Tally& chunk : chunks) {
+            if (chunk.samples != chunkSamples) continue;
+            const double d = chunk.weights[i] / static_cast<double>(chunkSamples) - p;
+            squares += d * d;
+        }
+        const double variance = squares / static_cast<double>(batches - 1);
+        const double value = variance > 0 ? static_cast<double>(total.samples) * p * (1 - p) / (static_cast<double>(chunkSamples) * variance)
+                                          : static_cast<double>(total.samples);
+        ess = estimated ? std::min(ess, value) : value;
+        estimated = true;
+    }
+    return estimated ? std::min(ess, static_cast<double>(total.samples)) : 0;
+}
+
+const std::vector<VarId>& Sampler::getTopologicalOrder() const {
+    return topologicalOrder;
+}
+
+size_t Sampler::rowOf(VarId var, const std::vector<size_t>& values) const {
+    size_t row = 0;
+    for (size_t k = layout.parentOffsets[var]; k < layout.parentOffsets[var + 1]; ++k)
+        row += values[layout.parents[k]] * parentStrides[k];
+    return row;
+}
+
+double Sampler::drawSample(std::vector<size_t>& values, const ObservedValues& observed, bool rejection, RandomStream& rng) const {
+    double weight = 1.0;
+    for (VarId var : topologicalOrder) {
+        const double* row = layout.cptData[var] + rowOf(var, values);
+        if (observed[var] != -1 && !rejection) {
+            weight *= row[observed[var]];
+            if (weight == 0) return 0;
+            continue;
+        }
+        values[var] = drawValue(row, layout.cardinalities[var], rng.uniform());
+        if (observed[var] != -1 && values[var] != static_cast<size_t>(observed[var])) return 0;
+    }
+    return weight;
+}
+
+void Sampler::gibbsStep(VarId var, std::vector<size_t>& values, std::vector<double>& weights, std::vector<size_t>& childRows,
+                        RandomStream& rng) const {
+    const size_t card = layout.cardinalities[var];
+    const size_t first_child = layout.childOffsets[var], last_child = layout.childOffsets[var + 1];
+    const size_t current = values[var];
+
+    //The entries of the children for var = 0, var = v moves each of them by v times the stride of var
+    values[var] = 0;
+    childRows.resize(last_child - first_child);
+    for (size_t j = first_child; j < last_child; ++j) {
+        const VarId child = layout.children[j];
+        childRows[j - first_child] = rowOf(child, values) + values[child];
+    }
+
+    const double* row = layout.cptData[var] + rowOf(var, values);
+    weights.resize(card);
+    double total = 0;
+    for (size_t v = 0; v < card; ++v) {
+        double weight = row[v];
+        for (size_t j = first_child; j < last_child && weight > 0; ++j)
+            weight *= layout.cptData[layout.children[j]][childRows[j - first_child] + v * childStrides[j]];
+        weights[v] = weight;
+        total += weight;
+    }
+    values[var] = total > 0 ? drawValue(weights.data(), card, rng.uniform() * total) : current;
+}
+
+SamplingResult Sampler::estimate(const std::vector<VarId>& queryVars, const Evidence& evidence, const SamplingOptions& options) const {
+    if (options.samples == 0 && options.timeBudget <= 0)
+        throw std::runtime_error("Sampling needs a sample count or a time budget");
+    if (options.method == SamplingMethod::GIBBS && deterministicVar < layout.size())
+        throw std::runtime_error("Gibbs sampling does not mix on the deterministic CPT of " + std::string(network.getVariableName(deterministicVar)) +
+                                 ", use likelihood weighting");
+    const ObservedValues observed = network.resolveEvidence(evidence);
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.timeBudget));
+
+    //The weight of value v of queryVars[q] is at query_offsets[q] + v in the tallies
+    std::vector<size_t> query_offsets;
+    size_t total_values = 0;
+    for (VarId var : queryVars) {
+        query_offsets.push_back(total_values);
+        total_values += layout.cardinalities[var];
+    }
+
+    struct Tally {
+        std::vector<double> weights;
+        double totalWeight = 0;
+        double squaredWeight = 0;
+        size_t samples = 0;
+        size_t accepted = 0;
+    };
+    const size_t threads = std::max<size_t>(1, options.threads);
+
+    /*
+    With a sample count every chunk is counted in a slot of its own, and the slots are added in the
+    order of the chunks once the threads have ended: the sums of the weights are done in the same
+    order whatever the number of threads, and no lock is taken. With a time budget alone the number
+    of chunks is not known in advance, so each thread counts its chunks in a slot of the thread.
+    */
+    const size_t chunk_samples = options.samples == 0 ? CHUNK_SAMPLES : std::max(CHUNK_SAMPLES, (options.samples + MAX_CHUNKS - 1) / MAX_CHUNKS);
+    const size_t chunk_count = (options.samples + chunk_samples - 1) / chunk_samples;
+    std::vector<Tally> slots(options.samples == 0 ? threads : chunk_count);
+
+    //Hands out the chunks: returns false when sampling is over, otherwise sets the index and the size of the next chunk
+    std::atomic<size_t> next_chunk{0};
+    auto claimChunk = [&](size_t& chunk, size_t& count) {
+        if (options.timeBudget > 0 && std::chrono::steady_clock::now() >= deadline) return false;
+        chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (options.samples == 0) {
+            count = chunk_samples;
+            return true;
+        }
+        if (chunk >= chunk_count) return false;
+        count = std::min(chunk_samples, options.samples - chunk * chunk_samples);
+        return true;
+    };
+
+    auto worker = [&](size_t thread) {
+        Tally* tally = nullptr; //the slot of the current chunk
+        auto startChunk = [&](size_t chunk, size_t chunk_size) {
+            tally = &slots[options.samples == 0 ? thread : chunk];
+            if (tally->weights.empty()) tally->weights.assign(total_values, 0.0);
+            tally->samples += chunk_size;
+        };
+        std::vector<size_t> values(layout.size(), 0);
+        for (VarId var = 0; var < layout.size(); ++var)
+            if (observed[var] != -1) values[var] = static_cast<size_t>(observed[var]);
+        auto count = [&](double weight) {
+            for (size_t q = 0; q < queryVars.size(); ++q) tally->weights[query_offsets[q] + values[queryVars[q]]] += weight;
+            tally->totalWeight += weight;
+            tally->squaredWeight += weight * weight;
+            ++tally->accepted;
+        };
+
+        size_t chunk = 0, chunk_size = 0;
+        if (options.method != SamplingMethod::GIBBS) {
+            const bool rejection = options.method == SamplingMethod::FORWARD;
+            while (claimChunk(chunk, chunk_size)) {
+                startChunk(chunk, chunk_size);
+                RandomStream rng(options.seed, chunk);
+                for (size_t s = 0; s < chunk_size; ++s) {
+                    const double weight = drawSample(values, observed, rejection, rng);
+                    if (weight > 0) count(weight);
+                }
+            }
+            return;
+        }
+
+        //The chain starts from a likelihood weighting sample consistent with the evidence
+        RandomStream rng(options.seed, thread);
+        double weight = 0;
+        for (size_t attempt = 0; attempt < 1000 && weight == 0; ++attempt) weight = drawSample(values, observed, false, rng);
+        if (weight == 0)
+            throw std::runtime_error("Gibbs sampling found no state with nonzero probability to start from");
+
+        std::vector<VarId> unobserved;
+        for (VarId var : topologicalOrder)
+            if (observed[var] == -1) unobserved.push_back(var);
+        std::vector<double> weights;
+        std::vector<size_t> child_rows;
+        for (size_t sweep = 0; sweep < options.burnIn; ++sweep) {
+            if (options.timeBudget > 0 && std::chrono::steady_clock::now() >= deadline) return;
+            for (VarId var : unobserved) gibbsStep(var, values, weights, child_rows, rng);
+        }
+        while (claimChunk(chunk, chunk_size)) {
+            startChunk(chunk, chunk_size);
+            for (size_t s = 0; s < chunk_size; ++s) {
+                for (VarId var : unobserved) gibbsStep(var, values, weights, child_rows, rng);
+                count(1.0);
+            }
+        }
+    };
+
+    if (threads == 1) {
+        worker(0);
+    } else {
+        ThreadPool pool(threads);
+        TaskGroup group(pool);
+        for (size_t t = 0; t < threads; ++t) group.run([&worker, t] { worker(t); });
+        group.wait();
+    }
+
+    Tally total;
+    total.weights.assign(total_values, 0.0);
+    for (const Tally& slot : slots) {
+        if (slot.weights.empty()) continue;
+        for (size_t i = 0; i < total_values; ++i) total.weights[i] += slot.weights[i];
+        total.totalWeight += slot.totalWeight;
+        total.squaredWeight += slot.squaredWeight;
+        total.samples += slot.samples;
+        total.accepted += slot.accepted;
+    }
+
+    if (total.samples == 0)
+        throw std::runtime_error("The time budget ended before the first sample");
+    if (total.totalWeight == 0)
+        throw std::runtime_error("No sample agrees with the evidence, it is too unlikely or has zero probability");
+
+    SamplingResult result;
+    for (size_t q = 0; q < queryVars.size(); ++q) {
+        Factor marginal({queryVars[q]}, {layout.cardinalities[queryVars[q]]});
+        for (size_t v = 0; v < marginal.values.size(); ++v) marginal.values[v] = total.weights[query_offsets[q] + v] / total.totalWeight;
+        result.marginals.push_back(std::move(marginal));
+    }
+    result.samples = total.samples;
+    result.accepted = total.accepted;
+    if (options.method == SamplingMethod::GIBBS)
+        result.effectiveSamples = options.samples == 0 ? 0 : batchMeansESS(slots, chunk_samples, total);
+    else
+        result.effectiveSamples = total.totalWeight * total.totalWeight / total.squaredWeight;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "variable_elimination.h"
+
+#include <cstdint>
+
+//A random number generator (xoshiro256**), see sampling.cpp
+class RandomStream;
+
+/*
+    The sampling algorithms of Sampler, they all estimate P(query | evidence):
+        - FORWARD: draws every variable from its CPT in topological order and keeps the samples
+          that agree with the evidence (rejection sampling)
+        - LIKELIHOOD_WEIGHTING: observed variables are set to their values instead of drawn, and
+          each sample is weighted by the probability of the evidence given its parents
+        - GIBBS: a Markov chain which redraws every unobserved variable in turn from its
+          distribution given its Markov blanket, starting from a likelihood weighting sample.
+          It changes one variable at a time, so it cannot leave a state where every single change
+          has probability 0: on deterministic CPTs (like the OR node either of asia) the chain gets
+          stuck and the estimates are wrong, so networks with one are refused, likelihood weighting
+          should be used there.
+*/
+enum class SamplingMethod { FORWARD, LIKELIHOOD_WEIGHTING, GIBBS };
+
+//Accepts "forward", "likelihood-weighting" (or "lw") and "gibbs", throws otherwise
+SamplingMethod parseSamplingMethod(const std::string& name);
+std::string toString(SamplingMethod method);
+
+/*
+    When to stop: after samples samples or after timeBudget seconds, whichever comes first.
+    A zero disables that limit, but at least one must be set.
+*/
+struct SamplingOptions {
+    SamplingMethod method = SamplingMethod::LIKELIHOOD_WEIGHTING;
+    size_t samples = 100000;
+    double timeBudget = 0;
+    size_t threads = 1;
+    uint64_t seed = 1;
+    size_t burnIn = 1000; //sweeps of each Gibbs chain which are not counted
+};
+
+struct SamplingResult {
+    std::vector<Factor> marginals; //normalized, in the order of the query variables
+    size_t samples = 0;            //drawn, for Gibbs the sweeps counted after the burn-in
+    size_t accepted = 0;           //forward sampling: the samples which agree with the evidence, the others count them all
+    /*
+    Forward and likelihood weighting: (sum of the weights)^2 / (sum of their squares), equal to accepted without weights.
+    Gibbs: estimated from the autocorrelation of the chains (see Sampler::MIN_BATCHES), 0 when it cannot be.
+    */
+    double effectiveSamples = 0;
+    double seconds = 0;
+};
+
+/*
+    Approximate inference on the layout of a BayesianNetwork, for networks whose induced width is
+    too high for variable elimination or the junction tree: the memory used is a few values per
+    variable and thread, whatever the structure.
+
+    The variables are visited in topological order, and the entry of a CPT for the current sample
+    is found adding the value of each parent times its stride in the table, precomputed for every
+    parent (the CPT layout of NetworkLayout, the variable itself changing fastest).
+
+    Samples are drawn in chunks of CHUNK_SAMPLES (bigger ones when a sample count would need more
+    than MAX_CHUNKS), which the threads take from an atomic counter until the sample count or the
+    time budget is reached. Forward and likelihood weighting samples use one random stream for each
+    chunk, derived from the seed and the index of the chunk, and each chunk is counted in a slot of
+    its own, added to the result in the order of the chunks after the threads end: with a sample
+    count they give the same result, bit for bit, whatever the number of threads, and no lock is
+    taken. Every Gibbs chain (one for each thread) has its own stream.
+*/
+class Sampler {
+public:
+    static constexpr size_t CHUNK_SAMPLES = 256;
+    static constexpr size_t MAX_CHUNKS = 1024; //the slots of the counts of a query, each one as big as its marginals
+    /*
+    The effective sample size of Gibbs is estimated with batch means: every chunk is a run of
+    consecutive sweeps of one chain, and the more correlated the sweeps are, the more the
+    frequencies of the values vary between chunks. It needs a sample count of at least this many
+    full chunks; with fewer, or with a time budget alone, it is not estimated.
+    */
+    static constexpr size_t MIN_BATCHES = 20;
+
+    //Throws if the network has a directed cycle
+    explicit Sampler(const BayesianNetwork& network);
+
+    /*
+    Throws if no options limit is set, if no sample has a nonzero weight (evidence of probability 0, or too rare),
+    or for Gibbs if a CPT of the network is deterministic (a row with an entry of 1).
+    */
+    SamplingResult estimate(const std::vector<VarId>& queryVars, const Evidence& evidence, const SamplingOptions& options) const;
+
+    const std::vector<VarId>& getTopologicalOrder() const;
+
+private:
+    const BayesianNetwork& network;
+    const NetworkLayout& layout;
+    std::vector<VarId> topologicalOrder;
+    std::vector<size_t> parentStrides; //the stride of parents[k] in the CPT of its child, aligned with layout.parents
+    std::vector<size_t> childStrides;  //the stride of the variable in the CPT of children[j], aligned with layout.children
+    VarId deterministicVar;            //the first variable with a deterministic CPT, layout.size() if none
+
+    //The offset in the CPT of var of the row for the values of its parents in values
+    size_t rowOf(VarId var, const std::vector<size_t>& values) const;
+
+    /*
+    Draws the unobserved variables of values in topological order, observed ones keep their value.
+    Returns the likelihood weight of the evidence, or with rejection 0 as soon as an observed
+    variable is drawn with a different value.
+    */
+    double drawSample(std::vector<size_t>& values, const ObservedValues& observed, bool rejection, RandomStream& rng) const;
+
+    /*
+    Redraws var from P(var | Markov blanket) with the current values, proportional to its CPT entry
+    times the entries of its children; it keeps its value when they are all 0.
+    weights and childRows are scratch space, so a sweep allocates nothing.
+    */
+    void gibbsStep(VarId var, std::vector<size_t>& values, std::vector<double>& weights, std::vector<size_t>& childRows, RandomStream& rng) const;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+
+/*
+    The arithmetic of the values of a BasicFactor, a compile-time parameter of the factor and of its kernels.
+    A semiring tells how a probability is stored (Value), what the product and the sum of two values are,
+    and what 0 and 1 look like; the kernels only use these functions, so the same code computes
+    with doubles, with floats or in log space.
+*/
+
+//Plain probabilities, float tables take half the memory of double ones and twice as many fit in a SIMD register
+template <typename T>
+struct ProbabilitySemiring {
+    typedef T Value;
+
+    static Value zero() { return 0; }
+    static Value one() { return 1; }
+    static Value times(Value a, Value b) { return a * b; }
+    static Value plus(Value a, Value b) { return a + b; }
+    static Value divide(Value a, Value b) { return a / b; }
+
+    static Value fromProbability(double p) { return static_cast<Value>(p); }
+    static double toProbability(Value v) { return v; }
+};
+
+/*
+    Natural logarithms of probabilities: the product is a sum and the sum is log(e^a + e^b),
+    so a product of thousands of small probabilities, which underflows to 0 in a double, stays finite.
+    Probability 0 is -infinity.
+*/
+template <typename T>
+struct LogSemiring {
+    typedef T Value;
+
+    static Value zero() { return -std::numeric_limits<Value>::infinity(); }
+    static Value one() { return 0; }
+    static Value times(Value a, Value b) { return a + b; }
+    static Value plus(Value a, Value b) {
+        if (a < b) std::swap(a, b);
+        if (b == zero()) return a;
+        return a + std::log1p(std::exp(b - a));
+    }
+    static Value divide(Value a, Value b) { return a - b; }
+
+    static Value fromProbability(double p) { return p > 0 ? static_cast<Value>(std::log(p)) : zero(); }
+    static double toProbability(Value v) { return std::exp(static_cast<double>(v)); }
+};
+
+/*
+    The value types a query can be answered with, see BayesianNetwork::setValueMode.
+        - DOUBLE: the Factor kernels, with SIMD, sparse tables and the cache
+        - FLOAT: BasicFactor<ProbabilitySemiring<float>>
+        - LOG: BasicFactor<LogSemiring<double>>
+*/
+enum class ValueMode { DOUBLE, FLOAT, LOG };
+
+//Accepts "double", "float" and "log", throws otherwise
+ValueMode parseValueMode(const std::string& name);
+std::string toString(ValueMode mode);
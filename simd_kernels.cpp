@@ -0,0 +1,533 @@
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+static std::atomic<int> currentLevel{-1}; //-1 until the first call of getSimdLevel or setSimdLevel
+
+SimdLevel detectSimdLevel() {
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+SimdLevel getSimdLevel() {
+    int level = currentLevel.load(std::memory_order_relaxed);
+    if (level == -1) {
+        level = static_cast<int>(detectSimdLevel());
+        currentLevel.store(level, std::memory_order_relaxed);
+    }
+    return static_cast<SimdLevel>(level);
+}
+
+void setSimdLevel(SimdLevel level) {
+    currentLevel.store(static_cast<int>(std::min(level, detectSimdLevel())), std::memory_order_relaxed);
+}
+
+SimdLevel parseSimdLevel(const std::string& name) {
+    if (name == "auto") return detectSimdLevel();
+    if (name == "scalar") return SimdLevel::SCALAR;
+    if (name == "avx2") return SimdLevel::AVX2;
+    if (name == "avx512") return SimdLevel::AVX512;
+    throw std::runtime_error("Unknown SIMD level " + name);
+}
+
+std::string toString(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SCALAR: return "scalar";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+//The number of partial sums of sumValues, one 512-bit register of them
+template <typename T>
+static constexpr size_t PARTIALS = 64 / sizeof(T);
+
+//Adds n partials (a power of 2) as a balanced tree
+template <typename T>
+static T addPartials(const T* partials, size_t n = PARTIALS<T>) {
+    if (n == 1) return partials[0];
+    return addPartials(partials, n / 2) + addPartials(partials + n / 2, n / 2);
+}
+
+// ---------- Scalar fallback ----------
+
+template <typename T>
+static T sumValuesScalar(const T* values, size_t n) {
+    T partials[PARTIALS<T>] = {};
+    size_t i = 0;
+    for (; i + PARTIALS<T> <= n; i += PARTIALS<T>)
+        for (size_t k = 0; k < PARTIALS<T>; ++k) partials[k] += values[i + k];
+    for (; i < n; ++i) partials[i % PARTIALS<T>] += values[i];
+    return addPartials(partials);
+}
+
+template <typename T>
+static void divideValuesScalar(T* values, size_t n, T divisor) {
+    for (size_t i = 0; i < n; ++i) values[i] /= divisor;
+}
+
+template <typename T>
+static void sumOutInnermostScalar(const T* in, T* out, size_t begin, size_t end, size_t card) {
+    for (size_t i = begin; i < end; ++i) {
+        T sum = 0;
+        for (size_t j = 0; j < card; ++j) sum += in[i * card + j];
+        out[i] = sum;
+    }
+}
+
+//Adds the rows j of one block for the outputs [first, first + count) of that block
+template <typename T>
+static void sumBlockRunScalar(const T* block, T* out, size_t count, size_t inner, size_t card) {
+    for (size_t x = 0; x < count; ++x) {
+        T sum = 0;
+        for (size_t j = 0; j < card; ++j) sum += block[j * inner + x];
+        out[x] = sum;
+    }
+}
+
+template <typename T>
+static void multiplyRunScalar(const T* a, const T* b, T* out, size_t count) {
+    for (size_t x = 0; x < count; ++x) out[x] = a[x] * b[x];
+}
+
+template <typename T>
+static void scaleRunScalar(const T* a, T b, T* out, size_t count) {
+    for (size_t x = 0; x < count; ++x) out[x] = a[x] * b;
+}
+
+#if SIMD_X86
+
+// ---------- AVX2 ----------
+
+__attribute__((target("avx2")))
+static double sumValuesAvx2(const double* values, size_t n) {
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        low = _mm256_add_pd(low, _mm256_loadu_pd(values + i));
+        high = _mm256_add_pd(high, _mm256_loadu_pd(values + i + 4));
+    }
+    double partials[8];
+    _mm256_storeu_pd(partials, low);
+    _mm256_storeu_pd(partials + 4, high);
+    for (; i < n; ++i) partials[i % 8] += values[i];
+    return addPartials(partials);
+}
+
+__attribute__((target("avx2")))
+static void divideValuesAvx2(double* values, size_t n, double divisor) {
+    const __m256d d = _mm256_set1_pd(divisor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(values + i, _mm256_div_pd(_mm256_loadu_pd(values + i), d));
+    divideValuesScalar(values + i, n - i, divisor);
+}
+
+__attribute__((target("avx2")))
+static void sumOutInnermostAvx2(const double* in, double* out, size_t begin, size_t end, size_t card) {
+    size_t i = begin;
+    if (card == 2) {
+        //The pairs of 4 outputs are de-interleaved with unpack, the lanes come out in the order 0 2 1 3
+        for (; i + 4 <= end; i += 4) {
+            __m256d a = _mm256_loadu_pd(in + 2 * i), b = _mm256_loadu_pd(in + 2 * i + 4);
+            __m256d sum = _mm256_add_pd(_mm256_setzero_pd(), _mm256_unpacklo_pd(a, b));
+            sum = _mm256_add_pd(sum, _mm256_unpackhi_pd(a, b));
+            _mm256_storeu_pd(out + i, _mm256_permute4x64_pd(sum, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+    } else {
+        const long long c = static_cast<long long>(card);
+        const __m256i index = _mm256_set_epi64x(3 * c, 2 * c, c, 0);
+        for (; i + 4 <= end; i += 4) {
+            __m256d sum = _mm256_setzero_pd();
+            for (size_t j = 0; j < card; ++j)
+                sum = _mm256_add_pd(sum, _mm256_i64gather_pd(in + i * card + j, index, 8));
+            _mm256_storeu_pd(out + i, sum);
+        }
+    }
+    sumOutInnermostScalar(in, out, i, end, card);
+}
+
+__attribute__((target("avx2")))
+static void sumBlockRunAvx2(const double* block, double* out, size_t count, size_t inner, size_t card) {
+    size_t x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m256d sum = _mm256_setzero_pd();
+        for (size_t j = 0; j < card; ++j) sum = _mm256_add_pd(sum, _mm256_loadu_pd(block + j * inner + x));
+        _mm256_storeu_pd(out + x, sum);
+    }
+    sumBlockRunScalar(block + x, out + x, count - x, inner, card);
+}
+
+__attribute__((target("avx2")))
+static void multiplyRunAvx2(const double* a, const double* b, double* out, size_t count) {
+    size_t x = 0;
+    for (; x + 4 <= count; x += 4)
+        _mm256_storeu_pd(out + x, _mm256_mul_pd(_mm256_loadu_pd(a + x), _mm256_loadu_pd(b + x)));
+    multiplyRunScalar(a + x, b + x, out + x, count - x);
+}
+
+__attribute__((target("avx2")))
+static void scaleRunAvx2(const double* a, double b, double* out, size_t count) {
+    const __m256d factor = _mm256_set1_pd(b);
+    size_t x = 0;
+    for (; x + 4 <= count; x += 4)
+        _mm256_storeu_pd(out + x, _mm256_mul_pd(_mm256_loadu_pd(a + x), factor));
+    scaleRunScalar(a + x, b, out + x, count - x);
+}
+
+// ---------- AVX2, floats ----------
+
+__attribute__((target("avx2")))
+static float sumValuesAvx2(const float* values, size_t n) {
+    __m256 low = _mm256_setzero_ps(), high = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        low = _mm256_add_ps(low, _mm256_loadu_ps(values + i));
+        high = _mm256_add_ps(high, _mm256_loadu_ps(values + i + 8));
+    }
+    float partials[16];
+    _mm256_storeu_ps(partials, low);
+    _mm256_storeu_ps(partials + 8, high);
+    for (; i < n; ++i) partials[i % 16] += values[i];
+    return addPartials(partials);
+}
+
+__attribute__((target("avx2")))
+static void divideValuesAvx2(float* values, size_t n, float divisor) {
+    const __m256 d = _mm256_set1_ps(divisor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(values + i, _mm256_div_ps(_mm256_loadu_ps(values + i), d));
+    divideValuesScalar(values + i, n - i, divisor);
+}
+
+__attribute__((target("avx2")))
+static void sumOutInnermostAvx2(const float* in, float* out, size_t begin, size_t end, size_t card) {
+    const int c = static_cast<int>(card);
+    const __m256i index = _mm256_setr_epi32(0, c, 2 * c, 3 * c, 4 * c, 5 * c, 6 * c, 7 * c);
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t j = 0; j < card; ++j)
+            sum = _mm256_add_ps(sum, _mm256_i32gather_ps(in + i * card + j, index, 4));
+        _mm256_storeu_ps(out + i, sum);
+    }
+    sumOutInnermostScalar(in, out, i, end, card);
+}
+
+__attribute__((target("avx2")))
+static void sumBlockRunAvx2(const float* block, float* out, size_t count, size_t inner, size_t card) {
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t j = 0; j < card; ++j) sum = _mm256_add_ps(sum, _mm256_loadu_ps(block + j * inner + x));
+        _mm256_storeu_ps(out + x, sum);
+    }
+    sumBlockRunScalar(block + x, out + x, count - x, inner, card);
+}
+
+__attribute__((target("avx2")))
+static void multiplyRunAvx2(const float* a, const float* b, float* out, size_t count) {
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8)
+        _mm256_storeu_ps(out + x, _mm256_mul_ps(_mm256_loadu_ps(a + x), _mm256_loadu_ps(b + x)));
+    multiplyRunScalar(a + x, b + x, out + x, count - x);
+}
+
+__attribute__((target("avx2")))
+static void scaleRunAvx2(const float* a, float b, float* out, size_t count) {
+    const __m256 factor = _mm256_set1_ps(b);
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8)
+        _mm256_storeu_ps(out + x, _mm256_mul_ps(_mm256_loadu_ps(a + x), factor));
+    scaleRunScalar(a + x, b, out + x, count - x);
+}
+
+// ---------- AVX-512 ----------
+
+__attribute__((target("avx512f")))
+static double sumValuesAvx512(const double* values, size_t n) {
+    __m512d sum = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) sum = _mm512_add_pd(sum, _mm512_loadu_pd(values + i));
+    double partials[8];
+    _mm512_storeu_pd(partials, sum);
+    for (; i < n; ++i) partials[i % 8] += values[i];
+    return addPartials(partials);
+}
+
+__attribute__((target("avx512f")))
+static void divideValuesAvx512(double* values, size_t n, double divisor) {
+    const __m512d d = _mm512_set1_pd(divisor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm512_storeu_pd(values + i, _mm512_div_pd(_mm512_loadu_pd(values + i), d));
+    divideValuesScalar(values + i, n - i, divisor);
+}
+
+__attribute__((target("avx512f")))
+static void sumOutInnermostAvx512(const double* in, double* out, size_t begin, size_t end, size_t card) {
+    const long long c = static_cast<long long>(card);
+    const __m512i index = _mm512_set_epi64(7 * c, 6 * c, 5 * c, 4 * c, 3 * c, 2 * c, c, 0);
+    const __m512d zero = _mm512_setzero_pd();
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m512d sum = zero;
+        //The masked gather with every lane set, the unmasked one trips -Wmaybe-uninitialized in GCC's header
+        for (size_t j = 0; j < card; ++j)
+            sum = _mm512_add_pd(sum, _mm512_mask_i64gather_pd(zero, 0xFF, index, in + i * card + j, 8));
+        _mm512_storeu_pd(out + i, sum);
+    }
+    sumOutInnermostScalar(in, out, i, end, card);
+}
+
+__attribute__((target("avx512f")))
+static void sumBlockRunAvx512(const double* block, double* out, size_t count, size_t inner, size_t card) {
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m512d sum = _mm512_setzero_pd();
+        for (size_t j = 0; j < card; ++j) sum = _mm512_add_pd(sum, _mm512_loadu_pd(block + j * inner + x));
+        _mm512_storeu_pd(out + x, sum);
+    }
+    sumBlockRunScalar(block + x, out + x, count - x, inner, card);
+}
+
+__attribute__((target("avx512f")))
+static void multiplyRunAvx512(const double* a, const double* b, double* out, size_t count) {
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8)
+        _mm512_storeu_pd(out + x, _mm512_mul_pd(_mm512_loadu_pd(a + x), _mm512_loadu_pd(b + x)));
+    multiplyRunScalar(a + x, b + x, out + x, count - x);
+}
+
+__attribute__((target("avx512f")))
+static void scaleRunAvx512(const double* a, double b, double* out, size_t count) {
+    const __m512d factor = _mm512_set1_pd(b);
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8)
+        _mm512_storeu_pd(out + x, _mm512_mul_pd(_mm512_loadu_pd(a + x), factor));
+    scaleRunScalar(a + x, b, out + x, count - x);
+}
+
+// ---------- AVX-512, floats ----------
+
+__attribute__((target("avx512f")))
+static float sumValuesAvx512(const float* values, size_t n) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) sum = _mm512_add_ps(sum, _mm512_loadu_ps(values + i));
+    float partials[16];
+    _mm512_storeu_ps(partials, sum);
+    for (; i < n; ++i) partials[i % 16] += values[i];
+    return addPartials(partials);
+}
+
+__attribute__((target("avx512f")))
+static void divideValuesAvx512(float* values, size_t n, float divisor) {
+    const __m512 d = _mm512_set1_ps(divisor);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(values + i, _mm512_div_ps(_mm512_loadu_ps(values + i), d));
+    divideValuesScalar(values + i, n - i, divisor);
+}
+
+__attribute__((target("avx512f")))
+static void sumOutInnermostAvx512(const float* in, float* out, size_t begin, size_t end, size_t card) {
+    const int c = static_cast<int>(card);
+    const __m512i index = _mm512_setr_epi32(0, c, 2 * c, 3 * c, 4 * c, 5 * c, 6 * c, 7 * c,
+                                            8 * c, 9 * c, 10 * c, 11 * c, 12 * c, 13 * c, 14 * c, 15 * c);
+    const __m512 zero = _mm512_setzero_ps();
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16) {
+        __m512 sum = zero;
+        for (size_t j = 0; j < card; ++j)
+            sum = _mm512_add_ps(sum, _mm512_mask_i32gather_ps(zero, 0xFFFF, index, in + i * card + j, 4));
+        _mm512_storeu_ps(out + i, sum);
+    }
+    sumOutInnermostScalar(in, out, i, end, card);
+}
+
+__attribute__((target("avx512f")))
+static void sumBlockRunAvx512(const float* block, float* out, size_t count, size_t inner, size_t card) {
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m512 sum = _mm512_setzero_ps();
+        for (size_t j = 0; j < card; ++j) sum = _mm512_add_ps(sum, _mm512_loadu_ps(block + j * inner + x));
+        _mm512_storeu_ps(out + x, sum);
+    }
+    sumBlockRunScalar(block + x, out + x, count - x, inner, card);
+}
+
+__attribute__((target("avx512f")))
+static void multiplyRunAvx512(const float* a, const float* b, float* out, size_t count) {
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16)
+        _mm512_storeu_ps(out + x, _mm512_mul_ps(_mm512_loadu_ps(a + x), _mm512_loadu_ps(b + x)));
+    multiplyRunScalar(a + x, b + x, out + x, count - x);
+}
+
+__attribute__((target("avx512f")))
+static void scaleRunAvx512(const float* a, float b, float* out, size_t count) {
+    const __m512 factor = _mm512_set1_ps(b);
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16)
+        _mm512_storeu_ps(out + x, _mm512_mul_ps(_mm512_loadu_ps(a + x), factor));
+    scaleRunScalar(a + x, b, out + x, count - x);
+}
+
+#endif
+
+// ---------- Dispatch ----------
+//Templates over the value type, the kernel of each level is chosen by overload resolution
+
+template <typename T>
+static T sumValuesDispatch(const T* values, size_t n) {
+    switch (getSimdLevel()) {
+#if SIMD_X86
+        case SimdLevel::AVX512: return sumValuesAvx512(values, n);
+        case SimdLevel::AVX2: return sumValuesAvx2(values, n);
+#endif
+        default: return sumValuesScalar(values, n);
+    }
+}
+
+template <typename T>
+static void divideValuesDispatch(T* values, size_t n, T divisor) {
+    switch (getSimdLevel()) {
+#if SIMD_X86
+        case SimdLevel::AVX512: divideValuesAvx512(values, n, divisor); return;
+        case SimdLevel::AVX2: divideValuesAvx2(values, n, divisor); return;
+#endif
+        default: divideValuesScalar(values, n, divisor);
+    }
+}
+
+template <typename T>
+static void sumOutBlocksDispatch(const T* in, T* out, size_t begin, size_t end, size_t inner, size_t card) {
+    const SimdLevel level = getSimdLevel();
+    if (inner == 1) {
+        switch (level) {
+#if SIMD_X86
+            case SimdLevel::AVX512: sumOutInnermostAvx512(in, out, begin, end, card); return;
+            case SimdLevel::AVX2: sumOutInnermostAvx2(in, out, begin, end, card); return;
+#endif
+            default: sumOutInnermostScalar(in, out, begin, end, card); return;
+        }
+    }
+
+    //Each run stays inside one block b, where the outputs and every row j are contiguous
+    for (size_t i = begin; i < end;) {
+        const size_t b = i / inner, t = i % inner;
+        const size_t run = std::min(end - i, inner - t);
+        const T* block = in + b * card * inner + t;
+        switch (level) {
+#if SIMD_X86
+            case SimdLevel::AVX512: sumBlockRunAvx512(block, out + i, run, inner, card); break;
+            case SimdLevel::AVX2: sumBlockRunAvx2(block, out + i, run, inner, card); break;
+#endif
+            default: sumBlockRunScalar(block, out + i, run, inner, card);
+        }
+        i += run;
+    }
+}
+
+template <typename T>
+static void multiplyRun(SimdLevel level, const T* a, const T* b, T* out, size_t count) {
+    switch (level) {
+#if SIMD_X86
+        case SimdLevel::AVX512: multiplyRunAvx512(a, b, out, count); return;
+        case SimdLevel::AVX2: multiplyRunAvx2(a, b, out, count); return;
+#endif
+        default: multiplyRunScalar(a, b, out, count);
+    }
+}
+
+template <typename T>
+static void scaleRun(SimdLevel level, const T* a, T b, T* out, size_t count) {
+    switch (level) {
+#if SIMD_X86
+        case SimdLevel::AVX512: scaleRunAvx512(a, b, out, count); return;
+        case SimdLevel::AVX2: scaleRunAvx2(a, b, out, count); return;
+#endif
+        default: scaleRunScalar(a, b, out, count);
+    }
+}
+
+template <typename T>
+static void multiplyBroadcastInnerDispatch(const T* big, const T* small, T* out, size_t begin, size_t end, size_t period) {
+    const SimdLevel level = getSimdLevel();
+    for (size_t i = begin; i < end;) {
+        const size_t t = i % period;
+        const size_t run = std::min(end - i, period - t);
+        multiplyRun(level, big + i, small + t, out + i, run);
+        i += run;
+    }
+}
+
+template <typename T>
+static void multiplyBroadcastOuterDispatch(const T* big, const T* small, T* out, size_t begin, size_t end, size_t block) {
+    const SimdLevel level = getSimdLevel();
+    for (size_t i = begin; i < end;) {
+        const size_t b = i / block;
+        const size_t run = std::min(end - i, block - i % block);
+        scaleRun(level, big + i, small[b], out + i, run);
+        i += run;
+    }
+}
+
+double sumValues(const double* values, size_t n) { return sumValuesDispatch(values, n); }
+float sumValues(const float* values, size_t n) { return sumValuesDispatch(values, n); }
+void divideValues(double* values, size_t n, double divisor) { divideValuesDispatch(values, n, divisor); }
+void divideValues(float* values, size_t n, float divisor) { divideValuesDispatch(values, n, divisor); }
+
+void sumOutBlocks(const double* in, double* out, size_t begin, size_t end, size_t inner, size_t card) {
+    sumOutBlocksDispatch(in, out, begin, end, inner, card);
+}
+void sumOutBlocks(const float* in, float* out, size_t begin, size_t end, size_t inner, size_t card) {
+    sumOutBlocksDispatch(in, out, begin, end, inner, card);
+}
+
+void multiplyBroadcastInner(const double* big, const double* small, double* out, size_t begin, size_t end, size_t period) {
+    multiplyBroadcastInnerDispatch(big, small, out, begin, end, period);
+}
+void multiplyBroadcastInner(const float* big, const float* small, float* out, size_t begin, size_t end, size_t period) {
+    multiplyBroadcastInnerDispatch(big, small, out, begin, end, period);
+}
+void multiplyBroadcastOuter(const double* big, const double* small, double* out, size_t begin, size_t end, size_t block) {
+    multiplyBroadcastOuterDispatch(big, small, out, begin, end, block);
+}
+void multiplyBroadcastOuter(const float* big, const float* small, float* out, size_t begin, size_t end, size_t block) {
+    multiplyBroadcastOuterDispatch(big, small, out, begin, end, block);
+}
+
+bool matchBroadcast(const size_t* smallStrides, const size_t* resultStrides, size_t n_vars, size_t resultSize, bool& inner, size_t& period) {
+    size_t first = 0;
+    while (first < n_vars && smallStrides[first] == 0) ++first;
+    bool matches = true;
+    for (size_t k = first; k < n_vars && matches; ++k)
+        matches = smallStrides[k] == resultStrides[k];
+    if (matches) {
+        inner = true;
+        period = first == 0 ? resultSize : resultStrides[first - 1];
+        return true;
+    }
+
+    size_t last = n_vars;
+    while (last > 0 && smallStrides[last - 1] == 0) --last;
+    const size_t block = last == 0 ? resultSize : resultStrides[last - 1];
+    for (size_t k = 0; k < last; ++k)
+        if (smallStrides[k] * block != resultStrides[k]) return false;
+    inner = false;
+    period = block;
+    return true;
+}
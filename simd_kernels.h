@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*
+    Explicit SIMD versions of the loops factor operations reduce to, on row-major tables of doubles
+    (Factor) or of floats (the float value mode, see typed_factor.h), which fill a register with
+    twice as many entries. The instruction set is chosen at runtime: AVX-512 or AVX2 when the CPU supports them
+    (and the compiler targets x86-64), plain scalar loops otherwise.
+
+    Every kernel computes each output entry with the same operations in the same order on
+    every path, so the results do not depend on the instruction set:
+        - sums over a variable always start from 0 and add its values in order
+        - sumValues always accumulates into one 512-bit register of partial sums (8 doubles or
+          16 floats), entry i going to partial i % 8 (or i % 16), and adds the partials with the same tree
+*/
+enum class SimdLevel { SCALAR, AVX2, AVX512 };
+
+//The best level supported by this CPU
+SimdLevel detectSimdLevel();
+SimdLevel getSimdLevel();
+//Levels above detectSimdLevel() are lowered to it
+void setSimdLevel(SimdLevel level);
+
+//Accepts "auto", "scalar", "avx2" and "avx512", throws otherwise
+SimdLevel parseSimdLevel(const std::string& name);
+std::string toString(SimdLevel level);
+
+double sumValues(const double* values, size_t n);
+float sumValues(const float* values, size_t n);
+void divideValues(double* values, size_t n, double divisor);
+void divideValues(float* values, size_t n, float divisor);
+
+/*
+    Sum-out of one variable from a row-major table, computing the outputs [begin, end).
+    inner is the stride of the summed variable (the product of the cardinalities after it)
+    and card its cardinality, so
+        out[b * inner + t] = sum over j of in[(b * card + j) * inner + t]
+    inner == 1 is the innermost (contiguous) variable, inner > 1 adds whole contiguous blocks.
+*/
+void sumOutBlocks(const double* in, double* out, size_t begin, size_t end, size_t inner, size_t card);
+void sumOutBlocks(const float* in, float* out, size_t begin, size_t end, size_t inner, size_t card);
+
+/*
+    Products where the smaller factor is broadcast over the larger one, computing [begin, end).
+        multiplyBroadcastInner: out[i] = big[i] * small[i % period], small is over the innermost variables
+        multiplyBroadcastOuter: out[i] = big[i] * small[i / block], small is over the outermost variables
+*/
+void multiplyBroadcastInner(const double* big, const double* small, double* out, size_t begin, size_t end, size_t period);
+void multiplyBroadcastInner(const float* big, const float* small, float* out, size_t begin, size_t end, size_t period);
+void multiplyBroadcastOuter(const double* big, const double* small, double* out, size_t begin, size_t end, size_t block);
+void multiplyBroadcastOuter(const float* big, const float* small, float* out, size_t begin, size_t end, size_t block);
+
+/*
+    Checks whether a factor with the strides smallStrides (over the n_vars variables of a result
+    with resultStrides and resultSize entries) covers the innermost variables of the result with
+    their strides in it (inner, small[i % period]) or the outermost ones with contiguous strides
+    (outer, small[i / period]), the layouts of the two kernels above.
+*/
+bool matchBroadcast(const size_t* smallStrides, const size_t* resultStrides, size_t n_vars, size_t resultSize, bool& inner, size_t& period);
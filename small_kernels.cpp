@@ -0,0 +1,124 @@
+#include "small_kernels.h"
+
+// ---------- Product ----------
+
+template <size_t CARD, size_t N_VARS>
+static constexpr size_t tableSize() {
+    size_t size = 1;
+    for (size_t k = 0; k < N_VARS; ++k) size *= CARD;
+    return size;
+}
+
+//The digits of every entry are constants after unrolling, only the strides are read
+template <size_t CARD, size_t N_VARS>
+static void productFixed(const double* a, const size_t* strideA, const double* b, const size_t* strideB, double* out) {
+    for (size_t i = 0; i < tableSize<CARD, N_VARS>(); ++i) {
+        size_t index_a = 0, index_b = 0, rest = i;
+        for (size_t k = N_VARS; k-- > 0;) {
+            const size_t digit = rest % CARD;
+            rest /= CARD;
+            index_a += digit * strideA[k];
+            index_b += digit * strideB[k];
+        }
+        out[i] = a[index_a] * b[index_b];
+    }
+}
+
+ProductKernel findProductKernel(size_t n_vars, size_t card) {
+    if (card == 2) {
+        switch (n_vars) {
+            case 1: return productFixed<2, 1>;
+            case 2: return productFixed<2, 2>;
+            case 3: return productFixed<2, 3>;
+            case 4: return productFixed<2, 4>;
+        }
+    } else if (card == 3) {
+        switch (n_vars) {
+            case 1: return productFixed<3, 1>;
+            case 2: return productFixed<3, 2>;
+            case 3: return productFixed<3, 3>;
+        }
+    }
+    return nullptr;
+}
+
+// ---------- Sum-out ----------
+
+template <size_t CARD>
+static void sumOutFixed(const double* in, double* out, size_t begin, size_t end, size_t inner) {
+    if (inner == 1) {
+        for (size_t i = begin; i < end; ++i) {
+            double sum = 0.0;
+            for (size_t j = 0; j < CARD; ++j) sum += in[i * CARD + j];
+            out[i] = sum;
+        }
+        return;
+    }
+    for (size_t i = begin; i < end; ++i) {
+        const double* block = in + (i / inner) * CARD * inner + i % inner;
+        double sum = 0.0;
+        for (size_t j = 0; j < CARD; ++j) sum += block[j * inner];
+        out[i] = sum;
+    }
+}
+
+SumOutKernel findSumOutKernel(size_t card, size_t entries) {
+    if (entries > SMALL_SUM_OUT_ENTRIES) return nullptr;
+    if (card == 2) return sumOutFixed<2>;
+    if (card == 3) return sumOutFixed<3>;
+    return nullptr;
+}
+
+// ---------- Fused product and sum-out ----------
+
+/*
+    The odometer of factorProductSumOut over the kept variables, with the inner one replaced by
+    a loop of SUMMED_CARD steps: the offset of value j of the summed variable is base + j * stride.
+*/
+template <size_t N_FACTORS, size_t SUMMED_CARD>
+static void productSumOutFixed(const double* const* tables, const size_t* keptStrides, const size_t* keptCards, size_t n_kept,
+                               const size_t* summedStrides, double* out, size_t begin, size_t end) {
+    size_t counter[SMALL_KERNEL_MAX_KEPT];
+    size_t base[N_FACTORS] = {};
+    size_t summed[N_FACTORS] = {};
+    if (SUMMED_CARD > 1)
+        for (size_t f = 0; f < N_FACTORS; ++f) summed[f] = summedStrides[f];
+
+    size_t rest = begin;
+    for (size_t k = n_kept; k-- > 0;) {
+        counter[k] = rest % keptCards[k];
+        rest /= keptCards[k];
+        for (size_t f = 0; f < N_FACTORS; ++f) base[f] += counter[k] * keptStrides[f * n_kept + k];
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+        double sum = 0.0;
+        for (size_t j = 0; j < SUMMED_CARD; ++j) {
+            double product = tables[0][base[0] + j * summed[0]];
+            for (size_t f = 1; f < N_FACTORS; ++f) product *= tables[f][base[f] + j * summed[f]];
+            sum += product;
+        }
+        out[i] = sum;
+
+        for (size_t k = n_kept; k-- > 0;) {
+            const size_t* strides = &keptStrides[k];
+            if (++counter[k] < keptCards[k]) {
+                for (size_t f = 0; f < N_FACTORS; ++f) base[f] += strides[f * n_kept];
+                break;
+            }
+            counter[k] = 0;
+            for (size_t f = 0; f < N_FACTORS; ++f) base[f] -= (keptCards[k] - 1) * strides[f * n_kept];
+        }
+    }
+}
+
+ProductSumOutKernel findProductSumOutKernel(size_t n_factors, size_t summedCard, size_t n_kept) {
+    static const ProductSumOutKernel kernels[SMALL_KERNEL_MAX_FACTORS - 1][3] = {
+        {productSumOutFixed<2, 1>, productSumOutFixed<2, 2>, productSumOutFixed<2, 3>},
+        {productSumOutFixed<3, 1>, productSumOutFixed<3, 2>, productSumOutFixed<3, 3>},
+        {productSumOutFixed<4, 1>, productSumOutFixed<4, 2>, productSumOutFixed<4, 3>},
+    };
+    if (n_factors < 2 || n_factors > SMALL_KERNEL_MAX_FACTORS || summedCard < 1 || summedCard > 3 || n_kept > SMALL_KERNEL_MAX_KEPT)
+        return nullptr;
+    return kernels[n_factors - 2][summedCard - 1];
+}
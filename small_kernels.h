@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+    Versions of the factor kernels for the shapes that make up most of the work on typical networks:
+    tables over a few binary or ternary variables, and eliminations of one binary or ternary variable
+    from the product of a few factors. The cardinality and the number of factors are template
+    parameters, so the loops over them have constant bounds and are unrolled completely.
+
+    Each find function looks at the cardinality signature of an operation and returns the kernel
+    instantiated for it, or nullptr when there is none and the generic kernel has to be used.
+    Every kernel computes each output entry with the same operations in the same order as the
+    generic one (products from the first factor to the last, sums starting from 0 in the order
+    of the summed values), so the results are bit-identical.
+*/
+
+/*
+    out[i] = a[sum of digit_k(i) * strideA[k]] * b[sum of digit_k(i) * strideB[k]] for the whole result,
+    a table over n_vars variables all with the same cardinality, the last one changing fastest.
+*/
+typedef void (*ProductKernel)(const double* a, const size_t* strideA, const double* b, const size_t* strideB, double* out);
+//Up to 4 binary or 3 ternary variables
+ProductKernel findProductKernel(size_t n_vars, size_t card);
+
+//The same contract as sumOutBlocks, computing the outputs [begin, end)
+typedef void (*SumOutKernel)(const double* in, double* out, size_t begin, size_t end, size_t inner);
+//Binary and ternary variables, on tables of at most SMALL_SUM_OUT_ENTRIES entries (the SIMD kernels are faster on bigger ones)
+constexpr size_t SMALL_SUM_OUT_ENTRIES = 64;
+SumOutKernel findSumOutKernel(size_t card, size_t entries);
+
+/*
+    The product of n_factors tables with one variable summed out, computing the result entries [begin, end).
+    The layout of the strides is the one of factorProductSumOut: keptStrides[f * n_kept + k] is the stride
+    in tables[f] of the k-th kept variable and summedStrides[f] the one of the summed variable
+    (0 when the factor does not contain it).
+    With summedCard == 1 nothing is summed out and summedStrides is not read.
+*/
+typedef void (*ProductSumOutKernel)(const double* const* tables, const size_t* keptStrides, const size_t* keptCards, size_t n_kept,
+                                    const size_t* summedStrides, double* out, size_t begin, size_t end);
+constexpr size_t SMALL_KERNEL_MAX_FACTORS = 4;
+constexpr size_t SMALL_KERNEL_MAX_KEPT = 64;
+//2 to SMALL_KERNEL_MAX_FACTORS factors, a summed variable of cardinality 2 or 3 (or none, summedCard == 1), at most SMALL_KERNEL_MAX_KEPT kept variables
+ProductSumOutKernel findProductSumOutKernel(size_t n_factors, size_t summedCard, size_t n_kept);
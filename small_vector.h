@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+/*
+    A vector which keeps its first N elements inside the object itself.
+    Factors almost always have a handful of variables, so storing their
+    cardinalities and strides inline avoids a heap allocation for every factor.
+    When more than N elements are pushed, the whole content moves to a std::vector.
+    It is meant only for trivially copyable types like VarId and size_t.
+*/
+template <typename T, size_t N>
+class SmallVector {
+public:
+    SmallVector() = default;
+
+    SmallVector(size_t count, const T& value) {
+        resize(count, value);
+    }
+
+    SmallVector(std::initializer_list<T> init) {
+        for (const T& value : init)
+            push_back(value);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T* data() { return count > N ? heap.data() : inline_data; }
+    const T* data() const { return count > N ? heap.data() : inline_data; }
+
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+
+    T* begin() { return data(); }
+    T* end() { return data() + count; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + count; }
+
+    T& back() { return data()[count - 1]; }
+    const T& back() const { return data()[count - 1]; }
+
+    void push_back(const T& value) {
+        if (count < N) {
+            inline_data[count++] = value;
+            return;
+        }
+        if (count == N)
+            heap.assign(inline_data, inline_data + N);
+        heap.push_back(value);
+        ++count;
+    }
+
+    void resize(size_t new_count, const T& value = T()) {
+        while (count > new_count) pop_back();
+        while (count < new_count) push_back(value);
+    }
+
+    void pop_back() {
+        --count;
+        if (count == N) {
+            for (size_t i = 0; i < N; ++i) inline_data[i] = heap[i];
+            heap.clear();
+        } else if (count > N)
+            heap.pop_back();
+    }
+
+    void clear() {
+        count = 0;
+        heap.clear();
+    }
+
+    bool operator==(const SmallVector& other) const {
+        if (count != other.count) return false;
+        for (size_t i = 0; i < count; ++i)
+            if (!((*this)[i] == other[i])) return false;
+        return true;
+    }
+    bool operator!=(const SmallVector& other) const { return !(*this == other); }
+
+private:
+    T inline_data[N] = {};
+    std::vector<T> heap;
+    size_t count = 0;
+};
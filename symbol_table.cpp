@@ -0,0 +1,36 @@
+#include "symbol_table.h"
+
+SymbolTable::SymbolTable(const SymbolTable& other) {
+    *this = other;
+}
+
+SymbolTable& SymbolTable::operator=(const SymbolTable& other) {
+    if (this == &other) return *this;
+    names.clear();
+    index.clear();
+    for (const auto& text : other.names) intern(text);
+    return *this;
+}
+
+SymbolId SymbolTable::intern(std::string_view text) {
+    auto it = index.find(text);
+    if (it != index.end()) return it->second;
+
+    const SymbolId id = static_cast<SymbolId>(names.size());
+    names.emplace_back(text);
+    index.emplace(names.back(), id);
+    return id;
+}
+
+SymbolId SymbolTable::find(std::string_view text) const {
+    auto it = index.find(text);
+    return it == index.end() ? NONE : it->second;
+}
+
+std::string_view SymbolTable::name(SymbolId id) const {
+    return names.at(id);
+}
+
+size_t SymbolTable::size() const {
+    return names.size();
+}
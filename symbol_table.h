@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+typedef uint32_t SymbolId;
+
+/*
+    The names of a network, each one stored once and identified by a dense SymbolId.
+    The Lexer interns every word it reads, so the variables and their values are handled
+    as integers from the parser on, and only resolved back to text when printing.
+    The same text always gets the same id, ids are given in order starting from 0.
+*/
+class SymbolTable {
+public:
+    static constexpr SymbolId NONE = UINT32_MAX;
+
+    SymbolTable() = default;
+    //The index points into the names, so a copy rebuilds it
+    SymbolTable(const SymbolTable& other);
+    SymbolTable& operator=(const SymbolTable& other);
+    SymbolTable(SymbolTable&&) = default;
+    SymbolTable& operator=(SymbolTable&&) = default;
+
+    SymbolId intern(std::string_view text);
+    //NONE if text was never interned
+    SymbolId find(std::string_view text) const;
+    std::string_view name(SymbolId id) const;
+    size_t size() const;
+
+private:
+    std::deque<std::string> names; //a deque never moves its elements, so the views in index stay valid
+    std::unordered_map<std::string_view, SymbolId> index;
+};
@@ -0,0 +1,1583 @@
+#include "../parser.h"
+#include "../variable_elimination.h"
+#include "../junction_tree.h"
+#include "../thread_pool.h"
+#include "../simd_kernels.h"
+#include "../mapped_file.h"
+#include "../compiled_network.h"
+#include "../small_kernels.h"
+#include "../typed_factor.h"
+#include "../sampling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+/*
+    Checks against plain reference implementations, on random factors and random networks:
+        - the indexes of Factor, and factorProduct and factorSumOut against loops over the assignments
+        - calculateMarginal against the marginal computed from the whole joint distribution
+        - the elimination orders against a greedy planner which recomputes every score at every step
+        - the marginals of the junction tree against the joint distribution
+        - factorReduce, and the queries with evidence of both engines
+        - the batches, with and without the factors in the cache, against the queries one at a time
+        - the thread pool, and the same bits from the queries and the kernels on any number of threads
+        - the SIMD kernels on every instruction set against plain loops
+        - factorProductSumOut against the reference, also with the kernels for binary and ternary
+          variables, and the factor arena
+        - the tokens of the lexer and the tables of the parser, from a mapped file, a stream or a string,
+          and the networks and errors of the blocks parsed on several threads or built while parsing
+        - readCompiledNetwork(writeCompiledNetwork(x)) against x, the flat layout of the networks and
+          the factors over their CPTs
+    Returns 1 if a check fails.
+*/
+
+static size_t failures = 0;
+
+#define CHECK(condition, message)                                                        \
+    do {                                                                                 \
+        if (!(condition)) {                                                              \
+            ++failures;                                                                  \
+            std::cerr << "FAILED " << __LINE__ << ": " << message << std::endl;          \
+        }                                                                                \
+    } while (0)
+
+// ---------- Reference kernels ----------
+
+//The entry of f for the values of all the variables, indexed by VarId
+static double entryAt(const Factor& f, const std::vector<size_t>& values) {
+    size_t index = 0;
+    for (size_t k = 0; k < f.variables.size(); ++k) index += values[f.variables[k]] * f.strides[k];
+    return f.values[index];
+}
+
+/*
+    The product of factors with summed out, one assignment at a time: the result is over the other
+    variables sorted by VarId, and each entry adds the products (from the first factor to the last)
+    in the order of the assignments of the summed variables, starting from 0.
+*/
+static Factor referenceProductSumOut(const std::vector<Factor>& factors, const std::vector<VarId>& summed, size_t n_vars,
+                                     const std::vector<size_t>& cards) {
+    std::vector<bool> in_scope(n_vars, false), is_summed(n_vars, false);
+    for (const auto& f : factors)
+        for (VarId var : f.variables) in_scope[var] = true;
+    for (VarId var : summed) is_summed[var] = true;
+
+    Factor::VarList kept;
+    Factor::SizeList kept_cards;
+    std::vector<VarId> summed_vars;
+    for (VarId var = 0; var < n_vars; ++var) {
+        if (!in_scope[var]) continue;
+        if (is_summed[var]) summed_vars.push_back(var);
+        else {
+            kept.push_back(var);
+            kept_cards.push_back(cards[var]);
+        }
+    }
+
+    Factor result(kept, kept_cards);
+    std::vector<size_t> values(n_vars, 0);
+    Factor::SizeList assignment;
+    for (size_t i = 0; i < result.values.size(); ++i) {
+        result.getAssignment(i, assignment);
+        for (size_t k = 0; k < kept.size(); ++k) values[kept[k]] = assignment[k];
+        for (VarId var : summed_vars) values[var] = 0;
+
+        double sum = 0.0;
+        while (true) {
+            double product = entryAt(factors[0], values);
+            for (size_t f = 1; f < factors.size(); ++f) product *= entryAt(factors[f], values);
+            sum += product;
+
+            size_t s = summed_vars.size();
+            while (s > 0 && ++values[summed_vars[s - 1]] == cards[summed_vars[s - 1]]) values[summed_vars[--s]] = 0;
+            if (s == 0) break;
+        }
+        result.values[i] = sum;
+    }
+    return result;
+}
+
+/*
+    The largest difference between the entries of a and b, which must have the same variables (in
+    any order); infinity if they do not. The kernels keep the order of the scope of their operands,
+    the reference sorts it by VarId.
+*/
+static double largestDifference(const Factor& a, const Factor& b) {
+    if (a.variables.size() != b.variables.size() || a.values.size() != b.values.size())
+        return std::numeric_limits<double>::infinity();
+    std::vector<size_t> position(b.variables.size());
+    for (size_t k = 0; k < b.variables.size(); ++k) {
+        const int at = a.indexOf(b.variables[k]);
+        if (at < 0) return std::numeric_limits<double>::infinity();
+        position[k] = static_cast<size_t>(at);
+    }
+    double largest = 0;
+    Factor::SizeList assignment;
+    for (size_t i = 0; i < b.values.size(); ++i) {
+        b.getAssignment(i, assignment);
+        size_t index = 0;
+        for (size_t k = 0; k < position.size(); ++k) index += assignment[k] * a.strides[position[k]];
+        const double difference = std::abs(a.values[index] - b.values[i]);
+        if (std::isnan(difference)) return std::numeric_limits<double>::infinity();
+        largest = std::max(largest, difference);
+    }
+    return largest;
+}
+
+//The same bits
+static bool sameFactor(const Factor& a, const Factor& b) {
+    return largestDifference(a, b) == 0;
+}
+
+// ---------- Random networks ----------
+
+struct RandomNetwork {
+    std::vector<size_t> cards;
+    std::vector<std::vector<VarId>> parents;
+    std::vector<std::vector<double>> tables; //parents first, the variable last and fastest
+    std::string bif;
+};
+
+/*
+    Variables v0 ... v(n-1) with values s0, s1, ..., each with up to 3 parents among the previous
+    ones. A fraction zeros of the entries are 0 (a row is never all zeros).
+    Every variable has card values, or 2 or 3 at random when card is 0.
+*/
+static RandomNetwork randomNetwork(std::mt19937_64& rng, size_t n_vars, double zeros, size_t card = 0) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    RandomNetwork net;
+    std::ostringstream bif;
+    bif.precision(17);
+    bif << std::showpoint; //The parser reads the entries as floating point literals only
+    bif << "network test {\n}\n";
+    for (size_t v = 0; v < n_vars; ++v) {
+        net.cards.push_back(card > 0 ? card : 2 + rng() % 2);
+        bif << "variable v" << v << " {\n  type discrete [ " << net.cards[v] << " ] {";
+        for (size_t value = 0; value < net.cards[v]; ++value) bif << (value ? ", " : " ") << "s" << value;
+        bif << " };\n}\n";
+    }
+    for (size_t v = 0; v < n_vars; ++v) {
+        std::vector<VarId> parents;
+        for (size_t tries = rng() % 4; tries > 0 && v > 0; --tries) {
+            VarId parent = static_cast<VarId>(rng() % v);
+            if (std::find(parents.begin(), parents.end(), parent) == parents.end()) parents.push_back(parent);
+        }
+        size_t rows = 1;
+        for (VarId parent : parents) rows *= net.cards[parent];
+
+        bif << "probability ( v" << v;
+        for (size_t p = 0; p < parents.size(); ++p) bif << (p ? ", v" : " | v") << parents[p];
+        bif << " ) {\n";
+        std::vector<double> table;
+        std::vector<size_t> row_values(parents.size(), 0);
+        for (size_t row = 0; row < rows; ++row) {
+            std::vector<double> entries(net.cards[v]);
+            double total = 0;
+            for (double& e : entries) total += e = uniform(rng) < zeros ? 0.0 : uniform(rng);
+            if (total == 0) total = entries[0] = 1.0;
+            bif << (parents.empty() ? "  table" : "  (");
+            for (size_t p = 0; p < parents.size(); ++p) bif << (p ? ", s" : "s") << row_values[p];
+            if (!parents.empty()) bif << ")";
+            for (size_t e = 0; e < entries.size(); ++e) {
+                entries[e] /= total;
+                table.push_back(entries[e]);
+                bif << (e ? ", " : " ") << entries[e];
+            }
+            bif << ";\n";
+            for (size_t p = parents.size(); p-- > 0;) {
+                if (++row_values[p] < net.cards[parents[p]]) break;
+                row_values[p] = 0;
+            }
+        }
+        bif << "}\n";
+        net.parents.push_back(parents);
+        net.tables.push_back(table);
+    }
+    net.bif = bif.str();
+    return net;
+}
+
+//A file in the temporary directory with the given text, for the tests of the inputs of the parser
+static std::filesystem::path writeTemporary(const std::string& text) {
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "bif_parser_tests.bif";
+    std::ofstream(path, std::ios::binary) << text;
+    return path;
+}
+
+static NetworkAST parseText(const std::string& text) {
+    Parser parser{std::string_view(text)};
+    return parser.parse();
+}
+
+static BayesianNetwork buildNetwork(const RandomNetwork& net) {
+    return BayesianNetwork(parseText(net.bif));
+}
+
+//P(query | evidence) from the whole joint distribution, observed[v] is -1 for the unobserved variables
+static std::vector<double> bruteForceMarginal(const RandomNetwork& net, VarId query, const std::vector<int>& observed) {
+    const size_t n = net.cards.size();
+    std::vector<double> marginal(net.cards[query], 0.0);
+    std::vector<size_t> values(n, 0);
+    while (true) {
+        bool consistent = true;
+        for (size_t v = 0; v < n && consistent; ++v) consistent = observed[v] == -1 || values[v] == static_cast<size_t>(observed[v]);
+        if (consistent) {
+            double p = 1.0;
+            for (size_t v = 0; v < n; ++v) {
+                size_t index = 0;
+                for (VarId parent : net.parents[v]) index = index * net.cards[parent] + values[parent];
+                p *= net.tables[v][index * net.cards[v] + values[v]];
+            }
+            marginal[values[query]] += p;
+        }
+        size_t v = n;
+        while (v > 0 && ++values[v - 1] == net.cards[v - 1]) values[--v] = 0;
+        if (v == 0) break;
+    }
+    double total = 0;
+    for (double p : marginal) total += p;
+    if (total == 0) return {};
+    for (double& p : marginal) p /= total;
+    return marginal;
+}
+
+static bool closeTo(const Factor& marginal, const std::vector<double>& expected, double tolerance) {
+    if (marginal.values.size() != expected.size()) return false;
+    for (size_t i = 0; i < expected.size(); ++i)
+        if (std::abs(marginal.values[i] - expected[i]) > tolerance) return false;
+    return true;
+}
+
+//A factor over 1 to max_scope of the variables of shape, in a random order, with a fraction zeros of 0 entries
+static Factor randomFactor(std::mt19937_64& rng, const RandomNetwork& shape, size_t max_scope, double zeros) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<VarId> vars(shape.cards.size());
+    for (VarId v = 0; v < vars.size(); ++v) vars[v] = v;
+    std::shuffle(vars.begin(), vars.end(), rng);
+    vars.resize(1 + rng() % std::min(max_scope, vars.size()));
+    Factor::VarList scope;
+    Factor::SizeList cards;
+    for (VarId var : vars) {
+        scope.push_back(var);
+        cards.push_back(shape.cards[var]);
+    }
+    Factor f(scope, cards);
+    for (double& v : f.values) v = uniform(rng) < zeros ? 0.0 : uniform(rng);
+    return f;
+}
+
+// ---------- Tests ----------
+
+//getIndex and getAssignment are inverse, and the last variable changes fastest
+static void testFactorIndexes(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    for (size_t round = 0; round < 50; ++round) {
+        const Factor f = randomFactor(rng, shape, 4, 0.0);
+        CHECK(f.strides[f.variables.size() - 1] == 1, "stride of the last variable");
+        Factor::SizeList assignment;
+        for (size_t i = 0; i < f.values.size(); ++i) {
+            f.getAssignment(i, assignment);
+            CHECK(f.getIndex(assignment) == i, "getIndex(getAssignment(" << i << "))");
+        }
+        for (size_t k = 0; k < f.variables.size(); ++k)
+            CHECK(f.indexOf(f.variables[k]) == static_cast<int>(k) && f.contains(f.variables[k]), "indexOf");
+        for (VarId var = 0; var < shape.cards.size(); ++var)
+            if (std::find(f.variables.begin(), f.variables.end(), var) == f.variables.end())
+                CHECK(f.indexOf(var) == -1 && !f.contains(var), "indexOf of a missing variable");
+    }
+}
+
+//factorProduct and factorSumOut give the same bits as the reference
+static void testKernels(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork bn = buildNetwork(shape);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 200; ++round) {
+        const Factor a = randomFactor(rng, shape, 4, round % 3 == 0 ? 0.8 : 0.1);
+        const Factor b = randomFactor(rng, shape, 4, 0.1);
+        const VarId summed = a.variables[rng() % a.variables.size()];
+        CHECK(sameFactor(bn.factorProduct(a, b), referenceProductSumOut({a, b}, {}, n_vars, shape.cards)), "factorProduct");
+        CHECK(sameFactor(bn.factorSumOut(a, summed), referenceProductSumOut({a}, {summed}, n_vars, shape.cards)), "factorSumOut");
+    }
+}
+
+//The odometer walks of factorProduct and factorSumOut on the scopes where its strides are special
+static void testKernelScopes(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork bn = buildNetwork(shape);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 50; ++round) {
+        const Factor a = randomFactor(rng, shape, 4, 0.1);
+
+        //The same variables in another order, and the variables of a alone
+        Factor::VarList reversed, first;
+        Factor::SizeList reversed_cards, first_cards;
+        for (size_t k = a.variables.size(); k-- > 0;) {
+            reversed.push_back(a.variables[k]);
+            reversed_cards.push_back(a.cardinalities[k]);
+        }
+        first.push_back(a.variables[0]);
+        first_cards.push_back(a.cardinalities[0]);
+        Factor same_scope(reversed, reversed_cards), subset(first, first_cards);
+        for (double& v : same_scope.values) v = static_cast<double>(rng() % 1000) / 1000;
+        for (double& v : subset.values) v = static_cast<double>(rng() % 1000) / 1000;
+
+        //A factor over the variables which a does not have
+        Factor::VarList others;
+        Factor::SizeList other_cards;
+        for (VarId var = 0; var < n_vars; ++var)
+            if (!a.contains(var)) {
+                others.push_back(var);
+                other_cards.push_back(shape.cards[var]);
+            }
+        Factor disjoint(others, other_cards);
+        for (double& v : disjoint.values) v = static_cast<double>(rng() % 1000) / 1000;
+
+        for (const Factor* b : {&same_scope, &subset, &disjoint}) {
+            CHECK(sameFactor(bn.factorProduct(a, *b), referenceProductSumOut({a, *b}, {}, n_vars, shape.cards)), "factorProduct");
+            CHECK(sameFactor(bn.factorProduct(*b, a), referenceProductSumOut({*b, a}, {}, n_vars, shape.cards)), "factorProduct");
+        }
+        //Summing out the only variable leaves a single entry
+        CHECK(sameFactor(bn.factorSumOut(subset, first[0]), referenceProductSumOut({subset}, {first[0]}, n_vars, shape.cards)),
+              "factorSumOut of the only variable");
+    }
+}
+
+//calculateMarginal against the joint distribution
+static void testMarginals(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 40; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 8, round % 2 ? 0.3 : 0.0);
+        BayesianNetwork bn = buildNetwork(net);
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        const std::vector<double> expected = bruteForceMarginal(net, query, std::vector<int>(net.cards.size(), -1));
+        CHECK(closeTo(bn.calculateMarginal("v" + std::to_string(query)), expected, 1e-12), "marginal of v" << query);
+    }
+}
+
+/*
+    The greedy elimination order recomputing every score at every step, with the induced width and
+    the largest clique (in entries) it forms, to compare with the incremental updates of the planner
+*/
+static EliminationPlan referencePlan(const std::vector<std::vector<VarId>>& scopes, const std::vector<size_t>& cards,
+                                     std::vector<VarId> pending, EliminationHeuristic heuristic) {
+    std::vector<std::set<VarId>> graph(cards.size());
+    for (const auto& scope : scopes)
+        for (VarId u : scope)
+            for (VarId w : scope)
+                if (u != w) graph[u].insert(w);
+
+    EliminationPlan plan;
+    std::sort(pending.begin(), pending.end());
+    while (!pending.empty()) {
+        size_t best = 0;
+        double best_score = 0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const std::set<VarId>& neighbours = graph[pending[i]];
+            double score = 0;
+            if (heuristic == EliminationHeuristic::MIN_DEGREE) score = static_cast<double>(neighbours.size());
+            else
+                for (VarId u : neighbours)
+                    for (VarId w : neighbours)
+                        if (u < w && !graph[u].count(w))
+                            score += heuristic == EliminationHeuristic::MIN_FILL ? 1.0 : static_cast<double>(cards[u] * cards[w]);
+            if (i == 0 || score < best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        const VarId var = pending[best];
+        pending.erase(pending.begin() + static_cast<std::ptrdiff_t>(best));
+        const std::set<VarId> neighbours = graph[var];
+        size_t clique = cards[var];
+        for (VarId u : neighbours) clique *= cards[u];
+        plan.order.push_back(var);
+        plan.inducedWidth = std::max(plan.inducedWidth, neighbours.size());
+        plan.maxFactorSize = std::max(plan.maxFactorSize, clique);
+        for (VarId u : neighbours) {
+            graph[u].erase(var);
+            for (VarId w : neighbours)
+                if (u != w) graph[u].insert(w);
+        }
+        graph[var].clear();
+    }
+    return plan;
+}
+
+//The planner against the reference on known and random graphs, and the marginals with every heuristic
+static void testEliminationOrder(std::mt19937_64& rng) {
+    const EliminationHeuristic heuristics[] = {EliminationHeuristic::MIN_DEGREE, EliminationHeuristic::MIN_FILL,
+                                               EliminationHeuristic::WEIGHTED_MIN_FILL};
+    for (EliminationHeuristic heuristic : heuristics) {
+        const EliminationOrderPlanner planner(heuristic);
+        //A chain never needs more than two variables in a factor, a cycle of 4 needs three
+        const EliminationPlan chain = planner.plan({{0}, {0, 1}, {1, 2}, {2, 3}}, {2, 3, 2, 3}, {1, 2, 3});
+        CHECK(chain.inducedWidth == 1, toString(heuristic) << " on a chain");
+        const EliminationPlan cycle = planner.plan({{0, 1}, {1, 2}, {2, 3}, {3, 0}}, {2, 2, 2, 2}, {0, 1, 2, 3});
+        CHECK(cycle.inducedWidth == 2 && cycle.maxFactorSize == 8, toString(heuristic) << " on a cycle");
+        CHECK(parseEliminationHeuristic(toString(heuristic)) == heuristic, "parseEliminationHeuristic");
+    }
+
+    for (size_t round = 0; round < 60; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 12, 0.0);
+        const size_t n = net.cards.size();
+        std::vector<std::vector<VarId>> scopes;
+        for (VarId v = 0; v < n; ++v) {
+            scopes.push_back(net.parents[v]);
+            scopes.back().push_back(v);
+        }
+        const VarId query = static_cast<VarId>(rng() % n);
+        std::vector<VarId> to_eliminate;
+        for (VarId v = 0; v < n; ++v)
+            if (v != query) to_eliminate.push_back(v);
+
+        const EliminationHeuristic heuristic = heuristics[round % 3];
+        const EliminationPlan plan = EliminationOrderPlanner(heuristic).plan(scopes, net.cards, to_eliminate);
+        const EliminationPlan expected = referencePlan(scopes, net.cards, to_eliminate, heuristic);
+        CHECK(plan.order == expected.order, toString(heuristic) << " order");
+        CHECK(plan.inducedWidth == expected.inducedWidth && plan.maxFactorSize == expected.maxFactorSize,
+              toString(heuristic) << " induced width and largest factor");
+
+        BayesianNetwork bn = buildNetwork(net);
+        bn.setEliminationHeuristic(heuristic);
+        CHECK(closeTo(bn.calculateMarginal("v" + std::to_string(query)), bruteForceMarginal(net, query, std::vector<int>(n, -1)), 1e-12),
+              "marginal with " << toString(heuristic));
+    }
+}
+
+//Every marginal of one junction tree calibration against the joint distribution
+static void testJunctionTree(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 40; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 10, round % 2 ? 0.3 : 0.0);
+        BayesianNetwork bn = buildNetwork(net);
+        const size_t n = net.cards.size();
+        JunctionTree tree(bn, round % 3 == 0 ? EliminationHeuristic::MIN_DEGREE : EliminationHeuristic::MIN_FILL);
+        const std::vector<Factor> marginals = tree.getAllMarginals();
+        CHECK(marginals.size() == n, "one marginal per variable");
+        for (VarId var = 0; var < n && var < marginals.size(); ++var) {
+            const std::vector<double> expected = bruteForceMarginal(net, var, std::vector<int>(n, -1));
+            CHECK(closeTo(marginals[var], expected, 1e-12), "junction tree marginal of v" << var);
+            CHECK(closeTo(tree.getMarginal("v" + std::to_string(var)), expected, 1e-12), "getMarginal of v" << var);
+        }
+    }
+}
+
+//Up to max_observed random variables other than query observed, as the evidence of the queries and as observed[v]
+static Evidence randomEvidence(std::mt19937_64& rng, const RandomNetwork& net, VarId query, size_t max_observed,
+                               std::vector<int>& observed) {
+    Evidence evidence;
+    observed.assign(net.cards.size(), -1);
+    for (size_t e = rng() % (max_observed + 1); e > 0; --e) {
+        const VarId var = static_cast<VarId>(rng() % net.cards.size());
+        if (var == query) continue;
+        observed[var] = static_cast<int>(rng() % net.cards[var]);
+        evidence["v" + std::to_string(var)] = "s" + std::to_string(observed[var]);
+    }
+    return evidence;
+}
+
+//factorReduce against the entries it keeps, and the queries with evidence against the joint distribution
+static void testEvidence(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork shape_bn = buildNetwork(shape);
+    for (size_t round = 0; round < 50; ++round) {
+        const Factor f = randomFactor(rng, shape, 4, 0.1);
+        const size_t position = rng() % f.variables.size();
+        const size_t value = rng() % f.cardinalities[position];
+        const Factor reduced = shape_bn.factorReduce(f, f.variables[position], value);
+        CHECK(reduced.variables.size() + 1 == f.variables.size() && !reduced.contains(f.variables[position]), "factorReduce scope");
+        Factor::SizeList assignment, full;
+        for (size_t i = 0; i < reduced.values.size(); ++i) {
+            reduced.getAssignment(i, assignment);
+            full.clear();
+            for (size_t k = 0, r = 0; k < f.variables.size(); ++k) full.push_back(k == position ? value : assignment[r++]);
+            CHECK(reduced.values[i] == f.getValue(full), "factorReduce entry");
+        }
+    }
+
+    for (size_t round = 0; round < 80; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 9, round % 2 ? 0.3 : 0.0);
+        BayesianNetwork bn = buildNetwork(net);
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, query, 3, observed);
+        const std::vector<double> expected = bruteForceMarginal(net, query, observed);
+        if (expected.empty()) continue;
+        CHECK(closeTo(bn.calculateMarginal("v" + std::to_string(query), evidence), expected, 1e-12), "marginal of v" << query << " with evidence");
+
+        JunctionTree tree(bn, EliminationHeuristic::MIN_FILL, evidence);
+        const std::vector<Factor> marginals = tree.getAllMarginals();
+        for (VarId var = 0; var < net.cards.size(); ++var)
+            CHECK(closeTo(marginals[var], bruteForceMarginal(net, var, observed), 1e-12), "junction tree marginal of v" << var << " with evidence");
+    }
+
+    //Evidence of probability 0 is an error, also when the zero is in a CPT pruned from the query or whose variables are all observed
+    size_t impossible = 0;
+    for (size_t round = 0; round < 200; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 4, 0.6);
+        BayesianNetwork bn = buildNetwork(net);
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, 0, net.cards.size() - 1, observed);
+        if (!bruteForceMarginal(net, 0, observed).empty()) continue;
+        ++impossible;
+        for (VarId query = 0; query < net.cards.size(); ++query) {
+            bool thrown = false;
+            try {
+                bn.calculateMarginal("v" + std::to_string(query), evidence);
+            } catch (const std::exception&) {
+                thrown = true;
+            }
+            CHECK(thrown, "marginal of v" << query << " with evidence of probability 0");
+        }
+        bool thrown = false;
+        try {
+            JunctionTree tree(bn, EliminationHeuristic::MIN_FILL, evidence);
+            tree.getAllMarginals();
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        CHECK(thrown, "junction tree with evidence of probability 0");
+    }
+    CHECK(impossible > 0, "some evidence has probability 0");
+
+    //The pruned ancestors of evidence already answered are not summed out again, other evidence still is
+    {
+        BayesianNetwork pruned(parseText("network test {\n}\n"
+                                         "variable a {\n  type discrete [ 2 ] { a0, a1 };\n}\n"
+                                         "variable b {\n  type discrete [ 2 ] { b0, b1 };\n}\n"
+                                         "variable c {\n  type discrete [ 2 ] { c0, c1 };\n}\n"
+                                         "probability ( a ) {\n  table 0.3, 0.7;\n}\n"
+                                         "probability ( b | a ) {\n  (a0) 1.0, 0.0;\n  (a1) 1.0, 0.0;\n}\n"
+                                         "probability ( c ) {\n  table 0.4, 0.6;\n}\n"));
+        const Factor first = pruned.calculateMarginal("c", {{"b", "b0"}});
+        const size_t checked = pruned.getAllocationStats().back().allocations;
+        const Factor second = pruned.calculateMarginal("c", {{"b", "b0"}});
+        CHECK(sameFactor(first, second), "the same marginal with the evidence already checked");
+        CHECK(pruned.getAllocationStats().back().allocations < checked, "the evidence is checked once");
+        bool thrown = false;
+        try {
+            pruned.calculateMarginal("c", {{"b", "b1"}});
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        CHECK(thrown, "other evidence is still checked");
+    }
+
+    //Unknown names are errors
+    RandomNetwork net = randomNetwork(rng, 3, 0.0);
+    BayesianNetwork bn = buildNetwork(net);
+    bool thrown = false;
+    try {
+        bn.calculateMarginal("v0", {{"v1", "missing"}});
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    CHECK(thrown, "evidence with an unknown value");
+}
+
+//A batch gives the same bits as the queries one at a time, and a second run takes its factors from the cache
+static void testBatch(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 3 + rng() % 8, 0.0);
+        BayesianNetwork single = buildNetwork(net), batched = buildNetwork(net);
+        std::vector<Query> queries;
+        for (size_t q = 0; q < 8; ++q) {
+            const VarId query = static_cast<VarId>(rng() % net.cards.size());
+            std::vector<int> observed;
+            queries.push_back({"v" + std::to_string(query), randomEvidence(rng, net, query, 2, observed)});
+        }
+        //The same query twice in a row must be answered from the cache
+        queries.push_back(queries.back());
+
+        const std::vector<Factor> first = batched.calculateMarginals(queries);
+        CHECK(first.size() == queries.size(), "one marginal per query");
+        CHECK(batched.getCacheStats().hits > 0, "a repeated query hits the cache");
+        const std::vector<Factor> second = batched.calculateMarginals(queries);
+        for (size_t q = 0; q < queries.size() && q < first.size(); ++q) {
+            const Factor expected = single.calculateMarginal(queries[q].variable, queries[q].evidence);
+            CHECK(sameFactor(first[q], expected), "batch query " << q);
+            CHECK(sameFactor(second[q], expected), "cached batch query " << q);
+        }
+
+        batched.clearCache();
+        CHECK(batched.getCacheStats().entries == 0, "clearCache");
+    }
+}
+
+//TaskGroup runs every task once, nested groups do not deadlock, and the exception of a task reaches wait()
+static void testThreadPool() {
+    ThreadPool pool(4);
+    std::atomic<size_t> count{0};
+    TaskGroup outer(pool);
+    for (size_t i = 0; i < 16; ++i)
+        outer.run([&] {
+            TaskGroup inner(pool);
+            for (size_t j = 0; j < 16; ++j) inner.run([&] { ++count; });
+            inner.wait();
+        });
+    outer.wait();
+    CHECK(count == 256, "every task runs once, ran " << count);
+
+    TaskGroup failing(pool);
+    failing.run([] { throw std::runtime_error("task error"); });
+    bool thrown = false;
+    try {
+        failing.wait();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown, "the exception of a task is rethrown by wait");
+}
+
+//The queries give the same bits on any number of threads
+static void testParallelElimination(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 30; ++round) {
+        RandomNetwork net = randomNetwork(rng, 4 + rng() % 12, round % 2 ? 0.3 : 0.0);
+        BayesianNetwork sequential = buildNetwork(net), parallel = buildNetwork(net);
+        parallel.setThreadCount(2 + round % 4);
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, query, 3, observed);
+        if (bruteForceMarginal(net, query, observed).empty()) continue;
+        const std::string name = "v" + std::to_string(query);
+        CHECK(sameFactor(parallel.calculateMarginal(name, evidence), sequential.calculateMarginal(name, evidence)),
+              "marginal of " << name << " on " << parallel.getThreadCount() << " threads");
+    }
+}
+
+//The kernels split between threads give the same bits as the reference, and the queries as one thread
+static void testParallelKernels(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 8, 0.0);
+    BayesianNetwork bn = buildNetwork(shape);
+    bn.setThreadCount(4);
+    bn.setParallelThreshold(1);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 100; ++round) {
+        const Factor a = randomFactor(rng, shape, 6, 0.1);
+        const Factor b = randomFactor(rng, shape, 6, 0.1);
+        const VarId summed = a.variables[rng() % a.variables.size()];
+        CHECK(sameFactor(bn.factorProduct(a, b), referenceProductSumOut({a, b}, {}, n_vars, shape.cards)), "parallel factorProduct");
+        CHECK(sameFactor(bn.factorSumOut(a, summed), referenceProductSumOut({a}, {summed}, n_vars, shape.cards)), "parallel factorSumOut");
+    }
+
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 4 + rng() % 10, 0.0);
+        BayesianNetwork sequential = buildNetwork(net), parallel = buildNetwork(net);
+        parallel.setThreadCount(3);
+        parallel.setParallelThreshold(1);
+        const std::string name = "v" + std::to_string(rng() % net.cards.size());
+        CHECK(sameFactor(parallel.calculateMarginal(name), sequential.calculateMarginal(name)), "marginal of " << name << " with split kernels");
+    }
+}
+
+//The SIMD kernels on tables of Value give the bits of plain loops on every level
+template <typename Value>
+static void testSimdTables(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const SimdLevel levels[] = {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512};
+    for (size_t round = 0; round < 100; ++round) {
+        const size_t card = 2 + rng() % 4, inner = 1 + rng() % 20, outer = 1 + rng() % 5;
+        std::vector<Value> in(outer * card * inner), small(card * inner);
+        for (Value& v : in) v = static_cast<Value>(uniform(rng));
+        for (Value& v : small) v = static_cast<Value>(uniform(rng));
+
+        std::vector<Value> sum_out(outer * inner, Value(0));
+        for (size_t b = 0; b < outer; ++b)
+            for (size_t t = 0; t < inner; ++t)
+                for (size_t j = 0; j < card; ++j) sum_out[b * inner + t] += in[(b * card + j) * inner + t];
+        std::vector<Value> inner_product(in.size()), outer_product(in.size());
+        for (size_t i = 0; i < in.size(); ++i) {
+            inner_product[i] = in[i] * small[i % small.size()];
+            outer_product[i] = in[i] * small[i / (in.size() / small.size())];
+        }
+
+        std::vector<Value> scalar_sum;
+        for (SimdLevel level : levels) {
+            setSimdLevel(level);
+            std::vector<Value> out(sum_out.size());
+            sumOutBlocks(in.data(), out.data(), 0, out.size(), inner, card);
+            CHECK(out == sum_out, "sumOutBlocks on " << toString(level));
+            out.assign(in.size(), Value(0));
+            multiplyBroadcastInner(in.data(), small.data(), out.data(), 0, out.size(), small.size());
+            CHECK(out == inner_product, "multiplyBroadcastInner on " << toString(level));
+            multiplyBroadcastOuter(in.data(), small.data(), out.data(), 0, out.size(), in.size() / small.size());
+            CHECK(out == outer_product, "multiplyBroadcastOuter on " << toString(level));
+
+            //Every level adds in the same order, so the sums have the same bits
+            const Value total = sumValues(in.data(), in.size());
+            if (level == SimdLevel::SCALAR) scalar_sum.assign(1, total);
+            CHECK(total == scalar_sum[0], "sumValues on " << toString(level));
+            out = in;
+            divideValues(out.data(), out.size(), total);
+            for (size_t i = 0; i < out.size(); ++i) CHECK(out[i] == in[i] / total, "divideValues on " << toString(level));
+        }
+        Value plain = 0;
+        for (Value v : in) plain += v;
+        CHECK(std::abs(scalar_sum[0] - plain) <= 4096 * std::numeric_limits<Value>::epsilon() * plain, "sumValues");
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+//The SIMD kernels on every level against plain loops, and factorProduct and factorSumOut against the reference
+static void testSimdKernels(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const SimdLevel levels[] = {SimdLevel::SCALAR, SimdLevel::AVX2, SimdLevel::AVX512};
+    for (SimdLevel level : levels) CHECK(parseSimdLevel(toString(level)) == level, "parseSimdLevel");
+    testSimdTables<double>(rng);
+    testSimdTables<float>(rng);
+
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork bn = buildNetwork(shape);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 100; ++round) {
+        const Factor a = randomFactor(rng, shape, 5, 0.1);
+        //The variables at the end or at the start of a, which take the broadcast products
+        const size_t length = 1 + rng() % a.variables.size();
+        Factor::VarList scope;
+        Factor::SizeList cards;
+        for (size_t k = 0; k < length; ++k) {
+            const size_t position = round % 2 ? a.variables.size() - length + k : k;
+            scope.push_back(a.variables[position]);
+            cards.push_back(a.cardinalities[position]);
+        }
+        Factor b(scope, cards);
+        for (double& v : b.values) v = uniform(rng);
+        const Factor c = randomFactor(rng, shape, 5, 0.1);
+        const VarId summed = a.variables[rng() % a.variables.size()];
+
+        for (SimdLevel level : levels) {
+            setSimdLevel(level);
+            CHECK(sameFactor(bn.factorProduct(a, b), referenceProductSumOut({a, b}, {}, n_vars, shape.cards)), "broadcast factorProduct on " << toString(level));
+            CHECK(sameFactor(bn.factorProduct(a, c), referenceProductSumOut({a, c}, {}, n_vars, shape.cards)), "factorProduct on " << toString(level));
+            CHECK(sameFactor(bn.factorSumOut(a, summed), referenceProductSumOut({a}, {summed}, n_vars, shape.cards)), "factorSumOut on " << toString(level));
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+//factorProductSumOut of one to three factors, summing out up to two variables, against the reference
+static void testFusedKernel(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork bn = buildNetwork(shape), parallel = buildNetwork(shape);
+    parallel.setThreadCount(4);
+    parallel.setParallelThreshold(1);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 200; ++round) {
+        std::vector<Factor> factors;
+        for (size_t f = 0, count = 1 + rng() % 3; f < count; ++f) factors.push_back(randomFactor(rng, shape, 4, 0.1));
+        //Up to two variables of the factors, sorted as the odometer of the reference walks them
+        std::vector<VarId> summed;
+        for (size_t s = rng() % 3; s > 0; --s) {
+            const Factor& f = factors[rng() % factors.size()];
+            const VarId var = f.variables[rng() % f.variables.size()];
+            if (std::find(summed.begin(), summed.end(), var) == summed.end()) summed.push_back(var);
+        }
+        std::sort(summed.begin(), summed.end());
+        Factor::VarList summed_list;
+        for (VarId var : summed) summed_list.push_back(var);
+
+        const Factor expected = referenceProductSumOut(factors, summed, n_vars, shape.cards);
+        CHECK(sameFactor(bn.factorProductSumOut(factors, summed_list), expected), "factorProductSumOut of " << factors.size()
+              << " factors and " << summed.size() << " variables");
+        CHECK(sameFactor(parallel.factorProductSumOut(factors, summed_list), expected), "parallel factorProductSumOut");
+    }
+}
+
+//The arena reuses released buffers, and the factors copied out of it go to the heap
+static void testFactorArena(std::mt19937_64& rng) {
+    FactorArena arena(4096);
+    void* first = arena.allocate(100);
+    void* second = arena.allocate(100);
+    CHECK(first != second, "two live buffers are different");
+    CHECK(reinterpret_cast<uintptr_t>(first) % 64 == 0 && reinterpret_cast<uintptr_t>(second) % 64 == 0, "buffers are aligned");
+    std::fill(static_cast<char*>(first), static_cast<char*>(first) + 100, 1);
+    std::fill(static_cast<char*>(second), static_cast<char*>(second) + 100, 2);
+    CHECK(static_cast<char*>(first)[99] == 1, "buffers do not overlap");
+    arena.deallocate(first, 100);
+    CHECK(arena.allocate(120) == first, "a released buffer is reused for the same size class");
+    void* big = arena.allocate(10000); //more than a block
+    std::fill(static_cast<char*>(big), static_cast<char*>(big) + 10000, 3);
+    arena.deallocate(big, 10000);
+    arena.deallocate(first, 120);
+    arena.deallocate(second, 100);
+    CHECK(arena.getStats().allocations == 4 && arena.getStats().peakBytes >= 10000 + 2 * 100, "arena stats");
+    const size_t reserved = arena.getStats().reservedBytes;
+    arena.reset();
+    CHECK(arena.getStats().allocations == 0 && arena.getStats().reservedBytes == reserved, "reset keeps the blocks");
+
+    //Several threads at once
+    std::vector<std::thread> threads;
+    std::atomic<size_t> corrupted{0};
+    for (size_t t = 0; t < 4; ++t)
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < 1000; ++i) {
+                const size_t bytes = 8 + (i * 37 + t) % 2000;
+                char* buffer = static_cast<char*>(arena.allocate(bytes));
+                std::fill(buffer, buffer + bytes, static_cast<char>(t));
+                if (std::count(buffer, buffer + bytes, static_cast<char>(t)) != static_cast<std::ptrdiff_t>(bytes)) ++corrupted;
+                arena.deallocate(buffer, bytes);
+            }
+        });
+    for (auto& thread : threads) thread.join();
+    CHECK(corrupted == 0, "buffers shared between threads");
+    arena.reset();
+
+    Factor in_arena({0, 1}, {2, 3}, &arena);
+    const double* table = static_cast<const Factor&>(in_arena).values.data();
+    const Factor copy = in_arena;
+    CHECK(copy.values.data() != table, "a copy has a table of its own");
+    const Factor moved = std::move(in_arena);
+    CHECK(moved.values.data() == table, "a move keeps the table");
+
+    //The arena is reused from one query to the next without changing the results
+    RandomNetwork net = randomNetwork(rng, 10, 0.2);
+    BayesianNetwork bn = buildNetwork(net);
+    for (size_t round = 0; round < 20; ++round) {
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        const std::vector<double> expected = bruteForceMarginal(net, query, std::vector<int>(net.cards.size(), -1));
+        CHECK(closeTo(bn.calculateMarginal("v" + std::to_string(query)), expected, 1e-12), "marginal after reusing the arena");
+        CHECK(bn.getAllocationStats().size() == 1, "allocation stats of the query");
+    }
+}
+
+//The tokens of the lexer, the values of the parsed tables, and the comments and errors of the grammar
+static void testLexer(std::mt19937_64& rng) {
+    const std::string text = "network \"My net\" { } /* a { comment } */ variable a_1 { type discrete [ 2 ] { yes, no }; }\n"
+                             "probability ( a_1 ) { table 0.25, 2.5e-1 1E3; } 2nd x.y-z";
+    const std::vector<std::pair<Token::Type, std::string>> expected = {
+        {Token::KEYWORD, "network"}, {Token::WORD, "My"}, {Token::WORD, "net"}, {Token::SYMBOL, "{"}, {Token::SYMBOL, "}"},
+        {Token::KEYWORD, "variable"}, {Token::WORD, "a_1"}, {Token::SYMBOL, "{"}, {Token::KEYWORD, "type"},
+        {Token::KEYWORD, "discrete"}, {Token::SYMBOL, "["}, {Token::DECIMAL_LITERAL, "2"}, {Token::SYMBOL, "]"},
+        {Token::SYMBOL, "{"}, {Token::WORD, "yes"}, {Token::WORD, "no"}, {Token::SYMBOL, "}"}, {Token::SYMBOL, ";"},
+        {Token::SYMBOL, "}"}, {Token::KEYWORD, "probability"}, {Token::SYMBOL, "("}, {Token::WORD, "a_1"},
+        {Token::SYMBOL, ")"}, {Token::SYMBOL, "{"}, {Token::KEYWORD, "table"}, {Token::FLOATING_POINT_LITERAL, "0.25"},
+        {Token::FLOATING_POINT_LITERAL, "2.5e-1"}, {Token::FLOATING_POINT_LITERAL, "1E3"}, {Token::SYMBOL, ";"},
+        {Token::SYMBOL, "}"}, {Token::WORD, "2nd"}, {Token::WORD, "x.y-z"}, {Token::END, ""}};
+    SymbolTable symbols;
+    Lexer lexer(std::string_view(text), symbols);
+    for (const auto& [type, value] : expected) {
+        const Token token = lexer.getNextToken();
+        CHECK(token.type == type && token.value == value, "token " << value << ", got " << token.value);
+        const bool named = type == Token::WORD || type == Token::DECIMAL_LITERAL;
+        CHECK(named ? symbols.name(token.symbol) == value : token.symbol == SymbolTable::NONE, "symbol of token " << value);
+        CHECK(text.compare(token.offset, token.value.size(), token.value) == 0, "offset of token " << value);
+    }
+
+    //The tables hold the numbers of the text exactly, with or without comments between the blocks
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 6, 0.2);
+        std::string commented = net.bif;
+        for (size_t at = 0; (at = commented.find("}\n", at)) != std::string::npos; at += 20) commented.insert(at + 2, "/* } { ; */\n");
+        for (const std::string& source : {net.bif, commented}) {
+            const NetworkAST network = parseText(source);
+            CHECK(network.variables.size() == net.cards.size() && network.probabilities.size() == net.cards.size(), "blocks");
+            for (size_t v = 0; v < network.probabilities.size() && v < net.cards.size(); ++v) {
+                CHECK(network.probabilities[v].table == net.tables[v], "table of v" << v);
+                CHECK(network.variables[v].domain.size() == net.cards[v], "domain of v" << v);
+            }
+        }
+    }
+
+    for (const std::string bad : {"network x { } variable @ { }", "network x { } variable a { type discrete [ 2 ] { y n } }",
+                                  "network x { } probability ( a ) { table 0.5 0.5 }"}) {
+        bool thrown = false;
+        try {
+            parseText(bad);
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        CHECK(thrown, "parse error in " << bad);
+    }
+}
+
+//The same names (each network has its own symbols), parents and tables
+static bool sameNetwork(const NetworkAST& a, const NetworkAST& b) {
+    auto sameNames = [&](const std::vector<SymbolId>& x, const std::vector<SymbolId>& y) {
+        if (x.size() != y.size()) return false;
+        for (size_t i = 0; i < x.size(); ++i)
+            if (a.symbols.name(x[i]) != b.symbols.name(y[i])) return false;
+        return true;
+    };
+    if (a.name != b.name || a.variables.size() != b.variables.size() || a.probabilities.size() != b.probabilities.size())
+        return false;
+    for (size_t i = 0; i < a.variables.size(); ++i)
+        if (!sameNames({a.variables[i].name}, {b.variables[i].name}) || !sameNames(a.variables[i].domain, b.variables[i].domain))
+            return false;
+    for (size_t i = 0; i < a.probabilities.size(); ++i)
+        if (!sameNames({a.probabilities[i].variable}, {b.probabilities[i].variable}) ||
+            !sameNames(a.probabilities[i].parents, b.probabilities[i].parents) || a.probabilities[i].table != b.probabilities[i].table)
+            return false;
+    return true;
+}
+
+//The mapped file holds the text of the file, and the parser gives the same network from a mapping, a stream and a string
+static void testMappedInput(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 10; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 8, 0.2);
+        const std::filesystem::path path = writeTemporary(net.bif);
+        MappedFile mapped(path.string());
+        CHECK(mapped.view() == net.bif, "the mapping holds the file");
+
+        Parser from_mapping(mapped.view());
+        std::ifstream input(path, std::ios::binary);
+        Parser from_stream(input);
+        const NetworkAST expected = parseText(net.bif);
+        CHECK(sameNetwork(from_mapping.parse(), expected), "network parsed from the mapping");
+        CHECK(sameNetwork(from_stream.parse(), expected), "network parsed from a stream");
+    }
+
+    CHECK(MappedFile(writeTemporary("").string()).view().empty(), "an empty file is an empty view");
+    bool thrown = false;
+    try {
+        MappedFile missing((std::filesystem::temp_directory_path() / "bif_parser_tests_missing.bif").string());
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown, "mapping a missing file");
+}
+
+//The numbers of the tables are read as strtod reads them, whatever their format
+static void testNumbers() {
+    const std::vector<std::string> numbers = {"0.1", "0.25", "1e-300", "1.7976931348623157e308", "123456789.125", "3e0",
+                                              "2.5E+2", "0.30000000000000004", "7.", "1e5"};
+    std::string text = "network n { } variable a { type discrete [ " + std::to_string(numbers.size()) + " ] {";
+    for (size_t i = 0; i < numbers.size(); ++i) text += " s" + std::to_string(i);
+    text += " }; } probability ( a ) { table";
+    for (const auto& number : numbers) text += " " + number + ",";
+    text.back() = ';';
+    text += " }";
+
+    const NetworkAST network = parseText(text);
+    CHECK(network.probabilities.size() == 1 && network.probabilities[0].table.size() == numbers.size(), "one flat table");
+    for (size_t i = 0; i < numbers.size() && i < network.probabilities[0].table.size(); ++i)
+        CHECK(network.probabilities[0].table[i] == std::strtod(numbers[i].c_str(), nullptr), "number " << numbers[i]);
+
+    //A count of values which is zero or does not fit is an error at its position
+    for (const std::string count : {"0", "99999999999999999999999"}) {
+        const std::string bad = "network n { } variable a { type discrete [ " + count + " ] { s0, s1 }; }";
+        const std::string at = "line 1, column " + std::to_string(bad.find('[') + 3);
+        std::string message;
+        try {
+            parseText(bad);
+        } catch (const std::runtime_error& e) {
+            message = e.what();
+        }
+        CHECK(message.find("Invalid number of values " + count) != std::string::npos && message.find(at) != std::string::npos,
+              "count of values " << count << ": " << message);
+    }
+    //and one bigger than the values listed fails on the list, without allocating for the count
+    bool thrown = false;
+    try {
+        parseText("network n { } variable a { type discrete [ 18446744073709551615 ] { s0, s1 }; }");
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown, "count of values bigger than the list");
+}
+
+//Same names, domains, parents and CPT bits
+static bool sameBayesianNetwork(const BayesianNetwork& a, const BayesianNetwork& b) {
+    if (a.getName() != b.getName() || a.getVariableCount() != b.getVariableCount()) return false;
+    const NetworkLayout& x = a.getLayout();
+    const NetworkLayout& y = b.getLayout();
+    for (VarId var = 0; var < a.getVariableCount(); ++var) {
+        if (a.getVariableName(var) != b.getVariableName(var) || x.cardinalities[var] != y.cardinalities[var] ||
+            !std::equal(x.parentsOf(var).begin(), x.parentsOf(var).end(), y.parentsOf(var).begin(), y.parentsOf(var).end()) ||
+            !std::equal(x.cptOf(var).begin(), x.cptOf(var).end(), y.cptOf(var).begin(), y.cptOf(var).end()))
+            return false;
+        for (size_t value = 0; value < x.cardinalities[var]; ++value)
+            if (a.getValueName(var, value) != b.getValueName(var, value)) return false;
+    }
+    return true;
+}
+
+//readCompiledNetwork(writeCompiledNetwork(x)) is x, and damaged files are refused
+static void testCompiledNetwork(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 10, 0.2);
+        BayesianNetwork original = buildNetwork(net);
+        std::ostringstream out;
+        writeCompiledNetwork(original, out);
+        const std::string data = out.str();
+        CHECK(isCompiledNetwork(data) && !isCompiledNetwork(net.bif), "isCompiledNetwork");
+
+        const std::unique_ptr<BayesianNetwork> loaded = readCompiledNetwork(data, nullptr);
+        CHECK(sameBayesianNetwork(*loaded, original), "compiled network round trip");
+        std::istringstream input(data);
+        CHECK(sameBayesianNetwork(*readCompiledNetwork(input), original), "compiled network read from a stream");
+        const std::string name = "v" + std::to_string(rng() % net.cards.size());
+        CHECK(sameFactor(loaded->calculateMarginal(name), original.calculateMarginal(name)), "marginal of the compiled network");
+
+        //The arrays of the layout are the sections of the file
+        const NetworkLayout& layout = loaded->getLayout();
+        auto inData = [&](const void* p) {
+            return static_cast<const char*>(p) >= data.data() && static_cast<const char*>(p) < data.data() + data.size();
+        };
+        CHECK(inData(layout.cardinalities.begin()) && inData(layout.parentOffsets.begin()) && inData(layout.cptOf(0).begin()) &&
+                  (layout.parents.empty() || inData(layout.parents.begin())),
+              "a compiled network is read in place");
+
+        //The network keeps its mapping
+        std::unique_ptr<BayesianNetwork> mapped_network;
+        {
+            auto mapped = std::make_shared<MappedFile>(writeTemporary(data).string());
+            mapped_network = readCompiledNetwork(mapped->view(), mapped);
+        }
+        CHECK(sameFactor(mapped_network->calculateMarginal(name), original.calculateMarginal(name)), "marginal of a mapped compiled network");
+
+        //A truncated file, another version, a section outside the file and a cardinality too big for the values
+        std::string version = data, outside = data, cardinality = data;
+        version[8] ^= 0x7f;
+        CompiledHeader header;
+        std::memcpy(&header, data.data(), sizeof(header));
+        const uint64_t huge = uint64_t(1) << 62;
+        std::memcpy(cardinality.data() + header.cardinalitiesOffset, &huge, sizeof(huge));
+        header.tablesOffset = data.size() + 8;
+        std::memcpy(outside.data(), &header, sizeof(header));
+        for (const std::string& damaged : {data.substr(0, data.size() / 2), version, outside, cardinality}) {
+            bool thrown = false;
+            try {
+                readCompiledNetwork(damaged, nullptr);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            CHECK(thrown, "damaged compiled network");
+        }
+    }
+}
+
+//The blocks parsed on several threads give the network and the errors of the sequential parse
+static void testParallelParse(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 20, 0.2);
+        std::string text = net.bif;
+        //Braces in comments must not cut the blocks, and every other source is padded with them
+        //to the size parsed in parallel after the variables
+        const size_t padding = round % 2 ? 0 : Parser::PARALLEL_PARSE_BYTES / net.cards.size();
+        const std::string comment = "/* } } { " + std::string(padding, '.') + " */\n";
+        for (size_t at = 0; (at = text.find("}\n", at)) != std::string::npos; at += comment.size()) text.insert(at + 2, comment);
+        Parser sequential{std::string_view(text)};
+        const NetworkAST expected = sequential.parse();
+        for (size_t threads = 1; threads <= 4; ++threads) {
+            ThreadPool pool(threads);
+            Parser parser{std::string_view(text)};
+            const NetworkAST parsed = parser.parse(pool);
+            CHECK(sameNetwork(parsed, expected), "network parsed on " << threads << " threads");
+            //The variables come first, so every range knows the size of its tables
+            for (const auto& probability : parsed.probabilities)
+                CHECK(probability.table.capacity() == probability.table.size(), "table preallocated on " << threads << " threads");
+        }
+
+        //An error in a block in the middle of the text
+        std::string broken = text;
+        const size_t at = broken.find("probability", broken.size() / 2);
+        if (at == std::string::npos) continue;
+        broken.replace(at, 11, "probabilty");
+        std::string expected_error, parallel_error;
+        try {
+            Parser{std::string_view(broken)}.parse();
+        } catch (const std::runtime_error& e) {
+            expected_error = e.what();
+        }
+        ThreadPool pool(4);
+        try {
+            Parser{std::string_view(broken)}.parse(pool);
+        } catch (const std::runtime_error& e) {
+            parallel_error = e.what();
+        }
+        CHECK(!expected_error.empty() && parallel_error == expected_error, "error on 4 threads: " << parallel_error
+              << " instead of " << expected_error);
+    }
+
+    SymbolTable symbols;
+    Lexer lexer(std::string_view("ab\ncd\n\nef"), symbols);
+    CHECK(lexer.position(0) == "line 1, column 1" && lexer.position(4) == "line 2, column 2" && lexer.position(7) == "line 4, column 1",
+          "positions of the lexer");
+}
+
+//The network built while parsing is the network built from the AST, whatever the order of the blocks
+static void testStreamingBuild(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 8, 0.2);
+        //The last probability block moved before every variable block
+        std::string reordered = net.bif;
+        const size_t last = reordered.rfind("probability");
+        const size_t first_variable = reordered.find("variable");
+        const std::string block = reordered.substr(last);
+        reordered.erase(last);
+        reordered.insert(first_variable, block);
+
+        const BayesianNetwork expected = buildNetwork(net);
+        for (const std::string& text : {net.bif, reordered}) {
+            Parser parser{std::string_view(text)};
+            const BayesianNetwork streamed(parser);
+            CHECK(sameBayesianNetwork(streamed, expected), "network built while parsing");
+        }
+    }
+
+    const std::string unknown = "network n { } variable a { type discrete [ 2 ] { x, y }; } probability ( a | b ) { table 0.5, 0.5; }";
+    bool thrown = false;
+    try {
+        Parser parser{std::string_view(unknown)};
+        BayesianNetwork bn(parser);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown, "a probability with an unknown parent");
+}
+
+//Interning gives every text one id, in order from 0, and a copy of the table finds the same ids
+static void testSymbolTable(std::mt19937_64& rng) {
+    SymbolTable symbols;
+    std::vector<std::string> texts;
+    for (size_t i = 0; i < 200; ++i) texts.push_back("name" + std::to_string(rng() % 100));
+    std::map<std::string, SymbolId> first_id;
+    for (const auto& text : texts) {
+        const SymbolId id = symbols.intern(text);
+        if (!first_id.count(text)) {
+            CHECK(id == first_id.size(), "ids are given in order");
+            first_id[text] = id;
+        }
+        CHECK(id == first_id[text] && symbols.name(id) == text, "intern " << text);
+    }
+    CHECK(symbols.size() == first_id.size() && symbols.find("missing") == SymbolTable::NONE, "size and find");
+
+    SymbolTable copy = symbols;
+    symbols = SymbolTable();
+    for (const auto& [text, id] : first_id) CHECK(copy.find(text) == id && copy.name(id) == text, "copy of the table");
+}
+
+//The arrays of the layout describe the network of the text, and the CPT arena keeps every table in place
+static void testNetworkLayout(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 10, 0.2);
+        BayesianNetwork bn = buildNetwork(net);
+        const NetworkLayout& layout = bn.getLayout();
+        CHECK(layout.size() == net.cards.size(), "variable count");
+        for (VarId var = 0; var < layout.size() && var < net.cards.size(); ++var) {
+            CHECK(layout.cardinalities[var] == net.cards[var] && layout.valuesOf(var).size() == net.cards[var], "cardinality of v" << var);
+            CHECK(std::equal(layout.parentsOf(var).begin(), layout.parentsOf(var).end(), net.parents[var].begin(), net.parents[var].end()),
+                  "parents of v" << var);
+            CHECK(std::equal(layout.cptOf(var).begin(), layout.cptOf(var).end(), net.tables[var].begin(), net.tables[var].end()),
+                  "CPT of v" << var);
+            std::vector<VarId> children;
+            for (VarId child = 0; child < net.cards.size(); ++child)
+                if (std::find(net.parents[child].begin(), net.parents[child].end(), var) != net.parents[child].end())
+                    children.push_back(child);
+            CHECK(std::equal(layout.childrenOf(var).begin(), layout.childrenOf(var).end(), children.begin(), children.end()),
+                  "children of v" << var);
+        }
+    }
+
+    //Small tables share the blocks, a table bigger than a block gets its own
+    NetworkLayout layout;
+    std::vector<std::vector<double>> tables;
+    std::vector<const double*> stored;
+    for (size_t size : {size_t(10), NetworkLayout::CPT_BLOCK_ENTRIES - 5, size_t(10), 3 * NetworkLayout::CPT_BLOCK_ENTRIES, size_t(7)}) {
+        tables.emplace_back(size);
+        for (double& v : tables.back()) v = static_cast<double>(rng() % 1000);
+        stored.push_back(layout.storeCPT(tables.back().data(), size));
+    }
+    for (size_t t = 0; t < tables.size(); ++t)
+        CHECK(std::equal(tables[t].begin(), tables[t].end(), stored[t]), "stored table " << t);
+}
+
+//A factor over a CPT reads the table in place, and copies it only when it is written
+static void testFactorViews(std::mt19937_64& rng) {
+    RandomNetwork net = randomNetwork(rng, 6, 0.2);
+    BayesianNetwork bn = buildNetwork(net);
+    const NetworkLayout& layout = bn.getLayout();
+    for (VarId var = 0; var < layout.size(); ++var) {
+        Factor::VarList vars;
+        Factor::SizeList cards;
+        for (VarId parent : layout.parentsOf(var)) {
+            vars.push_back(parent);
+            cards.push_back(layout.cardinalities[parent]);
+        }
+        vars.push_back(var);
+        cards.push_back(layout.cardinalities[var]);
+        const Span<double> cpt = layout.cptOf(var);
+
+        Factor view(vars, cards, cpt);
+        const Factor& read = view;
+        CHECK(view.values.isView() && read.values.data() == cpt.begin(), "a factor over a CPT is a view");
+        const Factor copy = view;
+        CHECK(copy.values.isView() && copy.values.data() == cpt.begin(), "a copy of a view is a view");
+
+        const double first = cpt[0];
+        view.values[0] = first + 1;
+        CHECK(!view.values.isView() && read.values.data() != cpt.begin(), "writing copies the table");
+        CHECK(cpt[0] == first && std::equal(cpt.begin() + 1, cpt.end(), read.values.begin() + 1), "the CPT is not written");
+    }
+}
+
+//The kernels for binary and ternary variables are chosen for their shapes, and give the bits of the reference
+static void testSmallKernels(std::mt19937_64& rng) {
+    CHECK(findProductKernel(3, 2) && findProductKernel(4, 2) && findProductKernel(3, 3) && !findProductKernel(5, 2) && !findProductKernel(2, 5),
+          "findProductKernel");
+    CHECK(findSumOutKernel(2, 16) && findSumOutKernel(3, 27) && !findSumOutKernel(2, 4 * SMALL_SUM_OUT_ENTRIES) && !findSumOutKernel(4, 16),
+          "findSumOutKernel");
+    CHECK(findProductSumOutKernel(2, 2, 3) && findProductSumOutKernel(4, 3, 2) && findProductSumOutKernel(3, 1, 2) &&
+          !findProductSumOutKernel(SMALL_KERNEL_MAX_FACTORS + 1, 2, 2) && !findProductSumOutKernel(2, 4, 2),
+          "findProductSumOutKernel");
+
+    for (size_t card : {size_t(2), size_t(3)}) {
+        RandomNetwork shape = randomNetwork(rng, 6, 0.0, card);
+        BayesianNetwork bn = buildNetwork(shape);
+        const size_t n_vars = shape.cards.size();
+        for (size_t round = 0; round < 200; ++round) {
+            std::vector<Factor> factors;
+            for (size_t f = 0, count = 2 + rng() % 3; f < count; ++f) factors.push_back(randomFactor(rng, shape, card == 2 ? 4 : 3, 0.1));
+            const VarId summed = factors[0].variables[rng() % factors[0].variables.size()];
+            Factor::VarList summed_list;
+            summed_list.push_back(summed);
+            CHECK(sameFactor(bn.factorProduct(factors[0], factors[1]), referenceProductSumOut({factors[0], factors[1]}, {}, n_vars, shape.cards)),
+                  "factorProduct of variables with " << card << " values");
+            CHECK(sameFactor(bn.factorSumOut(factors[0], summed), referenceProductSumOut({factors[0]}, {summed}, n_vars, shape.cards)),
+                  "factorSumOut of variables with " << card << " values");
+            CHECK(sameFactor(bn.factorProductSumOut(factors, summed_list), referenceProductSumOut(factors, {summed}, n_vars, shape.cards)),
+                  "factorProductSumOut of " << factors.size() << " factors of variables with " << card << " values");
+            CHECK(sameFactor(bn.factorProductSumOut(factors, {}), referenceProductSumOut(factors, {}, n_vars, shape.cards)),
+                  "factorProductSumOut of " << factors.size() << " factors without summed variables");
+        }
+    }
+}
+
+//A SparseTable keeps exactly the nonzero entries, and kernels walking it give the bits of the dense kernels
+static void testSparseTables(std::mt19937_64& rng) {
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    BayesianNetwork shape_bn = buildNetwork(shape);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 200; ++round) {
+        std::vector<Factor> factors;
+        for (size_t f = 0, count = 1 + rng() % 3; f < count; ++f) {
+            Factor factor = randomFactor(rng, shape, 4, 0.8);
+            if (round % 3 == 0)
+                for (double& v : factor.values) v = v == 0.0 ? 0.0 : 1.0;
+            const SparseTable table = makeSparseTable(factor.values.data(), factor.values.size(), factor.cardinalities.back());
+            std::vector<double> dense(table.size, 0.0);
+            for (size_t b = 0; b + 1 < table.first.size(); ++b)
+                for (size_t n = table.first[b]; n < table.first[b + 1]; ++n) dense[b * table.blockSize + table.positions[n]] = table.values[n];
+            CHECK(std::equal(dense.begin(), dense.end(), factor.values.begin()) &&
+                      table.nonzeros() == factor.values.size() - static_cast<size_t>(std::count(dense.begin(), dense.end(), 0.0)),
+                  "makeSparseTable keeps the nonzero entries");
+            CHECK(table.deterministic == std::all_of(table.values.begin(), table.values.end(), [](double v) { return v == 1.0; }),
+                  "deterministic SparseTable");
+            factor.sparse = std::make_shared<const SparseTable>(table);
+            factors.push_back(std::move(factor));
+        }
+        const VarId summed = factors[0].variables[rng() % factors[0].variables.size()];
+        Factor::VarList summed_list;
+        summed_list.push_back(summed);
+        CHECK(sameFactor(shape_bn.factorProductSumOut(factors, summed_list), referenceProductSumOut(factors, {summed}, n_vars, shape.cards)),
+              "factorProductSumOut of " << factors.size() << " sparse factors");
+        CHECK(sameFactor(shape_bn.factorProductSumOut(factors, {}), referenceProductSumOut(factors, {}, n_vars, shape.cards)),
+              "factorProductSumOut of " << factors.size() << " sparse factors without summed variables");
+    }
+
+    //The threshold only changes how the marginals are computed
+    size_t sparse_operations = 0;
+    for (size_t round = 0; round < 20; ++round) {
+        RandomNetwork net = randomNetwork(rng, 4 + rng() % 6, 0.7);
+        BayesianNetwork dense = buildNetwork(net);
+        BayesianNetwork sparse = buildNetwork(net);
+        dense.setSparseThreshold(0);
+        sparse.setSparseThreshold(1.0);
+        CHECK(sparse.getSparseThreshold() == 1.0, "getSparseThreshold");
+        for (VarId var = 0; var < net.cards.size(); ++var) {
+            const std::string name = "v" + std::to_string(var);
+            CHECK(sameFactor(sparse.calculateMarginal(name), dense.calculateMarginal(name)), "marginal of " << name << " with sparse CPTs");
+        }
+        CHECK(dense.getSparseStats().operations == 0, "no sparse kernel when the threshold is 0");
+        sparse_operations += sparse.getSparseStats().operations;
+        sparse.resetSparseStats();
+        CHECK(sparse.getSparseStats().operations == 0, "resetSparseStats");
+    }
+    CHECK(sparse_operations > 0, "the sparse kernels are used");
+}
+
+//The largest difference between the probabilities of a typed factor and a double one, or infinity if the scopes differ
+template <typename Semiring>
+static double typedDifference(const BasicFactor<Semiring>& typed, const Factor& expected) {
+    return largestDifference(typed.toFactor(), expected);
+}
+
+//The typed kernels follow the double ones: the same bits in double, the same probabilities up to rounding in float and log
+static void testTypedFactors(std::mt19937_64& rng) {
+    typedef BasicFactor<ProbabilitySemiring<double>> DoubleFactor;
+    RandomNetwork shape = randomNetwork(rng, 6, 0.0);
+    const size_t n_vars = shape.cards.size();
+    for (size_t round = 0; round < 100; ++round) {
+        std::vector<Factor> factors;
+        for (size_t f = 0, count = 2 + rng() % 3; f < count; ++f) factors.push_back(randomFactor(rng, shape, 4, 0.1));
+        const VarId summed = factors[0].variables[rng() % factors[0].variables.size()];
+        Factor::VarList summed_list;
+        summed_list.push_back(summed);
+        const Factor product = referenceProductSumOut({factors[0], factors[1]}, {}, n_vars, shape.cards);
+        const Factor sum = referenceProductSumOut({factors[0]}, {summed}, n_vars, shape.cards);
+        const Factor product_sum = referenceProductSumOut(factors, {summed}, n_vars, shape.cards);
+
+        std::vector<DoubleFactor> doubles;
+        std::vector<FloatFactor> floats;
+        std::vector<LogFactor> logs;
+        for (const Factor& f : factors) {
+            doubles.emplace_back(f);
+            floats.emplace_back(f);
+            logs.emplace_back(f);
+        }
+        CHECK(typedDifference(typedFactorProduct(doubles[0], doubles[1]), product) == 0, "typedFactorProduct in double");
+        CHECK(typedDifference(typedFactorSumOut(doubles[0], summed), sum) == 0, "typedFactorSumOut in double");
+        CHECK(typedDifference(typedFactorProductSumOut(doubles, summed_list), product_sum) == 0, "typedFactorProductSumOut in double");
+        CHECK(typedDifference(typedFactorProduct(floats[0], floats[1]), product) < 1e-6, "typedFactorProduct in float");
+        CHECK(typedDifference(typedFactorSumOut(floats[0], summed), sum) < 1e-5, "typedFactorSumOut in float");
+        CHECK(typedDifference(typedFactorProductSumOut(floats, summed_list), product_sum) < 1e-5, "typedFactorProductSumOut in float");
+        CHECK(typedDifference(typedFactorProduct(logs[0], logs[1]), product) < 1e-12, "typedFactorProduct in log");
+        CHECK(typedDifference(typedFactorSumOut(logs[0], summed), sum) < 1e-12, "typedFactorSumOut in log");
+        CHECK(typedDifference(typedFactorProductSumOut(logs, summed_list), product_sum) < 1e-12, "typedFactorProductSumOut in log");
+
+        //The float kernels give the same bits on every SIMD level
+        setSimdLevel(SimdLevel::SCALAR);
+        const FloatFactor scalar_product = typedFactorProduct(floats[0], floats[1]);
+        const FloatFactor scalar_sum = typedFactorSumOut(floats[0], summed);
+        for (SimdLevel level : {SimdLevel::AVX2, SimdLevel::AVX512}) {
+            setSimdLevel(level);
+            CHECK(typedFactorProduct(floats[0], floats[1]).values == scalar_product.values, "typedFactorProduct in float on " << toString(level));
+            CHECK(typedFactorSumOut(floats[0], summed).values == scalar_sum.values, "typedFactorSumOut in float on " << toString(level));
+        }
+        setSimdLevel(detectSimdLevel());
+
+        LogFactor normalized = logs[0];
+        normalized.normalize();
+        double total = 0;
+        for (double p : normalized.toFactor().values) total += p;
+        CHECK(std::abs(total - 1) < 1e-12, "normalize in log");
+    }
+
+    //Every value mode answers the queries of the brute force
+    for (size_t round = 0; round < 40; ++round) {
+        RandomNetwork net = randomNetwork(rng, 2 + rng() % 8, round % 2 ? 0.3 : 0.0);
+        BayesianNetwork bn = buildNetwork(net);
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, query, 3, observed);
+        const std::vector<double> expected = bruteForceMarginal(net, query, observed);
+        if (expected.empty()) continue;
+        for (ValueMode mode : {ValueMode::DOUBLE, ValueMode::FLOAT, ValueMode::LOG}) {
+            bn.setValueMode(mode);
+            CHECK(bn.getValueMode() == mode && parseValueMode(toString(mode)) == mode, "value mode " << toString(mode));
+            CHECK(closeTo(bn.calculateMarginal("v" + std::to_string(query), evidence), expected, mode == ValueMode::FLOAT ? 1e-5 : 1e-12),
+                  "marginal of v" << query << " in " << toString(mode));
+        }
+    }
+}
+
+//A memory budget conditions on a cutset when the plain plan does not fit, without changing the marginals,
+//and the tables of the query really stay within it
+static void testMemoryBudget(std::mt19937_64& rng) {
+    size_t conditioned = 0;
+    const ValueMode modes[] = {ValueMode::DOUBLE, ValueMode::FLOAT, ValueMode::LOG};
+    for (size_t round = 0; round < 60; ++round) {
+        //Four values each, so the factors are bigger than the smallest buffers of the arena
+        RandomNetwork net = randomNetwork(rng, 5 + rng() % 4, round % 2 ? 0.3 : 0.0, 4);
+        BayesianNetwork bn = buildNetwork(net);
+        const ValueMode mode = modes[round % 3];
+        bn.setValueMode(mode);
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        const std::string name = "v" + std::to_string(query);
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, query, 2, observed);
+        const std::vector<double> expected = bruteForceMarginal(net, query, observed);
+        if (expected.empty()) continue;
+        const double tolerance = mode == ValueMode::FLOAT ? 1e-5 : 1e-12;
+
+        bn.calculateMarginal(name, evidence);
+        const EliminationPlan plain = bn.getLastEliminationPlan();
+        CHECK(plain.cutset.empty() && plain.subproblems == 1, "no cutset without a budget");
+        CHECK(bn.getAllocationStats().back().peakBytes <= plain.peakBytes, "the estimate covers the rounded tables in " << toString(mode));
+        if (plain.peakBytes < 256) continue;
+
+        const size_t budget = plain.peakBytes / 2;
+        bn.setMemoryBudget(budget);
+        CHECK(bn.getMemoryBudget() == budget, "getMemoryBudget");
+        try {
+            const Factor marginal = bn.calculateMarginal(name, evidence);
+            const EliminationPlan& plan = bn.getLastEliminationPlan();
+            CHECK(plan.peakBytes <= budget, "the plan fits in the budget");
+            CHECK(bn.getAllocationStats().back().peakBytes <= budget, "the tables fit in the budget in " << toString(mode));
+            conditioned += !plan.cutset.empty();
+            CHECK(closeTo(marginal, expected, tolerance), "marginal of " << name << " within a budget of " << budget << " bytes");
+        } catch (const std::exception&) {
+            CHECK(bn.getLastEliminationPlan().peakBytes > budget, "a query is only refused when it does not fit");
+        }
+
+        //The marginal alone does not fit in a single entry
+        bn.setMemoryBudget(sizeof(double));
+        bool thrown = false;
+        try {
+            bn.calculateMarginal(name, evidence);
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        CHECK(thrown, "a query over the budget throws");
+    }
+    CHECK(conditioned > 0, "some queries condition on a cutset");
+
+    //Every table takes at least a 64 byte buffer and is rounded up to a power of two
+    FactorArena arena;
+    CHECK(arena.bufferBytes(1) == 64 && arena.bufferBytes(64) == 64 && arena.bufferBytes(65) == 128 &&
+          arena.bufferBytes(3000) == 4096, "buffer sizes of the arena");
+    CHECK(arena.bufferBytes((1 << 20) + 1) == (1 << 20) + 1, "big buffers are not rounded");
+}
+
+//The samplers converge to the brute force marginals
+static void testSampling(std::mt19937_64& rng) {
+    for (size_t round = 0; round < 12; ++round) {
+        RandomNetwork net = randomNetwork(rng, 3 + rng() % 5, 0.0);
+        BayesianNetwork bn = buildNetwork(net);
+        Sampler sampler(bn);
+        const std::vector<VarId>& order = sampler.getTopologicalOrder();
+        std::vector<size_t> position(order.size());
+        for (size_t i = 0; i < order.size(); ++i) position[order[i]] = i;
+        for (VarId var = 0; var < net.cards.size(); ++var)
+            for (VarId parent : net.parents[var]) CHECK(position[parent] < position[var], "parents come first in the topological order");
+
+        const VarId query = static_cast<VarId>(rng() % net.cards.size());
+        std::vector<int> observed;
+        const Evidence evidence = randomEvidence(rng, net, query, 2, observed);
+        const std::vector<double> expected = bruteForceMarginal(net, query, observed);
+        for (SamplingMethod method : {SamplingMethod::FORWARD, SamplingMethod::LIKELIHOOD_WEIGHTING, SamplingMethod::GIBBS}) {
+            SamplingOptions options;
+            options.method = method;
+            options.samples = 200000;
+            options.threads = 1 + round % 3;
+            options.seed = round + 1;
+            options.burnIn = 100;
+            const SamplingResult result = sampler.estimate({query}, evidence, options);
+            CHECK(result.samples >= options.samples && result.effectiveSamples > 0, toString(method) << " sample counts");
+            CHECK(closeTo(result.marginals[0], expected, 0.02), toString(method) << " marginal of v" << query);
+        }
+    }
+
+    //With a sample count, forward and likelihood weighting draw the same samples on any number of threads,
+    //also when the count needs chunks bigger than CHUNK_SAMPLES
+    for (size_t samples : {50 * Sampler::CHUNK_SAMPLES + 17, 3 * Sampler::MAX_CHUNKS * Sampler::CHUNK_SAMPLES + 17}) {
+        for (SamplingMethod method : {SamplingMethod::FORWARD, SamplingMethod::LIKELIHOOD_WEIGHTING}) {
+            RandomNetwork net = randomNetwork(rng, 8, 0.0);
+            BayesianNetwork bn = buildNetwork(net);
+            Sampler sampler(bn);
+            std::vector<VarId> queries;
+            for (VarId var = 2; var < net.cards.size(); ++var) queries.push_back(var);
+            SamplingOptions options;
+            options.method = method;
+            options.samples = samples;
+            const SamplingResult one = sampler.estimate(queries, {{"v0", "s1"}, {"v1", "s0"}}, options);
+            options.threads = 4;
+            const SamplingResult four = sampler.estimate(queries, {{"v0", "s1"}, {"v1", "s0"}}, options);
+            CHECK(one.samples == samples && one.samples == four.samples && one.accepted == four.accepted &&
+                      one.effectiveSamples == four.effectiveSamples,
+                  toString(method) << " counts on 1 and 4 threads");
+            for (size_t q = 0; q < queries.size(); ++q)
+                CHECK(sameFactor(one.marginals[q], four.marginals[q]), toString(method) << " marginal of v" << queries[q] << " on 1 and 4 threads");
+        }
+    }
+
+    //Gibbs refuses deterministic CPTs, and its effective sample size shrinks when the sweeps are correlated
+    const std::string coupled = "network coupled {\n}\n"
+                                "variable a {\n  type discrete [ 2 ] { s0, s1 };\n}\n"
+                                "variable b {\n  type discrete [ 2 ] { s0, s1 };\n}\n"
+                                "probability ( a ) {\n  table 0.5, 0.5;\n}\n";
+    BayesianNetwork strong(parseText(coupled + "probability ( b | a ) {\n  (s0) 0.99, 0.01;\n  (s1) 0.01, 0.99;\n}\n"));
+    BayesianNetwork deterministic(parseText(coupled + "probability ( b | a ) {\n  (s0) 1.0, 0.0;\n  (s1) 0.0, 1.0;\n}\n"));
+    SamplingOptions gibbs;
+    gibbs.method = SamplingMethod::GIBBS;
+    gibbs.samples = 100 * Sampler::CHUNK_SAMPLES;
+    bool refused = false;
+    try {
+        Sampler(deterministic).estimate({0}, {}, gibbs);
+    } catch (const std::exception&) {
+        refused = true;
+    }
+    CHECK(refused, "Gibbs on a deterministic CPT");
+    const SamplingResult correlated = Sampler(strong).estimate({0}, {}, gibbs);
+    CHECK(correlated.effectiveSamples > 0 && correlated.effectiveSamples < 0.2 * static_cast<double>(correlated.samples),
+          "effective sample size of a correlated Gibbs chain: " << correlated.effectiveSamples << " of " << correlated.samples);
+    RandomNetwork loose = randomNetwork(rng, 4, 0.0);
+    BayesianNetwork loose_bn = buildNetwork(loose);
+    const SamplingResult mixing = Sampler(loose_bn).estimate({0}, {}, gibbs);
+    CHECK(mixing.effectiveSamples > correlated.effectiveSamples && mixing.effectiveSamples <= static_cast<double>(mixing.samples),
+          "effective sample size of a Gibbs chain");
+    gibbs.samples = 0;
+    gibbs.timeBudget = 0.02;
+    CHECK(Sampler(strong).estimate({0}, {}, gibbs).effectiveSamples == 0, "no effective sample size of Gibbs with a time budget alone");
+
+    //A sampler needs a limit, and evidence it can draw
+    RandomNetwork net = randomNetwork(rng, 3, 0.0);
+    BayesianNetwork bn = buildNetwork(net);
+    Sampler sampler(bn);
+    SamplingOptions options;
+    options.samples = 0;
+    bool thrown = false;
+    try {
+        sampler.estimate({0}, {}, options);
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    CHECK(thrown, "sampling without a limit");
+    options.timeBudget = 0.05;
+    CHECK(sampler.estimate({0}, {}, options).samples > 0, "sampling with a time budget");
+    CHECK(parseSamplingMethod("lw") == SamplingMethod::LIKELIHOOD_WEIGHTING &&
+              parseSamplingMethod(toString(SamplingMethod::GIBBS)) == SamplingMethod::GIBBS,
+          "parseSamplingMethod");
+}
+
+int main() {
+    std::mt19937_64 rng(2025);
+    testFactorIndexes(rng);
+    testKernels(rng);
+    testKernelScopes(rng);
+    testMarginals(rng);
+    testEliminationOrder(rng);
+    testJunctionTree(rng);
+    testEvidence(rng);
+    testBatch(rng);
+    testThreadPool();
+    testParallelElimination(rng);
+    testParallelKernels(rng);
+    testSimdKernels(rng);
+    testFusedKernel(rng);
+    testFactorArena(rng);
+    testLexer(rng);
+    testMappedInput(rng);
+    testNumbers();
+    testCompiledNetwork(rng);
+    testParallelParse(rng);
+    testStreamingBuild(rng);
+    testSymbolTable(rng);
+    testNetworkLayout(rng);
+    testFactorViews(rng);
+    testSmallKernels(rng);
+    testSparseTables(rng);
+    testTypedFactors(rng);
+    testMemoryBudget(rng);
+    testSampling(rng);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
+
+//g++ -O3 -Wall -Wextra -Wpedantic -o run_tests tests/tests.cpp parser.cpp variable_elimination.cpp elimination_order.cpp junction_tree.cpp thread_pool.cpp simd_kernels.cpp small_kernels.cpp factor_arena.cpp mapped_file.cpp compiled_network.cpp symbol_table.cpp typed_factor.cpp sampling.cpp -std=c++17 -pthread
@@ -0,0 +1,132 @@
+#include "thread_pool.h"
+
+//The pool and the deque of the worker running on this thread, if any
+static thread_local ThreadPool* currentPool = nullptr;
+static thread_local size_t currentQueue = 0;
+
+ThreadPool::ThreadPool(size_t threadCount) {
+    const size_t n_workers = threadCount > 1 ? threadCount - 1 : 0;
+    //The caller has its own deque too, used when it submits while helping
+    for (size_t i = 0; i <= n_workers; ++i)
+        queues.push_back(std::make_unique<WorkQueue>());
+    for (size_t i = 0; i < n_workers; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i + 1);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+size_t ThreadPool::getThreadCount() const {
+    return workers.size() + 1;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    size_t index = currentPool == this ? currentQueue : nextQueue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+        countQueued(1);
+    }
+    wakeUp.notify_one();
+}
+
+//Called with the mutex of the deque held, so queued always matches the deques when sleepMutex is taken
+void ThreadPool::countQueued(int delta) {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    queued += delta;
+}
+
+bool ThreadPool::popTask(size_t preferred, std::function<void()>& task) {
+    {
+        WorkQueue& own = *queues[preferred];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            countQueued(-1);
+            return true;
+        }
+    }
+    for (size_t offset = 1; offset < queues.size(); ++offset) {
+        WorkQueue& victim = *queues[(preferred + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            countQueued(-1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::tryRunTask() {
+    const size_t preferred = currentPool == this ? currentQueue : 0;
+    std::function<void()> task;
+    if (!popTask(preferred, task)) return false;
+
+    ThreadPool* previousPool = currentPool;
+    size_t previousQueue = currentQueue;
+    currentPool = this;
+    currentQueue = preferred;
+    task();
+    currentPool = previousPool;
+    currentQueue = previousQueue;
+    return true;
+}
+
+void ThreadPool::waitForWork(const std::function<bool()>& done) {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    wakeUp.wait(lock, [this, &done] { return stopping || queued > 0 || done(); });
+}
+
+void ThreadPool::notifyWaiters() {
+    //Taking the mutex orders the change of done() before the check of a thread about to sleep
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wakeUp.notify_all();
+}
+
+void ThreadPool::workerLoop(size_t index) {
+    currentPool = this;
+    currentQueue = index;
+    std::function<void()> task;
+    while (true) {
+        if (popTask(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) return;
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool)
+    : pool(pool) {}
+
+void TaskGroup::run(std::function<void()> task) {
+    ++pending;
+    //The group may be destroyed as soon as pending reaches 0, so the pool is captured on its own
+    pool.submit([this, owner = &pool, task = std::move(task)] {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) error = std::current_exception();
+        }
+        if (--pending == 0) owner->notifyWaiters();
+    });
+}
+
+void TaskGroup::wait() {
+    while (pending > 0)
+        if (!pool.tryRunTask()) pool.waitForWork([this] { return pending == 0; });
+    if (error) std::rethrow_exception(error);
+}
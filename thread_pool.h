@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    A work-stealing thread pool.
+    Every worker owns a deque of tasks: it pushes and pops its own tasks at the back (LIFO,
+    so a task and the tasks it spawns stay on the same core) and, when its deque is empty,
+    it steals from the front of the others (FIFO, so it takes the oldest and usually biggest work).
+    Tasks submitted from outside the pool are spread round robin over the deques.
+
+    A thread that waits for some tasks should run queued tasks with tryRunTask() while it waits,
+    so it helps the workers and nested waits can never deadlock, and sleep in waitForWork()
+    only when every deque is empty.
+*/
+class ThreadPool {
+public:
+    //threadCount counts the caller too, so threadCount - 1 workers are started
+    explicit ThreadPool(size_t threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t getThreadCount() const;
+
+    void submit(std::function<void()> task);
+
+    //Runs one queued task on the calling thread, returns false if every deque was empty
+    bool tryRunTask();
+
+    //Sleeps until a task is queued or done() holds; whoever makes done() true must call notifyWaiters()
+    void waitForWork(const std::function<bool()>& done);
+    void notifyWaiters();
+
+private:
+    struct WorkQueue {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    size_t queued = 0; //tasks in all the deques, guarded by sleepMutex
+    std::atomic<size_t> nextQueue{0};
+    bool stopping = false;
+
+    void countQueued(int delta);
+    bool popTask(size_t preferred, std::function<void()>& task);
+    void workerLoop(size_t index);
+};
+
+/*
+    Counts the tasks of one job, so the submitting thread can wait for exactly those tasks.
+    The first exception thrown by a task is rethrown by wait().
+*/
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool);
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    ThreadPool& pool;
+    std::atomic<size_t> pending{0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
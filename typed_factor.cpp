@@ -0,0 +1,235 @@
+#include "typed_factor.h"
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+//Plain probabilities, double or float, have SIMD kernels for their Value in simd_kernels.h
+template <typename Semiring>
+static constexpr bool HAS_SIMD = std::is_same_v<Semiring, ProbabilitySemiring<typename Semiring::Value>>;
+
+ValueMode parseValueMode(const std::string& name) {
+    if (name == "double") return ValueMode::DOUBLE;
+    if (name == "float") return ValueMode::FLOAT;
+    if (name == "log") return ValueMode::LOG;
+    throw std::runtime_error("Unknown value mode " + name);
+}
+
+std::string toString(ValueMode mode) {
+    switch (mode) {
+        case ValueMode::DOUBLE: return "double";
+        case ValueMode::FLOAT: return "float";
+        case ValueMode::LOG: return "log";
+    }
+    return "";
+}
+
+template <typename Semiring>
+BasicFactor<Semiring>::BasicFactor(const Factor::VarList& vars, const Factor::SizeList& cards, FactorArena* arena)
+    : variables(vars), cardinalities(cards), values(ArenaAllocator<Value>(arena)) {
+    strides.resize(variables.size());
+    size_t current_stride = 1;
+    for (size_t i = variables.size(); i-- > 0;) {
+        strides[i] = current_stride;
+        current_stride *= cardinalities[i];
+    }
+    values.assign(current_stride, Semiring::zero());
+}
+
+template <typename Semiring>
+BasicFactor<Semiring>::BasicFactor(const Factor& factor, FactorArena* arena)
+    : BasicFactor(factor.variables, factor.cardinalities, arena) {
+    for (size_t i = 0; i < values.size(); ++i) values[i] = Semiring::fromProbability(factor.values[i]);
+}
+
+template <typename Semiring>
+int BasicFactor<Semiring>::indexOf(VarId var) const {
+    for (size_t i = 0; i < variables.size(); ++i)
+        if (variables[i] == var) return static_cast<int>(i);
+    return -1;
+}
+
+template <typename Semiring>
+bool BasicFactor<Semiring>::contains(VarId var) const {
+    return indexOf(var) != -1;
+}
+
+template <typename Semiring>
+void BasicFactor<Semiring>::normalize() {
+    if constexpr (HAS_SIMD<Semiring>) {
+        const Value total = sumValues(values.data(), values.size());
+        if (total != 0) divideValues(values.data(), values.size(), total);
+        return;
+    }
+    Value total = Semiring::zero();
+    for (Value v : values) total = Semiring::plus(total, v);
+    if (total == Semiring::zero()) return;
+    for (Value& v : values) v = Semiring::divide(v, total);
+}
+
+template <typename Semiring>
+Factor BasicFactor<Semiring>::toFactor() const {
+    Factor result(variables, cardinalities);
+    for (size_t i = 0; i < values.size(); ++i) result.values[i] = Semiring::toProbability(values[i]);
+    return result;
+}
+
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorSumOut(const BasicFactor<Semiring>& factor, VarId varToSumOut, FactorArena* arena) {
+    Factor::VarList new_vars;
+    Factor::SizeList new_cards;
+    for (size_t k = 0; k < factor.variables.size(); ++k) {
+        if (factor.variables[k] != varToSumOut) {
+            new_vars.push_back(factor.variables[k]);
+            new_cards.push_back(factor.cardinalities[k]);
+        }
+    }
+
+    BasicFactor<Semiring> result(new_vars, new_cards, arena);
+    const int position = factor.indexOf(varToSumOut);
+    if (position == -1)
+        throw std::runtime_error("typedFactorSumOut: the factor does not contain the variable");
+    const size_t card = factor.cardinalities[position];
+    const size_t inner = factor.strides[position];
+
+    //out[b * inner + t] is the sum over j of in[(b * card + j) * inner + t], whole rows of inner entries are added at a time
+    const auto* in = factor.values.data();
+    auto* out = result.values.data();
+    if constexpr (HAS_SIMD<Semiring>) {
+        sumOutBlocks(in, out, 0, result.values.size(), inner, card);
+        return result;
+    }
+    const size_t blocks = result.values.size() / inner;
+    for (size_t b = 0; b < blocks; ++b) {
+        auto* row = out + b * inner;
+        for (size_t j = 0; j < card; ++j) {
+            const auto* source = in + (b * card + j) * inner;
+            for (size_t t = 0; t < inner; ++t) row[t] = Semiring::plus(row[t], source[t]);
+        }
+    }
+    return result;
+}
+
+template <typename Semiring>
+void productSumOutRange(const ProductSumOutPlan& plan, const typename Semiring::Value* const* tables, typename Semiring::Value* out,
+                        size_t begin, size_t end) {
+    typedef typename Semiring::Value Value;
+    const size_t n_factors = plan.factorCount;
+    const size_t n_kept = plan.keptVars.size(), n_summed = plan.summedVars.size();
+    const size_t* kept_cards = plan.keptCards.data();
+    const size_t* summed_cards = plan.summedCards.data();
+
+    //The odometer starts from the assignment of entry begin, the last kept variable changing fastest
+    Factor::SizeList counter(n_kept, 0), inner_counter(n_summed, 0);
+    Factor::SizeList base(n_factors, 0), offset(n_factors, 0);
+    for (size_t k = n_kept, rest = begin; k-- > 0;) {
+        counter[k] = rest % kept_cards[k];
+        rest /= kept_cards[k];
+        for (size_t f = 0; f < n_factors; ++f) base[f] += counter[k] * plan.keptStrides[f * n_kept + k];
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+        for (size_t f = 0; f < n_factors; ++f) offset[f] = base[f];
+        Value sum = Semiring::zero();
+        for (size_t j = 0; j < plan.summedEntries; ++j) {
+            Value product = tables[0][offset[0]];
+            for (size_t f = 1; f < n_factors; ++f) product = Semiring::times(product, tables[f][offset[f]]);
+            sum = Semiring::plus(sum, product);
+
+            for (size_t s = n_summed; s-- > 0;) {
+                const size_t* strides = &plan.summedStrides[s];
+                if (++inner_counter[s] < summed_cards[s]) {
+                    for (size_t f = 0; f < n_factors; ++f) offset[f] += strides[f * n_summed];
+                    break;
+                }
+                inner_counter[s] = 0;
+                for (size_t f = 0; f < n_factors; ++f) offset[f] -= (summed_cards[s] - 1) * strides[f * n_summed];
+            }
+        }
+        out[i] = sum;
+
+        for (size_t k = n_kept; k-- > 0;) {
+            const size_t* strides = &plan.keptStrides[k];
+            if (++counter[k] < kept_cards[k]) {
+                for (size_t f = 0; f < n_factors; ++f) base[f] += strides[f * n_kept];
+                break;
+            }
+            counter[k] = 0;
+            for (size_t f = 0; f < n_factors; ++f) base[f] -= (kept_cards[k] - 1) * strides[f * n_kept];
+        }
+    }
+}
+
+/*
+    The product of two factors where one is over the whole scope and the other over a prefix or a suffix
+    of it, with the broadcast kernels as in BayesianNetwork::factorProduct. Returns false for other layouts.
+*/
+template <typename Semiring>
+static bool multiplyBroadcast(const ProductSumOutPlan& plan, const BasicFactor<Semiring>& f1, const BasicFactor<Semiring>& f2,
+                              BasicFactor<Semiring>& result) {
+    const size_t n_vars = plan.keptVars.size();
+    const BasicFactor<Semiring>* operands[2] = {&f1, &f2};
+    for (size_t big = 0; big < 2; ++big) {
+        const size_t* big_strides = plan.keptStrides.data() + big * n_vars;
+        const size_t* small_strides = plan.keptStrides.data() + (1 - big) * n_vars;
+        bool inner = false;
+        size_t period = 0;
+        if (!std::equal(big_strides, big_strides + n_vars, result.strides.begin()) ||
+            !matchBroadcast(small_strides, result.strides.data(), n_vars, result.values.size(), inner, period))
+            continue;
+        const auto* big_values = operands[big]->values.data();
+        const auto* small_values = operands[1 - big]->values.data();
+        if (inner) multiplyBroadcastInner(big_values, small_values, result.values.data(), 0, result.values.size(), period);
+        else multiplyBroadcastOuter(big_values, small_values, result.values.data(), 0, result.values.size(), period);
+        return true;
+    }
+    return false;
+}
+
+//typedFactorProductSumOut on pointers, so typedFactorProduct does not copy its operands
+template <typename Semiring>
+static BasicFactor<Semiring> productSumOut(const std::vector<const BasicFactor<Semiring>*>& factors, const Factor::VarList& varsToSumOut,
+                                           FactorArena* arena) {
+    typedef typename Semiring::Value Value;
+    if (factors.empty())
+        throw std::runtime_error("typedFactorProductSumOut needs at least one factor");
+    if (factors.size() == 1 && varsToSumOut.size() == 1 && factors[0]->contains(varsToSumOut[0]))
+        return typedFactorSumOut(*factors[0], varsToSumOut[0], arena);
+
+    const ProductSumOutPlan plan(factors, varsToSumOut);
+    BasicFactor<Semiring> result(plan.keptVars, plan.keptCards, arena);
+    if constexpr (HAS_SIMD<Semiring>) {
+        if (factors.size() == 2 && plan.summedVars.empty() && multiplyBroadcast(plan, *factors[0], *factors[1], result))
+            return result;
+    }
+
+    std::vector<const Value*> tables;
+    for (const auto* f : factors) tables.push_back(f->values.data());
+    productSumOutRange<Semiring>(plan, tables.data(), result.values.data(), 0, result.values.size());
+    return result;
+}
+
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorProduct(const BasicFactor<Semiring>& f1, const BasicFactor<Semiring>& f2, FactorArena* arena) {
+    return productSumOut<Semiring>({&f1, &f2}, {}, arena);
+}
+
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorProductSumOut(const std::vector<BasicFactor<Semiring>>& factors, const Factor::VarList& varsToSumOut,
+                                               FactorArena* arena) {
+    std::vector<const BasicFactor<Semiring>*> operands;
+    for (const auto& f : factors) operands.push_back(&f);
+    return productSumOut<Semiring>(operands, varsToSumOut, arena);
+}
+
+#define INSTANTIATE_TYPED_FACTOR(SEMIRING)                                                                                         \
+    template struct BasicFactor<SEMIRING>;                                                                                         \
+    template BasicFactor<SEMIRING> typedFactorProduct(const BasicFactor<SEMIRING>&, const BasicFactor<SEMIRING>&, FactorArena*);  \
+    template BasicFactor<SEMIRING> typedFactorSumOut(const BasicFactor<SEMIRING>&, VarId, FactorArena*);                          \
+    template BasicFactor<SEMIRING> typedFactorProductSumOut(const std::vector<BasicFactor<SEMIRING>>&, const Factor::VarList&, FactorArena*); \
+    template void productSumOutRange<SEMIRING>(const ProductSumOutPlan&, const SEMIRING::Value* const*, SEMIRING::Value*, size_t, size_t);
+
+INSTANTIATE_TYPED_FACTOR(ProbabilitySemiring<double>)
+INSTANTIATE_TYPED_FACTOR(ProbabilitySemiring<float>)
+INSTANTIATE_TYPED_FACTOR(LogSemiring<double>)
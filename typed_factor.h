@@ -0,0 +1,117 @@
+#pragma once
+
+#include "semiring.h"
+#include "variable_elimination.h"
+
+#include <algorithm>
+
+/*
+    A factor whose values are of the type of a Semiring, combined with its operations.
+    It has the layout of Factor (the last variable changes fastest) and its tables come from a
+    FactorArena in the same way, but it has little of the machinery of the double kernels: no views
+    and no sparse tables. Plain probabilities (double or float) use the SIMD kernels of simd_kernels.h
+    for the sum-outs, the broadcast products and normalize(), and every product with sum-out goes
+    through productSumOutRange, the odometer shared with BayesianNetwork::factorProductSumOut.
+    Only the instantiations in typed_factor.cpp exist: ProbabilitySemiring<double>,
+    ProbabilitySemiring<float> and LogSemiring<double>.
+*/
+template <typename Semiring>
+struct BasicFactor {
+    typedef typename Semiring::Value Value;
+    typedef std::vector<Value, ArenaAllocator<Value>> ValueList;
+
+    Factor::VarList variables;
+    Factor::SizeList cardinalities;
+    Factor::SizeList strides;
+    ValueList values;
+
+    BasicFactor() = default;
+    //Every entry starts at Semiring::zero()
+    BasicFactor(const Factor::VarList& vars, const Factor::SizeList& cards, FactorArena* arena = nullptr);
+    //The probabilities of factor, converted with Semiring::fromProbability
+    explicit BasicFactor(const Factor& factor, FactorArena* arena = nullptr);
+
+    int indexOf(VarId var) const;
+    bool contains(VarId var) const;
+
+    //Divides every value by their sum, nothing changes when the sum is zero
+    void normalize();
+    //The probabilities of the values, in a Factor on the heap
+    Factor toFactor() const;
+};
+
+typedef BasicFactor<ProbabilitySemiring<float>> FloatFactor;
+typedef BasicFactor<LogSemiring<double>> LogFactor;
+
+/*
+    The scope and the strides of the product of some factors (Factor or BasicFactor) with the variables
+    of varsToSumOut summed out. The kept and the summed variables are sorted by VarId, the result is over
+    the kept ones; keptStrides[f * keptVars.size() + k] is the stride in factors[f] of the k-th kept
+    variable, 0 if the factor does not contain it, and the same for summedStrides.
+*/
+struct ProductSumOutPlan {
+    Factor::VarList keptVars, summedVars;
+    Factor::SizeList keptCards, summedCards;
+    std::vector<size_t> keptStrides, summedStrides;
+    size_t factorCount;
+    size_t summedEntries = 1; //the product of summedCards
+
+    template <typename FactorType>
+    ProductSumOutPlan(const std::vector<const FactorType*>& factors, const Factor::VarList& varsToSumOut)
+        : factorCount(factors.size()) {
+        std::vector<std::pair<VarId, size_t>> scope;
+        for (const auto* f : factors)
+            for (size_t k = 0; k < f->variables.size(); ++k)
+                scope.push_back({f->variables[k], f->cardinalities[k]});
+        std::sort(scope.begin(), scope.end());
+        scope.erase(std::unique(scope.begin(), scope.end()), scope.end());
+
+        for (const auto& [var, card] : scope) {
+            bool summed = std::find(varsToSumOut.begin(), varsToSumOut.end(), var) != varsToSumOut.end();
+            (summed ? summedVars : keptVars).push_back(var);
+            (summed ? summedCards : keptCards).push_back(card);
+            if (summed) summedEntries *= card;
+        }
+
+        const size_t n_kept = keptVars.size(), n_summed = summedVars.size();
+        keptStrides.resize(factors.size() * n_kept);
+        summedStrides.resize(factors.size() * n_summed);
+        for (size_t f = 0; f < factors.size(); ++f) {
+            for (size_t k = 0; k < n_kept; ++k) {
+                int p = factors[f]->indexOf(keptVars[k]);
+                keptStrides[f * n_kept + k] = p == -1 ? 0 : factors[f]->strides[p];
+            }
+            for (size_t s = 0; s < n_summed; ++s) {
+                int p = factors[f]->indexOf(summedVars[s]);
+                summedStrides[f * n_summed + s] = p == -1 ? 0 : factors[f]->strides[p];
+            }
+        }
+    }
+};
+
+/*
+    The generic kernel of every product with sum-out, computing the entries [begin, end) of the result
+    of plan from the tables of its factors (in the order given to the plan). Two odometers: the outer one
+    walks the result and moves base (the offset in each table of the current result entry), the inner one
+    walks the summed variables and moves offset away from base. Each entry is the Semiring sum, from
+    Semiring::zero() in the order of the summed values, of the products from the first table to the last.
+*/
+template <typename Semiring>
+void productSumOutRange(const ProductSumOutPlan& plan, const typename Semiring::Value* const* tables, typename Semiring::Value* out,
+                        size_t begin, size_t end);
+
+/*
+    The kernels of BayesianNetwork::factorProduct, factorSumOut and factorProductSumOut over a Semiring,
+    with the same scopes and layouts of the results. The results are allocated from arena when it is not null.
+    Every entry is computed as in the generic double kernels: products from the first factor to the last,
+    sums starting from Semiring::zero() in the order of the summed values.
+*/
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorProduct(const BasicFactor<Semiring>& f1, const BasicFactor<Semiring>& f2, FactorArena* arena = nullptr);
+
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorSumOut(const BasicFactor<Semiring>& factor, VarId varToSumOut, FactorArena* arena = nullptr);
+
+template <typename Semiring>
+BasicFactor<Semiring> typedFactorProductSumOut(const std::vector<BasicFactor<Semiring>>& factors, const Factor::VarList& varsToSumOut,
+                                               FactorArena* arena = nullptr);
@@ -1,244 +1,1200 @@
 #include "parser.h"
 #include "variable_elimination.h"
+#include "simd_kernels.h"
+#include "small_kernels.h"
+#include "typed_factor.h"
 #include <chrono>
 #include <iostream>
 #include <algorithm>
 #include <queue>
+#include <iterator>
 #include <set>
+#include <tuple>
+#include <type_traits>
 
 #define DEBUG 0
 
-Node::Node(const std::string& name, const std::vector<std::string>& domain)
-    : name(name), domain(domain) {}
+size_t NetworkLayout::size() const {
+    return names.size();
+}
 
-size_t Node::getCardinality() const {
-    return domain.size();
+Span<SymbolId> NetworkLayout::valuesOf(VarId var) const {
+    return Span<SymbolId>(values.data() + valueOffsets[var], values.data() + valueOffsets[var + 1]);
 }
 
-Factor::Factor(const std::vector<std::string>& vars, const std::map<std::string, size_t>& cards)
-    : variables(vars), cardinalities(cards) {
-    initialise_indexes();
+Span<VarId> NetworkLayout::parentsOf(VarId var) const {
+    return Span<VarId>(parents.begin() + parentOffsets[var], parents.begin() + parentOffsets[var + 1]);
 }
 
-std::map<std::string, size_t> Factor::getAssignment(size_t index) const {
-    std::map<std::string, size_t> assignment;
-    size_t temp_index = index;
-    for (const auto& var : variables) {
-        const size_t stride = strides.at(var);
-        assignment[var] = temp_index / stride;
-        temp_index %= stride;
+Span<VarId> NetworkLayout::childrenOf(VarId var) const {
+    return Span<VarId>(children.data() + childOffsets[var], children.data() + childOffsets[var + 1]);
+}
+
+void NetworkLayout::linkChildren() {
+    const size_t n = size();
+    std::vector<size_t> child_counts(n, 0);
+    for (VarId parent : parents) ++child_counts[parent];
+
+    //Visiting the variables in order keeps each list sorted
+    childOffsets.assign(n + 1, 0);
+    for (VarId var = 0; var < n; ++var) childOffsets[var + 1] = childOffsets[var] + child_counts[var];
+    children.resize(childOffsets[n]);
+    std::vector<size_t> next_child(childOffsets.begin(), childOffsets.end() - 1);
+    for (VarId var = 0; var < n; ++var)
+        for (VarId parent : parentsOf(var)) children[next_child[parent]++] = var;
+}
+
+Span<double> NetworkLayout::cptOf(VarId var) const {
+    return Span<double>(cptData[var], cptData[var] + cptSizes[var]);
+}
+
+const double* NetworkLayout::storeCPT(const double* entries, size_t size) {
+    double* start;
+    if (size > CPT_BLOCK_ENTRIES) {
+        //A big table gets a block of its own, the free space of the current block stays for the next tables
+        cptBlocks.emplace_back(new double[size]);
+        start = cptBlocks.back().get();
+    } else {
+        if (size > cptBlockFree) {
+            //Not zeroed, so the pages are only touched when the tables are copied in
+            cptBlocks.emplace_back(new double[CPT_BLOCK_ENTRIES]);
+            cptNext = cptBlocks.back().get();
+            cptBlockFree = CPT_BLOCK_ENTRIES;
+        }
+        start = cptNext;
+        cptNext += size;
+        cptBlockFree -= size;
     }
-    return assignment;
+    std::copy(entries, entries + size, start);
+    return start;
+}
+
+FactorValues::FactorValues(const FactorValues& other)
+    : owned(other.owned),
+      first(other.viewing ? other.first : owned.data()),
+      count(other.count),
+      viewing(other.viewing) {}
+
+FactorValues::FactorValues(FactorValues&& other) noexcept
+    : owned(std::move(other.owned)),
+      first(other.first),
+      count(other.count),
+      viewing(other.viewing) {
+    other.first = nullptr;
+    other.count = 0;
+    other.viewing = false;
+}
+
+FactorValues& FactorValues::operator=(const FactorValues& other) {
+    if (this == &other) return *this;
+    owned = other.owned;
+    first = other.viewing ? other.first : owned.data();
+    count = other.count;
+    viewing = other.viewing;
+    return *this;
+}
+
+FactorValues& FactorValues::operator=(FactorValues&& other) noexcept {
+    if (this == &other) return *this;
+    //The allocator propagates on move assignment, so the buffer is taken as it is
+    owned = std::move(other.owned);
+    first = other.first;
+    count = other.count;
+    viewing = other.viewing;
+    other.first = nullptr;
+    other.count = 0;
+    other.viewing = false;
+    return *this;
+}
+
+void FactorValues::resize(size_t size, double value) {
+    if (viewing) materialize();
+    owned.resize(size, value);
+    first = owned.data();
+    count = size;
+}
+
+void FactorValues::materialize() {
+    owned.assign(first, first + count);
+    first = owned.data();
+    viewing = false;
+}
+
+Factor::Factor(const VarList& vars, const SizeList& cards, FactorArena* arena)
+    : variables(vars), cardinalities(cards), values(ArenaAllocator<double>(arena)) {
+    initialise_indexes();
+}
+
+Factor::Factor(const VarList& vars, const SizeList& cards, Span<double> table, FactorArena* arena)
+    : variables(vars), cardinalities(cards), values(table, ArenaAllocator<double>(arena)) {
+    initialise_indexes();
 }
 
 void Factor::initialise_indexes() {
+    strides.resize(variables.size());
     size_t current_stride = 1;
-    for (auto it = variables.rbegin(); it != variables.rend(); ++it) {
-        const std::string& var = *it;
-        strides[var] = current_stride;
-        current_stride *= cardinalities.at(var);
+    for (size_t i = variables.size(); i-- > 0;) {
+        strides[i] = current_stride;
+        current_stride *= cardinalities[i];
     }
-    values.resize(current_stride, 0.0);
+    //A view keeps the size of its table
+    if (!values.isView()) values.resize(current_stride, 0.0);
 }
 
-size_t Factor::getIndex(const std::map<std::string, size_t>& assignment) const {
-    size_t index = 0;
-    for (const auto& var : variables) {
-        index += strides.at(var) * assignment.at(var);
+int Factor::indexOf(VarId var) const {
+    for (size_t i = 0; i < variables.size(); ++i)
+        if (variables[i] == var) return static_cast<int>(i);
+    return -1;
+}
+
+bool Factor::contains(VarId var) const {
+    return indexOf(var) != -1;
+}
+
+void Factor::getAssignment(size_t index, SizeList& assignment) const {
+    assignment.resize(variables.size());
+    size_t temp_index = index;
+    for (size_t i = 0; i < variables.size(); ++i) {
+        assignment[i] = temp_index / strides[i];
+        temp_index %= strides[i];
     }
+}
+
+size_t Factor::getIndex(const SizeList& assignment) const {
+    size_t index = 0;
+    for (size_t i = 0; i < variables.size(); ++i)
+        index += strides[i] * assignment[i];
     return index;
 }
 
-double Factor::getValue(const std::map<std::string, size_t>& assignment) const {
+double Factor::getValue(const SizeList& assignment) const {
     return values[getIndex(assignment)];
 }
 
 void Factor::normalize() {
-    double total = 0;
-    for (const auto& val : values)
-        total += val;
+    const double total = sumValues(values.data(), values.size());
     if (total > 0)
-        for (auto& val : values)
-            val /= total;
+        divideValues(values.data(), values.size(), total);
+    sparse.reset();
 }
 
-BayesianNetwork::BayesianNetwork(const NetworkAST& parsedNetwork) {
-    build(parsedNetwork);
+double SparseTable::density() const {
+    return size == 0 ? 1.0 : static_cast<double>(nonzeros()) / static_cast<double>(size);
 }
 
-const Node* BayesianNetwork::getNode(const std::string& name) const {
-    auto it = nodes.find(name);
-    if (it == nodes.end()) {
+SparseTable makeSparseTable(const double* values, size_t size, size_t blockSize) {
+    SparseTable table;
+    table.size = size;
+    table.blockSize = blockSize;
+    const size_t nonzeros = size - static_cast<size_t>(std::count(values, values + size, 0.0));
+    table.first.reserve(size / blockSize + 1);
+    //Every entry is written and the position only moves past the nonzero ones, so the inner loop has no branch
+    table.positions.resize(nonzeros + 1);
+    table.values.resize(nonzeros + 1);
+    uint32_t n = 0;
+    for (size_t block = 0; block < size; block += blockSize) {
+        table.first.push_back(n);
+        for (size_t i = 0; i < blockSize; ++i) {
+            table.positions[n] = static_cast<uint32_t>(i);
+            table.values[n] = values[block + i];
+            n += values[block + i] != 0.0;
+        }
+    }
+    table.first.push_back(n);
+    table.positions.pop_back();
+    table.values.pop_back();
+    table.deterministic = std::all_of(table.values.begin(), table.values.end(), [](double v) { return v == 1.0; });
+    return table;
+}
+
+bool FactorCache::Key::operator<(const Key& other) const {
+    return std::tie(scope, sources, eliminated, evidence) < std::tie(other.scope, other.sources, other.eliminated, other.evidence);
+}
+
+const Factor* FactorCache::find(const Key& key) {
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        ++stats.misses;
         return nullptr;
     }
-    return it->second.get();
+    ++stats.hits;
+    return &it->second;
 }
 
-void BayesianNetwork::build(const NetworkAST& parsedNetwork) {
-    for (const auto& var : parsedNetwork.variables)
-        nodes[var.name] = std::make_unique<Node>(var.name, var.domain);
+void FactorCache::insert(const Key& key, const Factor& factor) {
+    entries[key] = factor;
+}
 
-    for (const auto& prob : parsedNetwork.probabilities) {
-        Node* currentNode = nodes.at(prob.variable).get();
-        for (const auto& parentName : prob.parents) {
-            Node* parentNode = nodes.at(parentName).get();
-            currentNode->cpt.parents.push_back(parentNode);
-            parentNode->children.push_back(currentNode);
-        }
-        for (const auto& row : prob.table)
-            currentNode->cpt.table.insert(currentNode->cpt.table.end(), row.begin(), row.end());
+void FactorCache::clear() {
+    entries.clear();
+    stats = CacheStats();
+}
+
+CacheStats FactorCache::getStats() const {
+    CacheStats result = stats;
+    result.entries = entries.size();
+    return result;
+}
+
+BayesianNetwork::BayesianNetwork(const NetworkAST& parsedNetwork)
+    : BayesianNetwork(NetworkAST(parsedNetwork)) {}
+
+BayesianNetwork::BayesianNetwork(NetworkAST&& parsedNetwork) {
+    build(std::move(parsedNetwork));
+}
+
+BayesianNetwork::BayesianNetwork(Parser& parser) {
+    Builder builder(*this);
+    parser.parse(builder);
+    builder.finish();
+}
+
+BayesianNetwork::BayesianNetwork(std::string name, SymbolTable&& symbols, NetworkLayout&& packedLayout)
+    : layout(std::move(packedLayout)), networkName(std::move(name)), symbols(std::move(symbols)) {
+    for (VarId var = 0; var < layout.size(); ++var) {
+        const SymbolId symbol = layout.names[var];
+        if (symbol >= varOfSymbol.size()) varOfSymbol.resize(symbol + 1, NO_VARIABLE);
+        varOfSymbol[symbol] = var;
     }
+    layout.linkChildren();
+    indexVariables();
+}
+
+BayesianNetwork::Builder::Builder(BayesianNetwork& network)
+    : network(network) {}
+
+void BayesianNetwork::Builder::onNetwork(std::string name) {
+    network.networkName = std::move(name);
+}
+
+void BayesianNetwork::Builder::onVariable(Variable&& variable) {
+    const VarId id = static_cast<VarId>(domains.size());
+    network.layout.names.push_back(variable.name);
+    domains.push_back(std::move(variable.domain));
+    parents.emplace_back();
+    network.layout.cptData.push_back(nullptr);
+    network.layout.cptSizes.push_back(0);
+
+    std::vector<VarId>& varOfSymbol = network.varOfSymbol;
+    if (variable.name >= varOfSymbol.size()) varOfSymbol.resize(variable.name + 1, NO_VARIABLE);
+    varOfSymbol[variable.name] = id;
+}
+
+void BayesianNetwork::Builder::onProbability(Probability&& probability) {
+    if (pending.empty() && isDeclared(probability))
+        addProbability(std::move(probability));
+    else
+        pending.push_back(std::move(probability));
+}
+
+void BayesianNetwork::Builder::onSymbols(SymbolTable&& symbols) {
+    network.symbols = std::move(symbols);
+}
+
+bool BayesianNetwork::Builder::isDeclared(const Probability& probability) const {
+    if (network.findVariable(probability.variable) == NO_VARIABLE) return false;
+    for (SymbolId parent : probability.parents)
+        if (network.findVariable(parent) == NO_VARIABLE) return false;
+    return true;
+}
+
+void BayesianNetwork::Builder::addProbability(Probability&& prob) {
+    auto findVar = [&](SymbolId name) {
+        const VarId var = network.findVariable(name);
+        if (var == NO_VARIABLE)
+            throw std::runtime_error("Unknown variable " + std::string(network.symbols.name(name)) + " in the probability of " + std::string(network.symbols.name(prob.variable)));
+        return var;
+    };
+
+    const VarId var = findVar(prob.variable);
+    for (SymbolId parent : prob.parents) parents[var].push_back(findVar(parent));
+    //The table is already flat, in the layout of the CPT; the rows of a second block for the same
+    //variable follow the first ones, so both are copied again and the old copy is left unused
+    NetworkLayout& layout = network.layout;
+    if (layout.cptSizes[var] > 0) {
+        std::vector<double> rows(layout.cptData[var], layout.cptData[var] + layout.cptSizes[var]);
+        rows.insert(rows.end(), prob.table.begin(), prob.table.end());
+        prob.table = std::move(rows);
+    }
+    layout.cptData[var] = layout.storeCPT(prob.table.data(), prob.table.size());
+    layout.cptSizes[var] = prob.table.size();
+}
+
+void BayesianNetwork::Builder::finish() {
+    for (auto& probability : pending)
+        addProbability(std::move(probability));
+    pending.clear();
+
+    NetworkLayout& layout = network.layout;
+    const size_t n = domains.size();
+    size_t n_values = 0, n_parents = 0;
+    for (VarId var = 0; var < n; ++var) {
+        n_values += domains[var].size();
+        n_parents += parents[var].size();
+    }
+    layout.values.reserve(n_values);
+    layout.parentList.reserve(n_parents);
+
+    layout.valueOffsets.push_back(0);
+    layout.parentOffsetList.push_back(0);
+    for (VarId var = 0; var < n; ++var) {
+        layout.cardinalityList.push_back(domains[var].size());
+        layout.values.insert(layout.values.end(), domains[var].begin(), domains[var].end());
+        layout.valueOffsets.push_back(layout.values.size());
+        layout.parentList.insert(layout.parentList.end(), parents[var].begin(), parents[var].end());
+        layout.parentOffsetList.push_back(layout.parentList.size());
+    }
+    layout.cardinalities = Span<size_t>(layout.cardinalityList);
+    layout.parentOffsets = Span<size_t>(layout.parentOffsetList);
+    layout.parents = Span<VarId>(layout.parentList);
+    layout.linkChildren();
+
+    domains.clear();
+    parents.clear();
+    network.indexVariables();
+}
+
+void BayesianNetwork::indexVariables() {
+    //The initial factors are built in the order of the names, as they always were
+    nameOrder.clear();
+    for (VarId var : varOfSymbol)
+        if (var != NO_VARIABLE) nameOrder.push_back(var);
+    std::sort(nameOrder.begin(), nameOrder.end(), [&](VarId a, VarId b) {
+        return getVariableName(a) < getVariableName(b);
+    });
+
+    buildSparseCPTs();
 }
 
-void BayesianNetwork::printFactor(const Factor& f, const std::string& label) {
+const std::string& BayesianNetwork::getName() const {
+    return networkName;
+}
+
+const NetworkLayout& BayesianNetwork::getLayout() const {
+    return layout;
+}
+
+size_t BayesianNetwork::getVariableCount() const {
+    return layout.size();
+}
+
+size_t BayesianNetwork::getCardinality(VarId id) const {
+    if (id >= layout.size()) throw std::out_of_range("No variable with id " + std::to_string(id));
+    return layout.cardinalities[id];
+}
+
+bool BayesianNetwork::containsVariable(std::string_view name) const {
+    return findVariable(symbols.find(name)) != NO_VARIABLE;
+}
+
+VarId BayesianNetwork::findVariable(SymbolId name) const {
+    return name < varOfSymbol.size() ? varOfSymbol[name] : NO_VARIABLE;
+}
+
+VarId BayesianNetwork::getVarId(std::string_view name) const {
+    const VarId var = findVariable(symbols.find(name));
+    if (var == NO_VARIABLE)
+        throw std::runtime_error("Unknown variable " + std::string(name));
+    return var;
+}
+
+const SymbolTable& BayesianNetwork::getSymbols() const {
+    return symbols;
+}
+
+std::string_view BayesianNetwork::getVariableName(VarId id) const {
+    return symbols.name(layout.names.at(id));
+}
+
+std::string_view BayesianNetwork::getValueName(VarId id, size_t value) const {
+    return symbols.name(layout.valuesOf(id)[value]);
+}
+
+std::map<std::string, size_t> BayesianNetwork::getAssignment(const Factor& f, size_t index) const {
+    Factor::SizeList positional;
+    f.getAssignment(index, positional);
+    std::map<std::string, size_t> assignment;
+    for (size_t i = 0; i < f.variables.size(); ++i)
+        assignment[std::string(getVariableName(f.variables[i]))] = positional[i];
+    return assignment;
+}
+
+void BayesianNetwork::build(NetworkAST&& parsedNetwork) {
+    Builder builder(*this);
+    builder.onNetwork(std::move(parsedNetwork.name));
+    for (auto& var : parsedNetwork.variables) builder.onVariable(std::move(var));
+    for (auto& prob : parsedNetwork.probabilities) builder.onProbability(std::move(prob));
+    builder.onSymbols(std::move(parsedNetwork.symbols));
+    builder.finish();
+}
+
+void BayesianNetwork::printFactor(const Factor& f, const std::string& label) const {
     if (!label.empty()) std::cout << "\n=== Factor: " << label << " ===\n";
     std::cout << "Variables: ";
-    for (const auto& var : f.variables) std::cout << var << " ";
+    for (VarId var : f.variables) std::cout << getVariableName(var) << " ";
     std::cout << "\nValues:\n";
+    Factor::SizeList assignment;
     for (size_t i = 0; i < f.values.size(); ++i) {
-        auto assignment = f.getAssignment(i);
+        f.getAssignment(i, assignment);
         std::cout << "  ";
-        for (const auto& var : f.variables) {
-            const Node* queryNode = getNode(var);
-            std::cout << var << "=" << queryNode->domain[assignment[var]] << " ";
+        for (size_t k = 0; k < f.variables.size(); ++k) {
+            std::cout << getVariableName(f.variables[k]) << "=" << getValueName(f.variables[k], assignment[k]) << " ";
         }
         std::cout << "-> " << f.values[i] << "\n";
     }
 }
 
-std::set<std::string> BayesianNetwork::getRelevantVariables(const std::string& queryVar, const std::map<std::string, std::unique_ptr<Node>>& nodes) {
-    std::set<std::string> visited;
-    std::queue<std::string> to_visit;
+ObservedValues BayesianNetwork::resolveEvidence(const Evidence& evidence) const {
+    ObservedValues observed(layout.size(), -1);
+    for (const auto& [variable, value] : evidence) {
+        const VarId var = getVarId(variable);
+        const Span<SymbolId> domain = layout.valuesOf(var);
+        //A value never interned is not in any domain, the others are compared as integers
+        auto it = std::find(domain.begin(), domain.end(), symbols.find(value));
+        if (it == domain.end())
+            throw std::runtime_error("Unknown value " + value + " for variable " + variable);
+        observed[var] = static_cast<int>(it - domain.begin());
+    }
+    return observed;
+}
+
+std::vector<bool> BayesianNetwork::getRelevantVariables(VarId queryVar, const ObservedValues& observed) const {
+    const size_t n = layout.size();
+    auto isObserved = [&](VarId var) { return !observed.empty() && observed[var] != -1; };
+
+    //1. Ancestors of the query and of the evidence, everything else is barren
+    std::vector<bool> ancestral(n, false);
+    std::queue<VarId> to_visit;
     to_visit.push(queryVar);
+    for (VarId var = 0; var < n; ++var)
+        if (isObserved(var)) to_visit.push(var);
 
     while (!to_visit.empty()) {
-        std::string current = to_visit.front();
+        VarId current = to_visit.front();
         to_visit.pop();
 
-        if (visited.count(current)) continue;
-        visited.insert(current);
+        if (ancestral[current]) continue;
+        ancestral[current] = true;
+
+        for (VarId parent : layout.parentsOf(current))
+            to_visit.push(parent);
+    }
+
+    //2. Bayes-ball, each entry of the queue is a node and whether the ball comes from one of its children
+    std::vector<bool> top(n, false), bottom(n, false);
+    std::queue<std::pair<VarId, bool>> balls;
+    balls.push({queryVar, true});
+
+    auto passUp = [&](VarId var) {
+        if (top[var]) return;
+        top[var] = true;
+        for (VarId parent : layout.parentsOf(var)) balls.push({parent, true});
+    };
+    auto passDown = [&](VarId var) {
+        if (bottom[var]) return;
+        bottom[var] = true;
+        for (VarId child : layout.childrenOf(var))
+            if (ancestral[child]) balls.push({child, false});
+    };
 
-        const Node* node = nodes.at(current).get();
-        for (const Node* parent : node->cpt.parents)
-            to_visit.push(parent->name);
+    while (!balls.empty()) {
+        auto [current, fromChild] = balls.front();
+        balls.pop();
+
+        if (fromChild && !isObserved(current)) {
+            passUp(current);
+            passDown(current);
+        } else if (!fromChild) {
+            if (isObserved(current)) passUp(current);
+            else passDown(current);
+        }
     }
-    return visited;
+    return top;
 }
 
-Factor BayesianNetwork::factorProduct(const Factor& f1, const Factor& f2) {
-    std::set<std::string> vars_set;
-    vars_set.insert(f1.variables.begin(), f1.variables.end());
-    vars_set.insert(f2.variables.begin(), f2.variables.end());
+void BayesianNetwork::parallelFor(size_t size, const std::function<void(size_t, size_t)>& body) const {
+    if (!threadPool || size < parallelThreshold) {
+        body(0, size);
+        return;
+    }
+    //A few chunks per thread, so a thread slowed down by other work does not delay the whole kernel
+    const size_t n_chunks = threadPool->getThreadCount() * 4;
+    const size_t chunk = (size + n_chunks - 1) / n_chunks;
+    TaskGroup group(*threadPool);
+    for (size_t begin = 0; begin < size; begin += chunk) {
+        const size_t end = std::min(size, begin + chunk);
+        group.run([&body, begin, end] { body(begin, end); });
+    }
+    group.wait();
+}
 
-    std::vector<std::string> new_vars(vars_set.begin(), vars_set.end());
-    std::map<std::string, size_t> new_cards;
-    for (const auto& var : new_vars)
-        if (f1.cardinalities.count(var)) new_cards[var] = f1.cardinalities.at(var);
-        else new_cards[var] = f2.cardinalities.at(var);
+Factor BayesianNetwork::factorProduct(const Factor& f1, const Factor& f2) const {
+    //The scope of the result is the union of the two scopes, sorted by VarId
+    Factor::VarList new_vars;
+    Factor::SizeList new_cards;
+    auto insertSorted = [&](VarId var, size_t card) {
+        size_t pos = 0;
+        while (pos < new_vars.size() && new_vars[pos] < var) ++pos;
+        if (pos < new_vars.size() && new_vars[pos] == var) return;
+        new_vars.push_back(var);
+        new_cards.push_back(card);
+        for (size_t k = new_vars.size() - 1; k > pos; --k) {
+            new_vars[k] = new_vars[k - 1];
+            new_cards[k] = new_cards[k - 1];
+        }
+        new_vars[pos] = var;
+        new_cards[pos] = card;
+    };
+    for (size_t k = 0; k < f1.variables.size(); ++k) insertSorted(f1.variables[k], f1.cardinalities[k]);
+    for (size_t k = 0; k < f2.variables.size(); ++k) insertSorted(f2.variables[k], f2.cardinalities[k]);
 
-    Factor result(new_vars, new_cards);
+    Factor result(new_vars, new_cards, activeArena);
 
-    for (size_t i = 0; i < result.values.size(); ++i) {
-        std::map<std::string, size_t> full_assignment = result.getAssignment(i);
-        std::map<std::string, size_t> assignment1, assignment2;
-        for (const auto& var : f1.variables) assignment1[var] = full_assignment.at(var);
-        for (const auto& var : f2.variables) assignment2[var] = full_assignment.at(var);
-        result.values[i] = f1.getValue(assignment1) * f2.getValue(assignment2);
+    //stride1[k] is the stride in f1 of the k-th variable of the result, 0 if f1 does not contain it
+    Factor::SizeList stride1, stride2;
+    for (VarId var : result.variables) {
+        int p1 = f1.indexOf(var), p2 = f2.indexOf(var);
+        stride1.push_back(p1 == -1 ? 0 : f1.strides[p1]);
+        stride2.push_back(p2 == -1 ? 0 : f2.strides[p2]);
     }
+
+    //The common layouts, one factor over the whole scope and the other over a prefix or a suffix of it, use the SIMD kernels
+    const Factor* big = nullptr;
+    const Factor* small = nullptr;
+    bool inner = false;
+    size_t period = 0;
+    const size_t n_vars = result.variables.size();
+    if (stride1 == result.strides && matchBroadcast(stride2.data(), result.strides.data(), n_vars, result.values.size(), inner, period)) {
+        big = &f1;
+        small = &f2;
+    } else if (stride2 == result.strides && matchBroadcast(stride1.data(), result.strides.data(), n_vars, result.values.size(), inner, period)) {
+        big = &f2;
+        small = &f1;
+    }
+
+    //With a sparse factor only its nonzero entries are multiplied, the other entries stay 0
+    const std::vector<const Factor*> operands = {&f1, &f2};
+    const size_t driver = chooseSparseDriver(operands, result.values.size(), result.values.size() * (big ? SIMD_ENTRY_COST : 1.0));
+    if (driver < operands.size()) {
+        sparseProductSumOut(operands, driver, NO_VARIABLE, result);
+        return result;
+    }
+
+    //Small tables over variables with the same cardinality have a kernel with every loop unrolled
+    bool same_cards = true;
+    for (size_t card : result.cardinalities) same_cards = same_cards && card == result.cardinalities[0];
+    if (same_cards && !result.variables.empty()) {
+        if (ProductKernel kernel = findProductKernel(result.variables.size(), result.cardinalities[0])) {
+            kernel(f1.values.data(), stride1.data(), f2.values.data(), stride2.data(), result.values.data());
+            return result;
+        }
+    }
+
+    if (big) {
+        parallelFor(result.values.size(), [&](size_t begin, size_t end) {
+            if (inner) multiplyBroadcastInner(big->values.data(), small->values.data(), result.values.data(), begin, end, period);
+            else multiplyBroadcastOuter(big->values.data(), small->values.data(), result.values.data(), begin, end, period);
+        });
+        return result;
+    }
+
+    /*
+    The result is walked in order with a multi-radix counter (an odometer) over its variables.
+    When digit k goes up by one the input offsets move by stride1[k] and stride2[k],
+    when it wraps around to 0 they move back by (cardinality - 1) strides.
+    Each chunk of parallelFor starts its own odometer from the assignment of its first entry.
+    */
+    parallelFor(result.values.size(), [&](size_t begin, size_t end) {
+        Factor::SizeList counter;
+        result.getAssignment(begin, counter);
+        size_t index1 = 0, index2 = 0;
+        for (size_t k = 0; k < n_vars; ++k) {
+            index1 += counter[k] * stride1[k];
+            index2 += counter[k] * stride2[k];
+        }
+        double* out = result.values.data();
+        for (size_t i = begin; i < end; ++i) {
+            out[i] = f1.values[index1] * f2.values[index2];
+
+            for (size_t k = n_vars; k-- > 0;) {
+                if (++counter[k] < result.cardinalities[k]) {
+                    index1 += stride1[k];
+                    index2 += stride2[k];
+                    break;
+                }
+                counter[k] = 0;
+                index1 -= (result.cardinalities[k] - 1) * stride1[k];
+                index2 -= (result.cardinalities[k] - 1) * stride2[k];
+            }
+        }
+    });
     return result;
 }
 
-Factor BayesianNetwork::factorSumOut(const Factor& factor, const std::string& varToSumOut) {
-    std::vector<std::string> new_vars;
-    std::map<std::string, size_t> new_cards;
+Factor BayesianNetwork::factorSumOut(const Factor& factor, VarId varToSumOut) const {
+    Factor::VarList new_vars;
+    Factor::SizeList new_cards;
+
+    for (size_t k = 0; k < factor.variables.size(); ++k) {
+        if (factor.variables[k] != varToSumOut) {
+            new_vars.push_back(factor.variables[k]);
+            new_cards.push_back(factor.cardinalities[k]);
+        }
+    }
+
+    Factor result(new_vars, new_cards, activeArena);
+    const int position = factor.indexOf(varToSumOut);
+    const size_t varToSumOut_cardinality = factor.cardinalities[position];
+    const size_t varToSumOut_stride = factor.strides[position];
+
+    /*
+    Dropping one variable keeps the order of the others, so the result entry b * stride + t
+    is the sum over j of the entries (b * cardinality + j) * stride + t of factor.
+    */
+    if (chooseSparseDriver({&factor}, factor.values.size(), factor.values.size() * SIMD_ENTRY_COST) == 0) {
+        sparseProductSumOut({&factor}, 0, varToSumOut, result);
+    } else if (SumOutKernel kernel = findSumOutKernel(varToSumOut_cardinality, factor.values.size())) {
+        kernel(factor.values.data(), result.values.data(), 0, result.values.size(), varToSumOut_stride);
+    } else {
+        parallelFor(result.values.size(), [&](size_t begin, size_t end) {
+            sumOutBlocks(factor.values.data(), result.values.data(), begin, end, varToSumOut_stride, varToSumOut_cardinality);
+        });
+    }
+    return result;
+}
+
+Factor BayesianNetwork::factorProductSumOut(const std::vector<Factor>& factors, const Factor::VarList& varsToSumOut) const {
+    if (factors.empty())
+        throw std::runtime_error("factorProductSumOut needs at least one factor");
+    //A single factor does not need the product, the plain kernels are vectorized
+    if (factors.size() == 1 && varsToSumOut.size() <= 1 && (varsToSumOut.empty() || factors[0].contains(varsToSumOut[0])))
+        return varsToSumOut.empty() ? factors[0] : factorSumOut(factors[0], varsToSumOut[0]);
+
+    //The scope of the product sorted by VarId, split in the kept and the summed variables, and the strides of every factor
+    std::vector<const Factor*> operands;
+    for (const auto& f : factors) operands.push_back(&f);
+    const ProductSumOutPlan plan(operands, varsToSumOut);
+    Factor result(plan.keptVars, plan.keptCards, activeArena);
+    const size_t n_factors = factors.size();
+    const size_t n_kept = plan.keptVars.size(), n_summed = plan.summedVars.size();
+
+    //A sparse factor drives the kernel with one summed variable or none, when walking its nonzero entries costs less
+    if (n_summed <= 1) {
+        const size_t product_size = result.values.size() * plan.summedEntries;
+        const size_t driver = chooseSparseDriver(operands, product_size, static_cast<double>(product_size));
+        if (driver < n_factors) {
+            sparseProductSumOut(operands, driver, n_summed == 0 ? NO_VARIABLE : plan.summedVars[0], result);
+            return result;
+        }
+    }
+
+    std::vector<const double*> tables;
+    for (const auto& f : factors) tables.push_back(f.values.data());
+
+    //One summed variable (or none) of cardinality up to 3 and a few factors, the inner odometer is an unrolled loop
+    const size_t summed_card = n_summed == 0 ? 1 : plan.summedCards[0];
+    if (ProductSumOutKernel kernel = n_summed <= 1 ? findProductSumOutKernel(n_factors, summed_card, n_kept) : nullptr) {
+        parallelFor(result.values.size(), [&](size_t begin, size_t end) {
+            kernel(tables.data(), plan.keptStrides.data(), result.cardinalities.data(), n_kept, plan.summedStrides.data(), result.values.data(), begin, end);
+        });
+        return result;
+    }
+
+    //The generic odometers, the same kernel as the other value modes (see typed_factor.h)
+    parallelFor(result.values.size(), [&](size_t begin, size_t end) {
+        productSumOutRange<ProbabilitySemiring<double>>(plan, tables.data(), result.values.data(), begin, end);
+    });
+    return result;
+}
+
+/*
+    The walk of sparseProductSumOut when the driver contains every variable of the product, so that
+    each nonzero entry is a single term, with the number of multiplied tables fixed.
+    blockStrides[k * N_TABLES + t] is the stride in tables[t] of the k-th variable of the driver.
+*/
+template <size_t N_TABLES>
+static void sparseBlocksFixed(const SparseTable& table, const double* const* tables, const size_t* blockCards, size_t n_block_vars,
+                              const size_t* blockStrides, const size_t* blockOut, const size_t* lastStrides, size_t lastOut, double* out) {
+    std::vector<size_t> digits(n_block_vars, 0);
+    size_t base[N_TABLES + 1] = {};
+    size_t base_out = 0;
+    for (size_t block = 0; block + 1 < table.first.size(); ++block) {
+        for (size_t e = table.first[block]; e < table.first[block + 1]; ++e) {
+            const size_t position = table.positions[e];
+            double product = 1.0;
+            if (N_TABLES > 0) {
+                product = tables[0][base[0] + position * lastStrides[0]];
+                for (size_t t = 1; t < N_TABLES; ++t) product *= tables[t][base[t] + position * lastStrides[t]];
+            }
+            out[base_out + position * lastOut] += product;
+        }
+
+        for (size_t k = n_block_vars; k-- > 0;) {
+            const size_t* strides = &blockStrides[k * N_TABLES];
+            if (++digits[k] < blockCards[k]) {
+                for (size_t t = 0; t < N_TABLES; ++t) base[t] += strides[t];
+                base_out += blockOut[k];
+                break;
+            }
+            digits[k] = 0;
+            for (size_t t = 0; t < N_TABLES; ++t) base[t] -= (blockCards[k] - 1) * strides[t];
+            base_out -= (blockCards[k] - 1) * blockOut[k];
+        }
+    }
+}
+
+void BayesianNetwork::sparseProductSumOut(const std::vector<const Factor*>& factors, size_t s, VarId summedVar, Factor& result) const {
+    const Factor& driver = *factors[s];
+    const SparseTable& table = *driver.sparse;
+    const size_t n_factors = factors.size();
+
+    //The factors actually read for each term, a deterministic driver only multiplies by 1
+    std::vector<const double*> tables;
+    std::vector<size_t> multiplied;
+    for (size_t f = 0; f < n_factors; ++f) {
+        if (f == s && table.deterministic) continue;
+        tables.push_back(factors[f]->values.data());
+        multiplied.push_back(f);
+    }
+    const size_t n_tables = tables.size();
 
-    for (const auto& var : factor.variables) {
-        if (var != varToSumOut) {
+    //strides[v * n_tables + t] is the stride of a variable in the t-th multiplied table, out_strides its stride in result
+    auto addStrides = [&](VarId var, std::vector<size_t>& strides, std::vector<size_t>& out_strides) {
+        for (size_t f : multiplied) {
+            int p = factors[f]->indexOf(var);
+            strides.push_back(p == -1 ? 0 : factors[f]->strides[p]);
+        }
+        int p = result.indexOf(var);
+        out_strides.push_back(p == -1 ? 0 : result.strides[p]);
+    };
+
+    //The variables of the driver, whose digits come from the index of each nonzero entry
+    const size_t n_driver = driver.variables.size();
+    std::vector<size_t> driver_strides, driver_out;
+    for (VarId var : driver.variables) addStrides(var, driver_strides, driver_out);
+
+    //The other variables of the product, walked with an odometer for every nonzero entry
+    std::vector<size_t> rest_strides, rest_out, rest_cards;
+    for (size_t k = 0; k < result.variables.size(); ++k) {
+        if (driver.contains(result.variables[k])) continue;
+        addStrides(result.variables[k], rest_strides, rest_out);
+        rest_cards.push_back(result.cardinalities[k]);
+    }
+    size_t summed_card = 1;
+    for (const Factor* f : factors) {
+        int p = summedVar == NO_VARIABLE ? -1 : f->indexOf(summedVar);
+        if (p != -1) summed_card = f->cardinalities[p];
+    }
+    if (summedVar != NO_VARIABLE && !driver.contains(summedVar)) {
+        addStrides(summedVar, rest_strides, rest_out);
+        rest_cards.push_back(summed_card);
+    }
+    //The last of them is walked by the inner loop, a product with no other variable gets one of cardinality 1
+    if (rest_cards.empty()) {
+        rest_strides.resize(n_tables, 0);
+        rest_out.push_back(0);
+        rest_cards.push_back(1);
+    }
+    const size_t n_outer = rest_cards.size() - 1;
+    const size_t inner_card = rest_cards[n_outer], inner_out = rest_out[n_outer];
+    const size_t* inner_strides = &rest_strides[n_outer * n_tables];
+    size_t rest_size = 1;
+    for (size_t card : rest_cards) rest_size *= card;
+    const size_t outer_size = rest_size / inner_card;
+
+    /*
+    The blocks of the driver are walked with an odometer over all its variables but the last,
+    the position of a nonzero entry inside its block is the value of the last one.
+    */
+    const size_t n_block_vars = n_driver - 1;
+    const size_t* last_strides = &driver_strides[n_block_vars * n_tables];
+    const size_t last_out = driver_out[n_block_vars];
+    double* out = result.values.data();
+    if (rest_size == 1 && n_tables <= 3) {
+        typedef void (*BlocksKernel)(const SparseTable&, const double* const*, const size_t*, size_t, const size_t*, const size_t*, const size_t*, size_t, double*);
+        static const BlocksKernel kernels[4] = {sparseBlocksFixed<0>, sparseBlocksFixed<1>, sparseBlocksFixed<2>, sparseBlocksFixed<3>};
+        kernels[n_tables](table, tables.data(), driver.cardinalities.data(), n_block_vars, driver_strides.data(), driver_out.data(), last_strides, last_out, out);
+        countSparseWork(result.values.size() * summed_card, table.nonzeros());
+        return;
+    }
+    std::vector<size_t> digits(n_block_vars, 0), base(n_tables, 0), offset(n_tables), counter(n_outer);
+    size_t base_out = 0;
+    for (size_t block = 0; block + 1 < table.first.size(); ++block) {
+        for (size_t e = table.first[block]; e < table.first[block + 1]; ++e) {
+            const size_t position = table.positions[e];
+            for (size_t t = 0; t < n_tables; ++t) offset[t] = base[t] + position * last_strides[t];
+            size_t out_offset = base_out + position * last_out;
+
+            std::fill(counter.begin(), counter.end(), 0);
+            for (size_t r = 0; r < outer_size; ++r) {
+                for (size_t j = 0; j < inner_card; ++j) {
+                    double product = n_tables == 0 ? 1.0 : tables[0][offset[0] + j * inner_strides[0]];
+                    for (size_t t = 1; t < n_tables; ++t) product *= tables[t][offset[t] + j * inner_strides[t]];
+                    out[out_offset + j * inner_out] += product;
+                }
+
+                for (size_t k = n_outer; k-- > 0;) {
+                    const size_t* strides = &rest_strides[k * n_tables];
+                    if (++counter[k] < rest_cards[k]) {
+                        for (size_t t = 0; t < n_tables; ++t) offset[t] += strides[t];
+                        out_offset += rest_out[k];
+                        break;
+                    }
+                    counter[k] = 0;
+                    for (size_t t = 0; t < n_tables; ++t) offset[t] -= (rest_cards[k] - 1) * strides[t];
+                    out_offset -= (rest_cards[k] - 1) * rest_out[k];
+                }
+            }
+        }
+
+        for (size_t k = n_block_vars; k-- > 0;) {
+            const size_t* strides = &driver_strides[k * n_tables];
+            if (++digits[k] < driver.cardinalities[k]) {
+                for (size_t t = 0; t < n_tables; ++t) base[t] += strides[t];
+                base_out += driver_out[k];
+                break;
+            }
+            digits[k] = 0;
+            for (size_t t = 0; t < n_tables; ++t) base[t] -= (driver.cardinalities[k] - 1) * strides[t];
+            base_out -= (driver.cardinalities[k] - 1) * driver_out[k];
+        }
+    }
+    countSparseWork(result.values.size() * summed_card, table.nonzeros() * rest_size);
+}
+
+size_t BayesianNetwork::chooseSparseDriver(const std::vector<const Factor*>& factors, size_t productSize, double denseCost) {
+    size_t driver = factors.size();
+    double best = denseCost;
+    for (size_t f = 0; f < factors.size(); ++f) {
+        const SparseTable* table = factors[f]->sparse.get();
+        if (!table) continue;
+        //Each nonzero entry is combined with every assignment of the variables the factor does not contain
+        const double terms = static_cast<double>(table->nonzeros()) * static_cast<double>(productSize / table->size);
+        const double cost = static_cast<double>(table->first.size() - 1) * SPARSE_BLOCK_COST + terms * SPARSE_TERM_COST;
+        if (cost < best) {
+            best = cost;
+            driver = f;
+        }
+    }
+    return driver;
+}
+
+std::shared_ptr<const SparseTable> BayesianNetwork::sparseTableOf(const double* values, size_t size, size_t blockSize) const {
+    if (sparseThreshold <= 0 || size < SPARSE_MIN_ENTRIES || size >= UINT32_MAX) return nullptr;
+
+    //Stops counting (after a whole block) as soon as the table is too dense, which is the common case
+    const size_t max_nonzeros = static_cast<size_t>(sparseThreshold * static_cast<double>(size));
+    size_t nonzeros = 0;
+    for (size_t i = 0; i < size && nonzeros <= max_nonzeros; i += 256) {
+        const size_t end = std::min(size, i + 256);
+        for (size_t j = i; j < end; ++j) nonzeros += values[j] != 0.0;
+    }
+    if (nonzeros > max_nonzeros) return nullptr;
+    return std::make_shared<const SparseTable>(makeSparseTable(values, size, blockSize));
+}
+
+void BayesianNetwork::updateSparse(Factor& factor) const {
+    const FactorValues& values = factor.values;
+    factor.sparse = factor.variables.empty() ? nullptr : sparseTableOf(values.data(), values.size(), factor.cardinalities.back());
+}
+
+void BayesianNetwork::buildSparseCPTs() {
+    //The variable of a CPT is the last one of its factor, see buildInitialFactor
+    sparseCPTs.assign(layout.size(), nullptr);
+    for (VarId var = 0; var < layout.size(); ++var)
+        sparseCPTs[var] = sparseTableOf(layout.cptOf(var).begin(), layout.cptOf(var).size(), layout.cardinalities[var]);
+}
+
+void BayesianNetwork::countSparseWork(size_t products, size_t computed) const {
+    std::lock_guard<std::mutex> lock(sparseStatsMutex);
+    ++sparseStats.operations;
+    sparseStats.products += products;
+    sparseStats.skipped += products - computed;
+}
+
+Factor BayesianNetwork::factorMarginalize(const Factor& factor, const Factor::VarList& keep) const {
+    Factor result = factor;
+    for (VarId var : factor.variables)
+        if (std::find(keep.begin(), keep.end(), var) == keep.end())
+            result = factorSumOut(result, var);
+    return result;
+}
+
+Factor BayesianNetwork::factorReduce(const Factor& factor, VarId var, size_t value) const {
+    ObservedValues values(var + 1, -1);
+    values[var] = static_cast<int>(value);
+    return factorReduce(factor, values);
+}
+
+Factor BayesianNetwork::factorReduce(const Factor& factor, const ObservedValues& values) const {
+    Factor::VarList new_vars;
+    Factor::SizeList new_cards;
+    Factor::SizeList input_strides;
+    size_t base = 0;
+
+    for (size_t k = 0; k < factor.variables.size(); ++k) {
+        const VarId var = factor.variables[k];
+        if (var < values.size() && values[var] != -1) {
+            base += static_cast<size_t>(values[var]) * factor.strides[k];
+        } else {
             new_vars.push_back(var);
-            new_cards[var] = factor.cardinalities.at(var);
+            new_cards.push_back(factor.cardinalities[k]);
+            input_strides.push_back(factor.strides[k]);
         }
     }
 
-    Factor result(new_vars, new_cards);
-    size_t varToSumOut_cardinality = factor.cardinalities.at(varToSumOut);
+    Factor result(new_vars, new_cards, activeArena);
 
+    //Same odometer walk as in factorProduct, starting from the slice of the observed values
+    const size_t n_vars = result.variables.size();
+    Factor::SizeList counter(n_vars, 0);
+    double* out = result.values.data();
     for (size_t i = 0; i < result.values.size(); ++i) {
-        auto partial_assignment = result.getAssignment(i);
-        double sum = 0.0;
-        for (size_t j = 0; j < varToSumOut_cardinality; ++j) {
-            partial_assignment[varToSumOut] = j;
-            sum += factor.getValue(partial_assignment);
+        out[i] = factor.values[base];
+
+        for (size_t k = n_vars; k-- > 0;) {
+            if (++counter[k] < result.cardinalities[k]) {
+                base += input_strides[k];
+                break;
+            }
+            counter[k] = 0;
+            base -= (result.cardinalities[k] - 1) * input_strides[k];
         }
-        result.values[i] = sum;
     }
+    updateSparse(result);
     return result;
 }
 
-std::vector<Factor> BayesianNetwork::buildInitialFactors(const std::set<std::string>& relevantVars) {
-    std::vector<Factor> factors;
-    for (const auto& pair : nodes) {
-        const std::string& nodeName = pair.first;
-        if (!relevantVars.count(nodeName)) continue;
+Factor BayesianNetwork::buildInitialFactor(VarId var, const ObservedValues& observed) const {
+    Factor::VarList factor_vars;
+    Factor::SizeList factor_cards;
 
-        const Node* node = pair.second.get();
-        std::vector<std::string> factor_vars;
-        std::map<std::string, size_t> factor_cards;
+    for (VarId parent : layout.parentsOf(var)) {
+        factor_vars.push_back(parent);
+        factor_cards.push_back(layout.cardinalities[parent]);
+    }
+    factor_vars.push_back(var);
+    factor_cards.push_back(layout.cardinalities[var]);
 
-        for (const auto* parent : node->cpt.parents) {
-            factor_vars.push_back(parent->name);
-            factor_cards[parent->name] = parent->getCardinality();
-        }
-        factor_vars.push_back(node->name);
-        factor_cards[node->name] = node->getCardinality();
+    //The CPT is read in place, nothing is copied unless the factor is written
+    Factor f(factor_vars, factor_cards, layout.cptOf(var), activeArena);
+    f.sparse = sparseCPTs[var];
 
-        Factor f(factor_vars, factor_cards);
-        f.values = node->cpt.table;
+    if (!observed.empty() && std::any_of(factor_vars.begin(), factor_vars.end(), [&](VarId u) { return observed[u] != -1; }))
+        f = factorReduce(f, observed);
 
-        if (DEBUG) printFactor(f, "Initial factor for " + node->name);
+    if (DEBUG) printFactor(f, "Initial factor for " + std::string(getVariableName(var)));
 
-        factors.push_back(f);
+    return f;
+}
+
+std::vector<Factor> BayesianNetwork::buildInitialFactors(const std::vector<bool>& relevantVars, const ObservedValues& observed) const {
+    std::vector<Factor> factors;
+    for (VarId var : nameOrder) {
+        if (!relevantVars[var]) continue;
+        factors.push_back(buildInitialFactor(var, observed));
     }
     return factors;
 }
 
-std::vector<Factor> BayesianNetwork::eliminateVariables(std::vector<Factor> factors, const std::string& queryVariableName) {
-    for (const auto& pair : nodes) {
-        const std::string& var_to_eliminate = pair.first;
-        if (var_to_eliminate == queryVariableName) continue;
+EliminationPlan BayesianNetwork::planElimination(const std::vector<Factor>& factors, VarId queryVar) const {
+    std::vector<std::vector<VarId>> scopes;
+    std::vector<bool> seen(layout.size(), false);
+    std::vector<VarId> to_eliminate;
+    for (const auto& f : factors) {
+        scopes.emplace_back(f.variables.begin(), f.variables.end());
+        for (VarId var : f.variables) {
+            if (seen[var] || var == queryVar) continue;
+            seen[var] = true;
+            to_eliminate.push_back(var);
+        }
+    }
 
+    EliminationOrderPlanner planner(eliminationHeuristic);
+    const std::vector<size_t> cardinalities(layout.cardinalities.begin(), layout.cardinalities.end());
+    TableMemory memory = tableMemory(valueMode);
+    for (const auto& f : factors) memory.allocated.push_back(f.values.getArena() != nullptr);
+    if (memoryBudget == 0) return planner.plan(scopes, cardinalities, to_eliminate, memory);
+    return planner.planWithinBudget(scopes, cardinalities, to_eliminate, memoryBudget, memory);
+}
+
+TableMemory BayesianNetwork::tableMemory(ValueMode mode) const {
+    TableMemory memory;
+    memory.valueBytes = mode == ValueMode::FLOAT ? sizeof(float) : sizeof(double);
+    //eliminateAs converts the initial factors of every step to the values of the other modes
+    memory.convertsInitial = mode != ValueMode::DOUBLE;
+    memory.allocationBytes = [this](size_t bytes) { return arena.bufferBytes(bytes); };
+    return memory;
+}
+
+static std::vector<VarId> sortedUnion(const std::vector<VarId>& a, const std::vector<VarId>& b) {
+    std::vector<VarId> result;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+FactorCache::Key BayesianNetwork::makeCacheKey(const std::vector<VarId>& scope, const FactorOrigin& origin, const ObservedValues& observed) const {
+    FactorCache::Key key;
+    key.scope = scope;
+    key.sources = origin.sources;
+    key.eliminated = origin.eliminated;
+
+    //Only the evidence on the variables of the source CPTs can change the factor
+    std::vector<VarId> touched;
+    for (VarId source : origin.sources) {
+        touched.push_back(source);
+        for (VarId parent : layout.parentsOf(source)) touched.push_back(parent);
+    }
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (VarId var : touched)
+        if (observed[var] != -1) key.evidence.push_back({var, observed[var]});
+    return key;
+}
+
+std::vector<Factor> BayesianNetwork::eliminateVariables(std::vector<Factor> factors, const std::vector<VarId>& order, CacheContext* context) {
+    for (const VarId var_to_eliminate : order) {
         std::vector<Factor> factors_with_var;
         std::vector<Factor> remaining_factors;
+        FactorOrigin merged_origin;
+        std::vector<FactorOrigin> remaining_origins;
 
-        for (const auto& f : factors) {
-            bool found = (std::find(f.variables.begin(), f.variables.end(), var_to_eliminate) != f.variables.end());
-            if (found) factors_with_var.push_back(f);
-            else remaining_factors.push_back(f);
+        //The factors are moved, never copied: each one goes either to the step or to the remaining ones
+        for (size_t i = 0; i < factors.size(); ++i) {
+            if (factors[i].contains(var_to_eliminate)) {
+                factors_with_var.push_back(std::move(factors[i]));
+                if (context) {
+                    merged_origin.sources = sortedUnion(merged_origin.sources, context->origins[i].sources);
+                    merged_origin.eliminated = sortedUnion(merged_origin.eliminated, context->origins[i].eliminated);
+                }
+            } else {
+                remaining_factors.push_back(std::move(factors[i]));
+                if (context) remaining_origins.push_back(std::move(context->origins[i]));
+            }
         }
 
+        factors = std::move(remaining_factors);
+        if (context) context->origins = std::move(remaining_origins);
         if (factors_with_var.empty()) continue;
 
-        Factor product = factors_with_var[0];
-        for (size_t i = 1; i < factors_with_var.size(); ++i)
-            product = factorProduct(product, factors_with_var[i]);
-
-        if (DEBUG) printFactor(product, "Product before summing out " + var_to_eliminate);
-
-        Factor summed_out = factorSumOut(product, var_to_eliminate);
+        Factor summed_out;
+        const Factor* cached = nullptr;
+        FactorCache::Key key;
+        if (context) {
+            merged_origin.eliminated = sortedUnion(merged_origin.eliminated, {var_to_eliminate});
+            std::vector<VarId> scope;
+            for (const auto& f : factors_with_var)
+                for (VarId var : f.variables)
+                    if (var != var_to_eliminate) scope.push_back(var);
+            std::sort(scope.begin(), scope.end());
+            scope.erase(std::unique(scope.begin(), scope.end()), scope.end());
+            key = makeCacheKey(scope, merged_origin, context->observed);
+            cached = context->cache.find(key);
+        }
 
-        if (DEBUG) printFactor(summed_out, "After summing out " + var_to_eliminate);
+        if (cached) {
+            summed_out = *cached;
+        } else {
+            summed_out = eliminateVariable(factors_with_var, var_to_eliminate);
+            if (context) context->cache.insert(key, summed_out);
+        }
 
-        factors = remaining_factors;
-        factors.push_back(summed_out);
+        factors.push_back(std::move(summed_out));
+        if (context) context->origins.push_back(std::move(merged_origin));
     }
     return factors;
 }
 
-Factor BayesianNetwork::combineNormalizeFactors(const std::vector<Factor>& factors) {
-    Factor final_factor = factors[0];
-    for (size_t i = 1; i < factors.size(); ++i) {
-        final_factor = factorProduct(final_factor, factors[i]);
+Factor BayesianNetwork::eliminateVariable(const std::vector<Factor>& factorsWithVar, VarId var) const {
+    Factor summed_out = factorProductSumOut(factorsWithVar, {var});
+
+    if (DEBUG) printFactor(summed_out, "After summing out " + std::string(getVariableName(var)));
+
+    return summed_out;
+}
+
+std::vector<Factor> BayesianNetwork::eliminateVariablesParallel(std::vector<Factor> factors, const std::vector<VarId>& order) {
+    struct Step {
+        VarId var;
+        std::vector<size_t> inputs; //slots of the factors to multiply, in the sequential order
+        size_t output;              //slot of the summed out factor
+        std::vector<size_t> dependents;
+    };
+
+    //Slots 0..factors.size()-1 are the initial factors, then one slot for the result of each step
+    std::vector<Factor> slots = std::move(factors);
+    std::vector<std::vector<VarId>> slot_scopes;
+    std::vector<int> producer; //step writing each slot, -1 for the initial factors
+    for (const auto& f : slots) {
+        slot_scopes.emplace_back(f.variables.begin(), f.variables.end());
+        producer.push_back(-1);
+    }
+
+    std::vector<Step> steps;
+    std::vector<size_t> live; //slots of the factors still alive, in the order of the sequential loop
+    for (size_t i = 0; i < slots.size(); ++i) live.push_back(i);
+
+    for (const VarId var : order) {
+        Step step{var, {}, 0, {}};
+        std::vector<size_t> remaining;
+        for (size_t slot : live) {
+            const auto& scope = slot_scopes[slot];
+            if (std::find(scope.begin(), scope.end(), var) != scope.end()) step.inputs.push_back(slot);
+            else remaining.push_back(slot);
+        }
+        if (step.inputs.empty()) continue;
+
+        std::vector<VarId> scope;
+        for (size_t slot : step.inputs)
+            for (VarId v : slot_scopes[slot])
+                if (v != var) scope.push_back(v);
+        std::sort(scope.begin(), scope.end());
+        scope.erase(std::unique(scope.begin(), scope.end()), scope.end());
+
+        step.output = slot_scopes.size();
+        slot_scopes.push_back(scope);
+        producer.push_back(static_cast<int>(steps.size()));
+        for (size_t slot : step.inputs)
+            if (producer[slot] != -1) steps[producer[slot]].dependents.push_back(steps.size());
+
+        remaining.push_back(step.output);
+        live = remaining;
+        steps.push_back(step);
+    }
+    slots.resize(slot_scopes.size());
+
+    //The ready steps are collected before submitting any, a running step could make another one ready
+    std::vector<std::atomic<size_t>> missing(steps.size());
+    std::vector<size_t> ready;
+    for (size_t s = 0; s < steps.size(); ++s) {
+        size_t count = 0;
+        for (size_t slot : steps[s].inputs)
+            if (producer[slot] != -1) ++count;
+        missing[s] = count;
+        if (count == 0) ready.push_back(s);
     }
 
+    TaskGroup group(*threadPool);
+    std::function<void(size_t)> runStep = [&](size_t s) {
+        const Step& step = steps[s];
+        std::vector<Factor> inputs;
+        for (size_t slot : step.inputs) inputs.push_back(std::move(slots[slot]));
+        slots[step.output] = eliminateVariable(inputs, step.var);
+        for (size_t d : step.dependents)
+            if (--missing[d] == 0) group.run([&runStep, d] { runStep(d); });
+    };
+    for (size_t s : ready) group.run([&runStep, s] { runStep(s); });
+    group.wait();
+
+    std::vector<Factor> result;
+    for (size_t slot : live) result.push_back(std::move(slots[slot]));
+    return result;
+}
+
+Factor BayesianNetwork::combineNormalizeFactors(std::vector<Factor> factors) {
+    //Every variable but the query is already eliminated, so this is just the product
+    Factor final_factor = factors.size() == 1 ? std::move(factors[0]) : factorProductSumOut(factors, {});
+
     if (DEBUG) printFactor(final_factor, "Final unnormalized factor");
 
     final_factor.normalize();
@@ -248,13 +1204,325 @@ Factor BayesianNetwork::combineNormalizeFactors(const std::vector<Factor>& facto
     return final_factor;
 }
 
-Factor BayesianNetwork::calculateMarginal(const std::string& queryVariableName) {
+template <typename Semiring>
+BasicFactor<Semiring> BayesianNetwork::eliminateAs(std::vector<Factor> factors, const std::vector<VarId>& order) {
+    if constexpr (std::is_same_v<Semiring, ProbabilitySemiring<double>>) {
+        if (threadPool) factors = eliminateVariablesParallel(std::move(factors), order);
+        else factors = eliminateVariables(std::move(factors), order);
+        return BasicFactor<Semiring>(factors.size() == 1 ? factors[0] : factorProductSumOut(factors, {}), activeArena);
+    } else {
+        /*
+        The loop of eliminateVariables, where the list of factors is always the initial factors not used
+        yet followed by the results of the steps: the initial ones are kept in factors, as views of the CPTs,
+        and converted only when a step multiplies them, so they never all exist in Value at the same time.
+        */
+        std::vector<BasicFactor<Semiring>> results;
+        for (const VarId var_to_eliminate : order) {
+            std::vector<BasicFactor<Semiring>> factors_with_var, remaining_results;
+            std::vector<Factor> remaining_factors;
+            for (auto& f : factors) {
+                if (f.contains(var_to_eliminate)) factors_with_var.emplace_back(f, activeArena);
+                else remaining_factors.push_back(std::move(f));
+            }
+            for (auto& f : results)
+                (f.contains(var_to_eliminate) ? factors_with_var : remaining_results).push_back(std::move(f));
+            factors = std::move(remaining_factors);
+            results = std::move(remaining_results);
+            if (factors_with_var.empty()) continue;
+            results.push_back(typedFactorProductSumOut(factors_with_var, {var_to_eliminate}, activeArena));
+        }
+
+        std::vector<BasicFactor<Semiring>> last;
+        for (const auto& f : factors) last.emplace_back(f, activeArena);
+        for (auto& f : results) last.push_back(std::move(f));
+        return last.size() == 1 ? std::move(last[0]) : typedFactorProductSumOut(last, {}, activeArena);
+    }
+}
+
+template <typename Semiring>
+Factor BayesianNetwork::marginalAs(std::vector<Factor> factors, VarId queryVar) {
+    BasicFactor<Semiring> marginal;
+    if (lastPlan.cutset.empty()) {
+        marginal = eliminateAs<Semiring>(std::move(factors), lastPlan.order);
+    } else {
+        marginal = BasicFactor<Semiring>({queryVar}, {layout.cardinalities[queryVar]}, activeArena);
+        const std::vector<VarId>& cutset = lastPlan.cutset;
+        std::vector<size_t> assignment(cutset.size(), 0);
+        for (size_t s = 0; s < lastPlan.subproblems; ++s) {
+            //The factors without cutset variables are passed as views, the others are sliced on the assignment
+            ObservedValues fixed(layout.size(), -1);
+            for (size_t c = 0; c < cutset.size(); ++c) fixed[cutset[c]] = static_cast<int>(assignment[c]);
+            std::vector<Factor> sliced;
+            for (const auto& f : factors) {
+                Factor slice(f.variables, f.cardinalities, Span<double>(f.values.begin(), f.values.end()), activeArena);
+                slice.sparse = f.sparse;
+                if (std::any_of(cutset.begin(), cutset.end(), [&](VarId var) { return slice.contains(var); }))
+                    slice = factorReduce(slice, fixed);
+                sliced.push_back(std::move(slice));
+            }
+
+            BasicFactor<Semiring> part = eliminateAs<Semiring>(std::move(sliced), lastPlan.order);
+            for (size_t i = 0; i < marginal.values.size(); ++i)
+                marginal.values[i] = Semiring::plus(marginal.values[i], part.values[i]);
+
+            for (size_t c = cutset.size(); c-- > 0;) {
+                if (++assignment[c] < layout.cardinalities[cutset[c]]) break;
+                assignment[c] = 0;
+            }
+        }
+    }
+
+    marginal.normalize();
+    if (DEBUG) printFactor(marginal.toFactor(), "Final normalized factor");
+    if (std::all_of(marginal.values.begin(), marginal.values.end(), [](auto v) { return v == Semiring::zero(); }))
+        throw std::runtime_error("The evidence has zero probability");
+    return marginal.toFactor();
+}
+
+//The observed variables with their values, the key of possibleEvidence
+static std::vector<std::pair<VarId, int>> observedPairs(const ObservedValues& observed) {
+    std::vector<std::pair<VarId, int>> pairs;
+    for (VarId var = 0; var < observed.size(); ++var)
+        if (observed[var] != -1) pairs.push_back({var, observed[var]});
+    return pairs;
+}
+
+size_t BayesianNetwork::checkPrunedEvidence(const std::vector<bool>& relevantVars, const ObservedValues& observed) {
+    if (observed.empty() || possibleEvidence.count(observedPairs(observed))) return 0;
+    const size_t n = layout.size();
+    std::vector<bool> pruned(n, false);
+    std::queue<VarId> to_visit;
+    for (VarId var = 0; var < n; ++var)
+        if (observed[var] != -1) to_visit.push(var);
+
+    bool any_pruned = false;
+    while (!to_visit.empty()) {
+        VarId current = to_visit.front();
+        to_visit.pop();
+
+        if (pruned[current] || relevantVars[current]) continue;
+        pruned[current] = any_pruned = true;
+
+        for (VarId parent : layout.parentsOf(current))
+            to_visit.push(parent);
+    }
+    if (!any_pruned) return 0;
+
+    //No relevant CPT has a variable in common with a pruned one, so the pruned ones are summed out alone
+    std::vector<Factor> factors = buildInitialFactors(pruned, observed);
+    std::vector<std::vector<VarId>> scopes;
+    std::vector<VarId> to_eliminate;
+    std::vector<bool> seen(n, false);
+    for (const auto& f : factors) {
+        scopes.emplace_back(f.variables.begin(), f.variables.end());
+        for (VarId var : f.variables) {
+            if (seen[var]) continue;
+            seen[var] = true;
+            to_eliminate.push_back(var);
+        }
+    }
+    const std::vector<size_t> cardinalities(layout.cardinalities.begin(), layout.cardinalities.end());
+    TableMemory memory = tableMemory(ValueMode::LOG);
+    for (const auto& f : factors) memory.allocated.push_back(f.values.getArena() != nullptr);
+    EliminationPlan plan = EliminationOrderPlanner(eliminationHeuristic).plan(scopes, cardinalities, to_eliminate, memory);
+    if (memoryBudget != 0 && plan.peakBytes > memoryBudget) {
+        throw std::runtime_error("Checking the evidence needs about " + std::to_string(plan.peakBytes) +
+                                 " bytes, over the memory budget of " + std::to_string(memoryBudget) + " bytes");
+    }
+
+    using Semiring = LogSemiring<double>;
+    BasicFactor<Semiring> likelihood = eliminateAs<Semiring>(std::move(factors), plan.order);
+    if (likelihood.values[0] == Semiring::zero())
+        throw std::runtime_error("The evidence has zero probability");
+    return plan.peakBytes;
+}
+
+Factor BayesianNetwork::computeMarginal(VarId queryVar, const ObservedValues& observed, FactorCache* cache) {
+    //Declared before any factor of the query, so it resets the arena after all of them are destroyed
+    struct ArenaGuard {
+        BayesianNetwork& network;
+        ~ArenaGuard() {
+            network.allocationStats.push_back(network.arena.getStats());
+            network.activeArena = nullptr;
+            network.arena.reset();
+        }
+    } guard{*this};
+    arena.reset();
+    activeArena = &arena;
+
+    //An observed query has all its mass on the observed value
+    if (observed[queryVar] != -1) {
+        //Nothing is relevant, so the check sums out every ancestor of the evidence
+        const size_t check_bytes = checkPrunedEvidence(std::vector<bool>(layout.size(), false), observed);
+        Factor point({queryVar}, {layout.cardinalities[queryVar]});
+        point.values[observed[queryVar]] = 1.0;
+        lastPlan = EliminationPlan();
+        lastPlan.peakBytes = check_bytes;
+        possibleEvidence.insert(observedPairs(observed));
+        return point;
+    }
+
+    std::vector<bool> relevantVars = getRelevantVariables(queryVar, observed);
+    const size_t check_bytes = checkPrunedEvidence(relevantVars, observed);
+
+    std::vector<Factor> factors;
+    std::vector<FactorOrigin> origins;
+    if (cache == nullptr) {
+        factors = buildInitialFactors(relevantVars, observed);
+    } else {
+        //The sliced CPTs are cached too, with no eliminated variables
+        for (VarId var : nameOrder) {
+            if (!relevantVars[var]) continue;
+
+            FactorOrigin origin{{var}, {}};
+            std::vector<VarId> scope;
+            for (VarId parent : layout.parentsOf(var))
+                if (observed[parent] == -1) scope.push_back(parent);
+            if (observed[var] == -1) scope.push_back(var);
+
+            FactorCache::Key key = makeCacheKey(scope, origin, observed);
+            const Factor* cached = cache->find(key);
+            if (cached) factors.push_back(*cached);
+            else {
+                factors.push_back(buildInitialFactor(var, observed));
+                cache->insert(key, factors.back());
+            }
+            origins.push_back(origin);
+        }
+    }
+
+    lastPlan = planElimination(factors, queryVar);
+    //The tables of the check are all freed before the elimination starts
+    lastPlan.peakBytes = std::max(lastPlan.peakBytes, check_bytes);
+    if (memoryBudget != 0 && lastPlan.peakBytes > memoryBudget) {
+        throw std::runtime_error("The query needs about " + std::to_string(lastPlan.peakBytes) +
+                                 " bytes even when conditioning, over the memory budget of " + std::to_string(memoryBudget) + " bytes");
+    }
+
+    //The other value modes and the conditioning on a cutset work on BasicFactor, neither uses the cache
+    Factor marginal;
+    if (valueMode == ValueMode::FLOAT) {
+        marginal = marginalAs<ProbabilitySemiring<float>>(std::move(factors), queryVar);
+    } else if (valueMode == ValueMode::LOG) {
+        marginal = marginalAs<LogSemiring<double>>(std::move(factors), queryVar);
+    } else if (!lastPlan.cutset.empty()) {
+        marginal = marginalAs<ProbabilitySemiring<double>>(std::move(factors), queryVar);
+    } else {
+        if (cache != nullptr) {
+            CacheContext context{*cache, observed, std::move(origins)};
+            factors = eliminateVariables(std::move(factors), lastPlan.order, &context);
+        } else if (threadPool) {
+            factors = eliminateVariablesParallel(std::move(factors), lastPlan.order);
+        } else {
+            factors = eliminateVariables(std::move(factors), lastPlan.order);
+        }
+
+        Factor combined = combineNormalizeFactors(std::move(factors));
+        if (std::all_of(combined.values.begin(), combined.values.end(), [](double v) { return v == 0.0; }))
+            throw std::runtime_error("The evidence has zero probability");
+        //A copy, so the marginal does not point into the arena reset by the guard
+        marginal = Factor(combined);
+    }
+
+    /*
+    The pruned CPTs share no variable with the relevant ones, so P(observed) is the product of the
+    likelihood of each part: both are nonzero now, and so is P(observed) for any other query.
+    */
+    possibleEvidence.insert(observedPairs(observed));
+    return marginal;
+}
+
+Factor BayesianNetwork::calculateMarginal(const std::string& queryVariableName, const Evidence& evidence) {
     if (DEBUG)
         std::cout << "\n[DEBUG] Starting marginal computation for variable: " << queryVariableName << "\n";
 
-    std::set<std::string> relevantVars = getRelevantVariables(queryVariableName, nodes);
+    allocationStats.clear();
+    return computeMarginal(getVarId(queryVariableName), resolveEvidence(evidence), nullptr);
+}
+
+std::vector<Factor> BayesianNetwork::calculateMarginals(const std::vector<Query>& queries) {
+    std::vector<Factor> marginals;
+    marginals.reserve(queries.size());
+    allocationStats.clear();
+    //The cache holds double factors, the other value modes answer every query from scratch
+    FactorCache* cache = valueMode == ValueMode::DOUBLE ? &factorCache : nullptr;
+    for (const auto& query : queries)
+        marginals.push_back(computeMarginal(getVarId(query.variable), resolveEvidence(query.evidence), cache));
+    return marginals;
+}
 
-    std::vector<Factor> factors = buildInitialFactors(relevantVars);
-    factors = eliminateVariables(factors, queryVariableName);
-    return combineNormalizeFactors(factors);
-}
\ No newline at end of file
+CacheStats BayesianNetwork::getCacheStats() const {
+    return factorCache.getStats();
+}
+
+void BayesianNetwork::clearCache() {
+    factorCache.clear();
+}
+
+const std::vector<AllocationStats>& BayesianNetwork::getAllocationStats() const {
+    return allocationStats;
+}
+
+void BayesianNetwork::setThreadCount(size_t threads) {
+    if (threads <= 1) threadPool.reset();
+    else if (!threadPool || threadPool->getThreadCount() != threads) threadPool = std::make_unique<ThreadPool>(threads);
+}
+
+size_t BayesianNetwork::getThreadCount() const {
+    return threadPool ? threadPool->getThreadCount() : 1;
+}
+
+void BayesianNetwork::setParallelThreshold(size_t entries) {
+    parallelThreshold = entries;
+}
+
+size_t BayesianNetwork::getParallelThreshold() const {
+    return parallelThreshold;
+}
+
+void BayesianNetwork::setSparseThreshold(double density) {
+    sparseThreshold = density;
+    buildSparseCPTs();
+}
+
+double BayesianNetwork::getSparseThreshold() const {
+    return sparseThreshold;
+}
+
+SparseStats BayesianNetwork::getSparseStats() const {
+    std::lock_guard<std::mutex> lock(sparseStatsMutex);
+    return sparseStats;
+}
+
+void BayesianNetwork::resetSparseStats() {
+    std::lock_guard<std::mutex> lock(sparseStatsMutex);
+    sparseStats = SparseStats();
+}
+
+void BayesianNetwork::setValueMode(ValueMode mode) {
+    valueMode = mode;
+}
+
+ValueMode BayesianNetwork::getValueMode() const {
+    return valueMode;
+}
+
+void BayesianNetwork::setMemoryBudget(size_t bytes) {
+    memoryBudget = bytes;
+}
+
+size_t BayesianNetwork::getMemoryBudget() const {
+    return memoryBudget;
+}
+
+void BayesianNetwork::setEliminationHeuristic(EliminationHeuristic heuristic) {
+    eliminationHeuristic = heuristic;
+}
+
+EliminationHeuristic BayesianNetwork::getEliminationHeuristic() const {
+    return eliminationHeuristic;
+}
+
+const EliminationPlan& BayesianNetwork::getLastEliminationPlan() const {
+    return lastPlan;
+}
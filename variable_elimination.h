@@ -1,71 +1,382 @@
 #pragma once
 
 #include "parser.h"
+#include "small_vector.h"
+#include "elimination_order.h"
+#include "thread_pool.h"
+#include "factor_arena.h"
+#include "symbol_table.h"
+#include "semiring.h"
 
 #include <memory>
+#include <mutex>
 #include <set>
 
-class Node;
+//A read-only view of consecutive elements of an array, like the std::span of C++20
+template <typename T>
+class Span {
+public:
+    Span() : first(nullptr), last(nullptr) {}
+    Span(const T* first, const T* last) : first(first), last(last) {}
+    explicit Span(const std::vector<T>& elements) : first(elements.data()), last(elements.data() + elements.size()) {}
+
+    const T* begin() const { return first; }
+    const T* end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    const T& operator[](size_t i) const { return first[i]; }
+
+private:
+    const T* first;
+    const T* last;
+};
+
+/*
+    The network in flat arrays indexed by VarId (compressed rows), so a traversal reads a few
+    contiguous arrays instead of following pointers from node to node.
+    The parents of var are parents[parentOffsets[var]] ... parents[parentOffsets[var + 1] - 1],
+    and in the same way the children and the values. For A -> C <- B:
+        cardinalities = [2, 2, 3]
+        parentOffsets = [0, 0, 0, 2]    parents  = [0, 1]
+        childOffsets  = [0, 1, 2, 2]    children = [2, 2]
+    cptData[var] points to the cptSizes[var] entries of the CPT of var.
+    The CPT of a variable is over its parents, in the order of its probability block, and the
+    variable itself last, changing fastest: the layout of a Factor over the same variables.
+
+    cardinalities, parentOffsets, parents and the CPTs are views, so they can be read in place
+    from the sections of a compiled network (see readCompiledNetwork), which storage keeps alive.
+    A network built from parsed blocks keeps the first three in the vectors below, and the CPTs in
+    an arena of big blocks: a table is copied in the arena as soon as its block is parsed, so the
+    tables are never all stored twice, whatever the order of the blocks.
+*/
+struct NetworkLayout {
+    static constexpr size_t CPT_BLOCK_ENTRIES = 1 << 16; //bigger tables get a block of their own
 
-struct CPT {
-    std::vector<Node*> parents; 
-    std::vector<double> table;
+    std::vector<SymbolId> names;      //in the SymbolTable of the network
+    Span<size_t> cardinalities;
+    std::vector<size_t> valueOffsets;
+    std::vector<SymbolId> values;
+    Span<size_t> parentOffsets;
+    Span<VarId> parents;
+    std::vector<size_t> childOffsets;
+    std::vector<VarId> children;      //sorted by VarId
+    std::vector<const double*> cptData;
+    std::vector<size_t> cptSizes;
+
+    std::vector<size_t> cardinalityList;
+    std::vector<size_t> parentOffsetList;
+    std::vector<VarId> parentList;
+    std::vector<std::unique_ptr<double[]>> cptBlocks;
+    double* cptNext = nullptr;        //the free entries of the current block
+    size_t cptBlockFree = 0;
+    std::shared_ptr<const void> storage; //what the views point to when it is not in the vectors above
+
+    //Copies entries to the end of the arena and returns where they are
+    const double* storeCPT(const double* entries, size_t size);
+    //Fills childOffsets and children from the parents, each list sorted
+    void linkChildren();
+
+    size_t size() const;
+    Span<SymbolId> valuesOf(VarId var) const;
+    Span<VarId> parentsOf(VarId var) const;
+    Span<VarId> childrenOf(VarId var) const;
+    Span<double> cptOf(VarId var) const;
 };
 
-class Node {
+/*
+    The table of a Factor: either a vector of its own or a read-only view of a table which
+    outlives the factor, like a CPT of the network, so building a factor over a CPT copies nothing.
+    Reading through the const functions never copies. The first non-const access to a view copies
+    it into a vector of its own (copy on write), with the allocator given to the view.
+    Copying a view gives another view of the same table.
+*/
+class FactorValues {
 public:
-    std::string name;
-    std::vector<std::string> domain;
-    CPT cpt;
-    
-    std::vector<Node*> children;
+    typedef std::vector<double, ArenaAllocator<double>> Storage;
+
+    FactorValues() = default;
+    explicit FactorValues(const ArenaAllocator<double>& allocator)
+        : owned(allocator) {}
+    FactorValues(Span<double> table, const ArenaAllocator<double>& allocator)
+        : owned(allocator), first(table.begin()), count(table.size()), viewing(true) {}
+
+    FactorValues(const FactorValues& other);
+    FactorValues(FactorValues&& other) noexcept;
+    FactorValues& operator=(const FactorValues& other);
+    FactorValues& operator=(FactorValues&& other) noexcept;
+
+    bool isView() const { return viewing; }
+    //The arena holding the table, null for a view or a table on the heap
+    FactorArena* getArena() const { return viewing ? nullptr : owned.get_allocator().getArena(); }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
 
-    Node(const std::string& name, const std::vector<std::string>& domain);
+    const double* data() const { return first; }
+    const double& operator[](size_t i) const { return first[i]; }
+    const double* begin() const { return first; }
+    const double* end() const { return first + count; }
 
-    size_t getCardinality() const;
+    double* data() { return mutableData(); }
+    double& operator[](size_t i) { return mutableData()[i]; }
+    double* begin() { return mutableData(); }
+    double* end() { return mutableData() + count; }
+
+    void resize(size_t size, double value);
+
+private:
+    Storage owned;
+    const double* first = nullptr; //owned.data() or the viewed table
+    size_t count = 0;
+    bool viewing = false;
+
+    double* mutableData() {
+        if (viewing) materialize();
+        return owned.data();
+    }
+    void materialize();
+};
+
+/*
+    The nonzero entries of a factor table in a compressed block format.
+    The table is cut in blocks of blockSize consecutive entries, one for each assignment of all the
+    variables but the last; the nonzero entries of block b are first[b] to first[b + 1] - 1, each one
+    with its position inside the block (the value of the last variable) and its value.
+    Deterministic CPTs (tables of 0s and 1s, one nonzero entry per block) and CPTs with large zero
+    regions are mostly zeros, and a kernel with a sparse operand only visits its nonzero entries.
+*/
+struct SparseTable {
+    size_t size = 0;      //entries of the dense table, zeros included
+    size_t blockSize = 1;
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> positions;
+    std::vector<double> values;
+    bool deterministic = false; //every nonzero value is 1, so multiplying by it can be skipped
+
+    size_t nonzeros() const { return values.size(); }
+    double density() const;
+};
+//blockSize must divide size, tables with 2^32 entries or more are not supported
+SparseTable makeSparseTable(const double* values, size_t size, size_t blockSize);
+
+//The work of the kernels which had a sparse operand, see BayesianNetwork::getSparseStats
+struct SparseStats {
+    size_t operations = 0;
+    size_t products = 0; //terms the dense kernels would have computed in those operations
+    size_t skipped = 0;  //terms which were not computed because the sparse operand is 0 there
 };
 
 /*
     A factor is a table which maps combinations of variable values to probabilities.
     In this program a factor will be used to represent the intermediate CPT of the operations done to marginalize a variable.
+    Variables are identified by their VarId, and cardinalities and strides are kept in the same
+    positions as the variables, so no lookup by name is ever needed.
     For example, a factor could represent
-        - variables = ["A", "B"]
-        - cardinalities = {"A": 2, "B": 3} // A has 2 values, B has 3 values
+        - variables = [0, 1] // A has id 0, B has id 1
+        - cardinalities = [2, 3] // A has 2 values, B has 3 values
+        - strides = [3, 1]
         - values = [0.1, 0.2, 0.3, 0.4, 0.5, 0.6]
+    The last variable is the one that changes fastest in values.
+    The values can live in a FactorArena, see ArenaAllocator: moving a factor keeps them there,
+    copying it always makes a heap copy. They can also be a view of a CPT, see FactorValues.
 */
 struct Factor {
-    std::vector<std::string> variables;
-    std::vector<double> values;
-    std::map<std::string, size_t> cardinalities; //number of elements in the domain for each variable
-    std::map<std::string, size_t> strides;
+    static constexpr size_t INLINE_VARIABLES = 8;
+    typedef SmallVector<VarId, INLINE_VARIABLES> VarList;
+    typedef SmallVector<size_t, INLINE_VARIABLES> SizeList;
+    typedef FactorValues ValueList;
 
-    Factor(const std::vector<std::string>& vars, const std::map<std::string, size_t>& cards);
+    VarList variables;
+    SizeList cardinalities; //number of elements in the domain of variables[i]
+    SizeList strides;
+    ValueList values;
+    /*
+    The nonzero entries of values when the factor is sparse enough, null otherwise.
+    Only the factors of the CPTs and their evidence slices get one: building it for the results
+    of products and sum-outs, which are rarely sparse, costs more than it saves.
+    It is shared by the copies of a factor, so code writing into values must reset it (normalize does).
+    */
+    std::shared_ptr<const SparseTable> sparse;
+
+    Factor() = default;
+    Factor(const VarList& vars, const SizeList& cards, FactorArena* arena = nullptr);
+    //A view of table, which must outlive the factor; arena is used if the values are ever written
+    Factor(const VarList& vars, const SizeList& cards, Span<double> table, FactorArena* arena = nullptr);
 
-    std::map<std::string, size_t> getAssignment(size_t index) const;
     void initialise_indexes();
-    size_t getIndex(const std::map<std::string, size_t>& assignment) const;
-    double getValue(const std::map<std::string, size_t>& assignment) const;
+
+    //Position of var inside variables, -1 if the factor does not contain it
+    int indexOf(VarId var) const;
+    bool contains(VarId var) const;
+
+    //assignment[i] is the value of variables[i]
+    void getAssignment(size_t index, SizeList& assignment) const;
+    size_t getIndex(const SizeList& assignment) const;
+    double getValue(const SizeList& assignment) const;
 
     void normalize();
 };
 
+//A factor with the values of a semiring, see typed_factor.h
+template <typename Semiring>
+struct BasicFactor;
+
+//Observed values, from the name of a variable to the name of its value, e.g. {"xray": "yes"}
+typedef std::map<std::string, std::string> Evidence;
+
+//Index of the observed value of each variable, indexed by VarId, -1 for unobserved variables
+typedef std::vector<int> ObservedValues;
+
+//One marginal query of a batch: P(variable | evidence)
+struct Query {
+    std::string variable;
+    Evidence evidence;
+};
+
+struct CacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t entries = 0;
+};
+
+//The CPTs multiplied into an intermediate factor and the variables summed out of it
+struct FactorOrigin {
+    std::vector<VarId> sources;    //sorted
+    std::vector<VarId> eliminated; //sorted
+};
+
+/*
+    Cache of the intermediate factors of variable elimination, shared by the queries of a batch.
+    An intermediate factor is identified by its scope, the variables summed out of it and the
+    evidence it was sliced with. The scope alone does not tell which CPTs were multiplied,
+    so the key also keeps the sources of the factor, and the evidence is restricted to the
+    variables of those CPTs: two queries with different evidence elsewhere still share the factor.
+*/
+class FactorCache {
+public:
+    struct Key {
+        std::vector<VarId> scope;
+        std::vector<VarId> sources;
+        std::vector<VarId> eliminated;
+        std::vector<std::pair<VarId, int>> evidence;
+
+        bool operator<(const Key& other) const;
+    };
+
+    //Counts a hit or a miss, the pointer is valid until the next insert or clear
+    const Factor* find(const Key& key);
+    void insert(const Key& key, const Factor& factor);
+    void clear();
+    CacheStats getStats() const;
+
+private:
+    std::map<Key, Factor> entries;
+    CacheStats stats;
+};
+
 class BayesianNetwork {
 private:
-    std::map<std::string, std::unique_ptr<Node>> nodes; //Unique pointer are because Node are heavy
+    static constexpr VarId NO_VARIABLE = UINT32_MAX;
+
+    NetworkLayout layout;
+    std::string networkName;
+    SymbolTable symbols;               //the names of the variables and of their values
+    std::vector<VarId> varOfSymbol;    //by SymbolId, NO_VARIABLE for the names of values; a redeclared name keeps its last variable
+    std::vector<VarId> nameOrder;      //the variables of varOfSymbol, sorted by name
+
+    EliminationHeuristic eliminationHeuristic = EliminationHeuristic::MIN_FILL;
+    EliminationPlan lastPlan;
+    FactorCache factorCache;
+    //The evidence of the queries answered so far, as (variable, value) pairs: it has a nonzero
+    //probability, so checkPrunedEvidence is skipped for it
+    std::set<std::vector<std::pair<VarId, int>>> possibleEvidence;
+    std::unique_ptr<ThreadPool> threadPool; //null when the elimination is sequential
+    size_t parallelThreshold = 1 << 20;     //factors with fewer entries are never split between threads
+    double sparseThreshold = 0.5;           //factors with at most this fraction of nonzero entries get a SparseTable
+    std::vector<std::shared_ptr<const SparseTable>> sparseCPTs; //by VarId, null for the dense CPTs
+    mutable std::mutex sparseStatsMutex;
+    mutable SparseStats sparseStats;
+    ValueMode valueMode = ValueMode::DOUBLE;
+    size_t memoryBudget = 0;                //bytes for the factors of a query, 0 for no limit
+
+    FactorArena arena;                         //the tables of the query being answered, reset after it
+    FactorArena* activeArena = nullptr;        //&arena during a query, the kernels allocate their results from it
+    std::vector<AllocationStats> allocationStats;
+
+    //What eliminateVariables needs to look up and store intermediate factors in a FactorCache
+    struct CacheContext {
+        FactorCache& cache;
+        const ObservedValues& observed;
+        std::vector<FactorOrigin> origins; //origins[i] describes the i-th factor being eliminated
+    };
+
+    /*
+        Fills the network block by block, as the Parser reads them or from a NetworkAST.
+        Until finish() the domains and parents of the variables are kept in vectors of their own,
+        then they are packed into the layout. The tables go into the arena of the layout at once.
+        A probability may name variables declared after it: from the first such probability on,
+        the probabilities wait for the end of the input, so the variables are linked in the same
+        order whatever the order of the blocks.
+    */
+    class Builder : public NetworkListener {
+    public:
+        explicit Builder(BayesianNetwork& network);
+
+        void onNetwork(std::string name) override;
+        void onVariable(Variable&& variable) override;
+        void onProbability(Probability&& probability) override;
+        void onSymbols(SymbolTable&& symbols) override;
+
+        //Links the waiting probabilities and builds the layout, throws if a probability names an unknown variable
+        void finish();
+
+    private:
+        BayesianNetwork& network;
+        std::vector<Probability> pending;
+        std::vector<std::vector<SymbolId>> domains; //by VarId
+        std::vector<std::vector<VarId>> parents;
+
+        bool isDeclared(const Probability& probability) const;
+        void addProbability(Probability&& probability);
+    };
 
     private:
-        void build(const NetworkAST& parsedNetwork);
+        void build(NetworkAST&& parsedNetwork);
+        //Sorts the variables by name and builds the sparse CPTs, once the layout and varOfSymbol are complete
+        void indexVariables();
+        //NO_VARIABLE if no variable has this name
+        VarId findVariable(SymbolId name) const;
     
         /*
-        This function is a breath-first search to find all relevant variables in the network.
-        It starts from the query variable and explores all its parents.
-        I am not sure the bfs is the best "order" to traverse the network.
+        This function finds the variables whose CPT is needed to answer P(queryVar | observed).
+        1. Barren nodes are removed: only ancestors of the query and of the evidence are kept.
+        2. Among those, a Bayes-ball visit starting from the query marks the nodes whose CPT is requisite.
+           The ball passes through unobserved nodes and bounces back on observed ones, so the nodes
+           d-separated from the query by the evidence are never marked.
+        With no evidence the result is exactly the set of ancestors of the query.
+        */
+        std::vector<bool> getRelevantVariables(VarId queryVar, const ObservedValues& observed) const;
+
+        /*
+        The CPTs dropped by getRelevantVariables do not change P(queryVar | observed), but they can still
+        make the evidence impossible. This sums out the ancestors of the evidence that are not relevant
+        (in log space, so a long product does not underflow) and throws if the evidence has zero probability.
+        Returns the estimated peak bytes of that elimination, 0 when there is nothing to sum out, and
+        throws before allocating anything when they are over the memory budget.
+        Evidence found in possibleEvidence is not checked again.
+        */
+        size_t checkPrunedEvidence(const std::vector<bool>& relevantVars, const ObservedValues& observed);
+
+        /*
+        Orders every variable appearing in factors except queryVar with the current heuristic.
+        With a memory budget the plan may condition on a cutset, see EliminationOrderPlanner::planWithinBudget.
         */
-        std::set<std::string> getRelevantVariables(const std::string& queryVar, const std::map<std::string, std::unique_ptr<Node>>& nodes);
-        std::vector<Factor> buildInitialFactors(const std::set<std::string>& relevantVars);
+        EliminationPlan planElimination(const std::vector<Factor>& factors, VarId queryVar) const;
+        //How the elimination allocates the tables of mode from arena
+        TableMemory tableMemory(ValueMode mode) const;
 
         /*
         This is the heart of the calculateMarginal function.
+        Variables are eliminated in the given order, see EliminationOrderPlanner.
         1. Take the factors that contains variables to eliminate
         2. Compute the product of them
         3. Sum-Out
@@ -74,7 +385,7 @@ private:
             f1: ["A", "B"] [0.1, 0.2, 0.3, 0.4]
             f2: ["B", "C"] [0.5, 0.6, 0.7, 0.8]
             queryVar = "A"
-            So variables to eliminate are "B", "C"
+            So variables to eliminate are "B", "C", suppose the order is ["C", "B"]
 
             Elimination of "C":
                 1. Only f2 contains C
@@ -88,12 +399,132 @@ private:
             result: ["A"] [0.33, 0.67]
 
         */
-        std::vector<Factor> eliminateVariables(std::vector<Factor> factors, const std::string& queryVariableName);
-        Factor combineNormalizeFactors(const std::vector<Factor>& factors);
+        std::vector<Factor> eliminateVariables(std::vector<Factor> factors, const std::vector<VarId>& order, CacheContext* context = nullptr);
+
+        //One step of the elimination: the product of the factors containing var, with var summed out
+        Factor eliminateVariable(const std::vector<Factor>& factorsWithVar, VarId var) const;
+
+        /*
+        The same eliminations of eliminateVariables, run on the thread pool.
+        The order is first simulated on the scopes only, which gives for every step the factors it
+        multiplies (in the same order the sequential loop would use) and the steps producing them.
+        A step is submitted as soon as all the steps it depends on are done, so eliminations in
+        different branches of the elimination tree run at the same time.
+        Since every step does exactly the same operations of the sequential loop on the same inputs,
+        the result is bit-identical to eliminateVariables.
+        */
+        std::vector<Factor> eliminateVariablesParallel(std::vector<Factor> factors, const std::vector<VarId>& order);
+        Factor combineNormalizeFactors(std::vector<Factor> factors);
+
+        /*
+        The eliminations of order in the values of Semiring, returning the product of the factors left
+        over (not normalized). ProbabilitySemiring<double> runs the Factor kernels and converts the result,
+        the others convert each initial factor to BasicFactor<Semiring> (see typed_factor.h) only when a
+        step multiplies it, and run on one thread.
+        */
+        template <typename Semiring>
+        BasicFactor<Semiring> eliminateAs(std::vector<Factor> factors, const std::vector<VarId>& order);
+
+        /*
+        The normalized marginal of queryVar from factors with lastPlan, in the values of Semiring.
+        With a cutset every assignment of it is a sub-problem: the factors are sliced on the assignment,
+        the rest of the variables eliminated, and the unnormalized results of all the sub-problems added up.
+        Throws if the evidence has zero probability.
+        */
+        template <typename Semiring>
+        Factor marginalAs(std::vector<Factor> factors, VarId queryVar);
+
+        /*
+        Calls body on consecutive chunks [begin, end) covering [0, size).
+        When there is a thread pool and size reaches parallelThreshold the chunks run on the pool,
+        otherwise body is called once on the whole range.
+        */
+        void parallelFor(size_t size, const std::function<void(size_t, size_t)>& body) const;
+
+        //Factors smaller than this are never sparse, the dense kernels are faster on them
+        static constexpr size_t SPARSE_MIN_ENTRIES = 16;
+        /*
+        The costs used to choose between the sparse and the dense kernels, relative to one term of
+        the dense odometer kernels (a product of the factors added to an entry of the result).
+        */
+        static constexpr double SIMD_ENTRY_COST = 0.3;   //an entry of the SIMD sum-out and broadcast kernels
+        static constexpr double SPARSE_BLOCK_COST = 1.5; //a block of a SparseTable, empty or not
+        static constexpr double SPARSE_TERM_COST = 1.5;
+        /*
+        The factor whose sparse walk is the cheapest for a product of productSize entries,
+        factors.size() when the dense kernel, costing denseCost, is cheaper than all of them.
+        This is the automatic switch between the formats: sparseThreshold only limits which tables get a SparseTable.
+        */
+        static size_t chooseSparseDriver(const std::vector<const Factor*>& factors, size_t productSize, double denseCost);
+        //A SparseTable of values if at most sparseThreshold of them are nonzero, null otherwise
+        std::shared_ptr<const SparseTable> sparseTableOf(const double* values, size_t size, size_t blockSize) const;
+        //Sets or resets factor.sparse, depending on the fraction of nonzero entries of its values
+        void updateSparse(Factor& factor) const;
+        void buildSparseCPTs();
+        void countSparseWork(size_t products, size_t computed) const;
+
+        /*
+        factorProductSumOut with at most one summed variable (NO_VARIABLE for none), when factors[s] is sparse.
+        Every nonzero entry of factors[s] is combined with all the assignments of the variables it does not
+        contain, and its terms are added to their entries of result, which must be zero when called.
+        The terms of an entry are still added in the order of the values of the summed variable, and the
+        skipped terms are exact zeros, so result is bit-identical to the one of the dense kernels
+        (on tables of finite, non negative values).
+        */
+        void sparseProductSumOut(const std::vector<const Factor*>& factors, size_t s, VarId summedVar, Factor& result) const;
+
+        FactorCache::Key makeCacheKey(const std::vector<VarId>& scope, const FactorOrigin& origin, const ObservedValues& observed) const;
+
+        /*
+        The whole pipeline of calculateMarginal, sharing factors through cache when it is not null.
+        Every factor is moved from one step to the next, and their tables come from arena,
+        which is reset when the query ends. The returned marginal is a heap copy.
+        */
+        Factor computeMarginal(VarId queryVar, const ObservedValues& observed, FactorCache* cache);
 public:
     BayesianNetwork(const NetworkAST& parsedNetwork);
+    //Takes the probabilities one at a time: each table is copied into the layout with storeCPT and freed
+    BayesianNetwork(NetworkAST&& parsedNetwork);
+    /*
+    Streaming: the network is built while parser reads the input, every table is copied into
+    the layout with storeCPT as soon as its block ends, so the whole NetworkAST never exists.
+    */
+    explicit BayesianNetwork(Parser& parser);
+    /*
+    A network over a layout whose arrays are already packed, as readCompiledNetwork builds it:
+    the views of layout are kept as they are, only childOffsets and children are filled.
+    */
+    BayesianNetwork(std::string name, SymbolTable&& symbols, NetworkLayout&& packedLayout);
+
+    const std::string& getName() const;
+    const NetworkLayout& getLayout() const;
+    size_t getVariableCount() const;
+    size_t getCardinality(VarId id) const;
+    bool containsVariable(std::string_view name) const;
+
+    //Names are only needed to print, everything else works on VarIds and value indexes
+    const SymbolTable& getSymbols() const;
+    std::string_view getVariableName(VarId id) const;
+    std::string_view getValueName(VarId id, size_t value) const;
+
+    //Throws if the network has no variable with this name
+    VarId getVarId(std::string_view name) const;
+
+    /*
+    The string-keyed view of a factor entry, only meant for printing.
+    It maps the name of each variable of the factor to the index of its value in the domain.
+    */
+    std::map<std::string, size_t> getAssignment(const Factor& f, size_t index) const;
+
+    //Throws if a variable or a value of the evidence is not in the network
+    ObservedValues resolveEvidence(const Evidence& evidence) const;
 
-    const Node* getNode(const std::string& name) const;
+    /*
+    One factor for the CPT of each variable with relevantVars[id] set, in the order of the node names.
+    Observed variables are sliced out of the factors, so they never reach the elimination.
+    */
+    std::vector<Factor> buildInitialFactors(const std::vector<bool>& relevantVars, const ObservedValues& observed = {}) const;
+    Factor buildInitialFactor(VarId var, const ObservedValues& observed = {}) const;
 
     /*
     This function "merges" two factors into one.
@@ -104,7 +535,7 @@ public:
         It maps, for example, the assignment (A=0, B=1, C=0) to the value
             f1(A=0, B=1)*f2(B=1, C=0) = 0.2 * 0.7 = 0.14  
     */
-    Factor factorProduct(const Factor& f1, const Factor& f2);
+    Factor factorProduct(const Factor& f1, const Factor& f2) const;
 
     /*
     This function sums out a variable from a factor.
@@ -114,11 +545,101 @@ public:
         r: ["A"]        [0.1 + 0.2, 0.3 + 0.4] = [0.3, 0.7]
 
     */
-    Factor factorSumOut(const Factor& factor, const std::string& varToSumOut);
+    Factor factorSumOut(const Factor& factor, VarId varToSumOut) const;
+
+    /*
+    The product of all the factors with varsToSumOut summed out, without building the product.
+    Every entry of the result walks the assignments of the summed variables, multiplies the
+    matching entries of the factors from left to right and adds them, so the memory used is
+    the size of the result instead of the size of the product.
+    For example, summing out B:
+        f1: ["A", "B"] [0.1, 0.2, 0.3, 0.4]
+        f2: ["B"]      [0.5, 0.6]
+         r: ["A"]      [0.1*0.5 + 0.2*0.6, 0.3*0.5 + 0.4*0.6] = [0.17, 0.39]
+    With a single summed variable the values are bit-identical to chaining factorProduct
+    and then calling factorSumOut. varsToSumOut can be empty, which gives the plain product.
+    */
+    Factor factorProductSumOut(const std::vector<Factor>& factors, const Factor::VarList& varsToSumOut) const;
+
+    /*
+    This function keeps only the entries of a factor where var has the given value, and removes var.
+    For example, with B=1:
+        f: ["A", "B"]   [0.1, 0.2, 0.3, 0.4]
+        r: ["A"]        [0.2, 0.4]
+    */
+    Factor factorReduce(const Factor& factor, VarId var, size_t value) const;
+    //The same for every variable with values[var] != -1 at once, so the partial slices are never allocated
+    Factor factorReduce(const Factor& factor, const ObservedValues& values) const;
+
+    //Sums out every variable of factor which is not in keep
+    Factor factorMarginalize(const Factor& factor, const Factor::VarList& keep) const;
+
+    //This is the main function for the implementation of the algorithm, it computes P(query | evidence)
+    Factor calculateMarginal(const std::string& queryVariableName, const Evidence& evidence = {});
+
+    /*
+    Answers many queries, in order, sharing the intermediate factors through a cache.
+    The cache survives between calls, so later batches reuse the factors of earlier ones.
+    */
+    std::vector<Factor> calculateMarginals(const std::vector<Query>& queries);
+    CacheStats getCacheStats() const;
+    void clearCache();
+
+    //The factor table allocations of each query answered by the last call to calculateMarginal(s)
+    const std::vector<AllocationStats>& getAllocationStats() const;
+
+    /*
+    Number of threads used by calculateMarginal and by the kernels on big factors,
+    1 (the default) means sequential elimination.
+    The batch API stays sequential because its cache is shared by all the steps.
+    */
+    void setThreadCount(size_t threads);
+    size_t getThreadCount() const;
+
+    /*
+    factorProduct and factorSumOut split their output between the threads when it has at least
+    this many entries. Every entry is still computed in the same way, so the results do not change.
+    */
+    void setParallelThreshold(size_t entries);
+    size_t getParallelThreshold() const;
+
+    /*
+    CPTs (and their evidence slices) with at most this fraction of nonzero entries get a SparseTable,
+    and the kernels skip their zeros whenever that is estimated to be faster than the dense kernel;
+    0 disables the sparse kernels. The results do not change.
+    */
+    void setSparseThreshold(double density);
+    double getSparseThreshold() const;
+    //Counted since the network was built or the last resetSparseStats
+    SparseStats getSparseStats() const;
+    void resetSparseStats();
+
+    /*
+    The values the eliminations of calculateMarginal(s) compute with, see ValueMode.
+    FLOAT halves the memory of the tables, LOG never underflows on long chains of small probabilities.
+    Both are sequential and skip the cache and the sparse tables; the initial factors and the
+    elimination order are the same of DOUBLE, so only the rounding of the results changes.
+    */
+    void setValueMode(ValueMode mode);
+    ValueMode getValueMode() const;
+
+    /*
+    Bytes available for the factors of a query, 0 (the default) for no limit.
+    Before eliminating, the peak memory of the plan is estimated from the scopes, with every table
+    rounded up as the arena allocates it (see EliminationPlan::peakBytes): when it is over the budget
+    the query conditions on a cutset and solves the sub-problems one after the other, and when even
+    that does not fit it throws before allocating any table. The estimate follows the steps one at a
+    time, with a thread pool the independent steps can also be alive together.
+    */
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget() const;
+
+    void setEliminationHeuristic(EliminationHeuristic heuristic);
+    EliminationHeuristic getEliminationHeuristic() const;
 
-    //This is the main function for the implementation of the algorithm
-    Factor calculateMarginal(const std::string& queryVariableName);
+    //The plan used by the last call to calculateMarginal, with its induced width and largest factor size
+    const EliminationPlan& getLastEliminationPlan() const;
 
     //This function is only for debug
-    void printFactor(const Factor& f, const std::string& label = "");
+    void printFactor(const Factor& f, const std::string& label = "") const;
 };
\ No newline at end of file